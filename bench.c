@@ -0,0 +1,517 @@
+/*********************************************************************
+ *
+ *   LPC ISP - Flashing throughput benchmark
+ *
+ * Run the flash, dump and erase operations of lpcprog against lpcisp-sim for each
+ * part of a parts description file, at several baudrates and with several image
+ * fill patterns, and report throughput, link use, round trips and the time spent
+ * in each ISP command.
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+#include <stdlib.h> /* malloc, free, rand */
+#include <stdio.h>
+#include <stdint.h>
+
+#include <unistd.h> /* fork, dup, close */
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <string.h> /* strncmp, strlen, strdup */
+
+#include "isp_utils.h"
+#include "isp_transport.h"
+#include "isp_commands.h"
+#include "prog_commands.h"
+#include "parts.h"
+
+#define PROG_NAME "LPC ISP flashing benchmark"
+#define VERSION   "1.07"
+
+
+void help(char *prog_name)
+{
+	fprintf(stderr, "---------------- "PROG_NAME" --------------------------------\n");
+	fprintf(stderr, "Usage: %s [options]\n" \
+		"  Flash an image, dump it and erase the flash of each part of the parts description\n" \
+		"  file, simulated by lpcisp-sim, for each baudrate and image fill pattern.\n" \
+		"  Available options:\n" \
+		"  \t -p | --parts=file : Parts description file (default ./lpctools_parts.def)\n" \
+		"  \t -s | --sim=path : lpcisp-sim program (default ./lpcisp-sim)\n" \
+		"  \t -i | --part=id : only this part (can be given more than once)\n" \
+		"  \t -b | --baudrates=N,N,.. : baudrates (default 115200,460800)\n" \
+		"  \t -f | --fill=p,p,.. : image fill patterns, among random, zero, half and blank\n" \
+		"  \t     (half is random data followed by erased state bytes, default all)\n" \
+		"  \t -m | --max-size=N : image size limit, the image fills the flash up to it (default 16384)\n" \
+		"  \t -o | --output=file : write the results to 'file' as CSV\n" \
+		"  \t -V | --verbose : keep the output of the operations\n" \
+		"  \t -h | --help : display this help\n" \
+		"  \t -v | --version : display version information\n", prog_name);
+	fprintf(stderr, "-----------------------------------------------------------------------\n");
+}
+
+static char* parts_file_name = "./lpctools_parts.def";
+static char* sim_name = "./lpcisp-sim";
+static uint64_t* part_ids = NULL;
+static int nb_part_ids = 0;
+static char* baudrates = "115200,460800";
+static char* fills = "random,zero,half,blank";
+static unsigned int max_size = 16384;
+static char* output_name = NULL;
+static int verbose = 0;
+
+/* Operations */
+enum bench_ops {
+	BENCH_FLASH = 0,
+	BENCH_DUMP,
+	BENCH_ERASE,
+	BENCH_NB_OPS,
+};
+static char* op_names[] = { "flash", "dump", "erase" };
+
+/* ISP commands reported as phases, the time spent in other commands and out of commands
+ * is reported as "other" */
+static char* phases = "IPEWCRSM";
+
+struct bench_result {
+	int ret;
+	unsigned int bytes; /* Image size for flash, flash size for dump and erase */
+	double time;
+	unsigned int tx_bytes;
+	unsigned int rx_bytes;
+	unsigned int round_trips;
+	double cmd_time[26];
+};
+
+/* Simulated target */
+struct bench_sim {
+	pid_t pid;
+	FILE* out;
+	char device[300];
+};
+
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/* Hide the output of the operations unless verbose */
+static int saved_stdout = -1;
+static void bench_quiet(int on)
+{
+	int fd = -1;
+
+	if (verbose) {
+		return;
+	}
+	fflush(stdout);
+	if (on) {
+		saved_stdout = dup(STDOUT_FILENO);
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	} else if (saved_stdout >= 0) {
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(saved_stdout);
+		saved_stdout = -1;
+	}
+}
+
+/* Start the simulator for "part", and get the path of its pseudo-terminal */
+static int bench_sim_start(struct bench_sim* sim, struct part_desc* part, unsigned int baudrate)
+{
+	char id[32], baud[16], line[256];
+	int fds[2];
+	char* prefix = "Pseudo-terminal slave is ";
+
+	if (pipe(fds) != 0) {
+		perror("Unable to create pipe");
+		return -1;
+	}
+	snprintf(id, sizeof(id), "0x%08llx", (unsigned long long)part->part_id);
+	snprintf(baud, sizeof(baud), "%u", baudrate);
+	sim->pid = fork();
+	if (sim->pid < 0) {
+		perror("Unable to start simulator");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (sim->pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl(sim_name, sim_name, "-p", parts_file_name, "-b", baud, id, (char*)NULL);
+		perror("Unable to run simulator");
+		_exit(127);
+	}
+	close(fds[1]);
+	sim->out = fdopen(fds[0], "r");
+	while (fgets(line, sizeof(line), sim->out) != NULL) {
+		if (strncmp(line, prefix, strlen(prefix)) == 0) {
+			line[strcspn(line, "\r\n")] = '\0';
+			snprintf(sim->device, sizeof(sim->device), "pty:%s", (line + strlen(prefix)));
+			return 0;
+		}
+	}
+	printf("Simulator did not start for part %s.\n", part->name);
+	fclose(sim->out);
+	waitpid(sim->pid, NULL, 0);
+	return -1;
+}
+
+static void bench_sim_stop(struct bench_sim* sim)
+{
+	char line[256];
+
+	kill(sim->pid, SIGINT);
+	/* Drop the simulator statistics */
+	while (fgets(line, sizeof(line), sim->out) != NULL);
+	fclose(sim->out);
+	waitpid(sim->pid, NULL, 0);
+}
+
+static void bench_fill(char* data, unsigned int size, char* fill)
+{
+	unsigned int i = 0;
+
+	if (strcmp(fill, "zero") == 0) {
+		memset(data, 0, size);
+	} else if (strcmp(fill, "blank") == 0) {
+		memset(data, 0xFF, size);
+	} else {
+		for (i = 0; i < size; i++) {
+			data[i] = rand();
+		}
+		if (strcmp(fill, "half") == 0) {
+			memset(&data[size / 2], 0xFF, (size - (size / 2)));
+		}
+	}
+}
+
+/* Check the dumped flash against the image, but for the user code */
+static int bench_check_dump(char* dump_name, struct flash_image* image, struct part_desc* part)
+{
+	char* data = malloc(part->flash_size);
+	int ret = 0, len = 0;
+
+	if (data == NULL) {
+		return -1;
+	}
+	len = isp_file_to_buff(data, part->flash_size, dump_name);
+	if ((len < image->size) || (memcmp(data, image->data, 28) != 0) ||
+			(memcmp(&data[32], &image->data[32], (image->size - 32)) != 0)) {
+		ret = -1;
+	}
+	free(data);
+	return ret;
+}
+
+static int bench_op(struct isp_transport* t, int op, struct part_desc* part, struct flash_image* image,
+					char* dump_name, struct bench_result* res)
+{
+	double start = 0;
+
+	t->tx_bytes = 0;
+	t->rx_bytes = 0;
+	t->round_trips = 0;
+	t->reply_wait = 0;
+	t->cur_cmd = 0;
+	memset(t->cmd_time, 0, sizeof(t->cmd_time));
+	memset(t->cmd_count, 0, sizeof(t->cmd_count));
+
+	res->bytes = part->flash_size;
+	start = now_s();
+	switch (op) {
+		case BENCH_FLASH:
+			res->bytes = image->size;
+			res->ret = flash_target(t, part, image, 1, FLASH_FULL);
+			break;
+		case BENCH_DUMP:
+			res->ret = dump_to_file(t, part, dump_name);
+			if (res->ret == 0) {
+				res->ret = bench_check_dump(dump_name, image, part);
+			}
+			break;
+		case BENCH_ERASE:
+			res->ret = erase_flash(t, part);
+			break;
+	}
+	isp_serial_command(t, 0);
+	res->time = now_s() - start;
+	res->tx_bytes = t->tx_bytes;
+	res->rx_bytes = t->rx_bytes;
+	res->round_trips = t->round_trips;
+	memcpy(res->cmd_time, t->cmd_time, sizeof(res->cmd_time));
+	return res->ret;
+}
+
+static void bench_report(FILE* csv, struct part_desc* part, unsigned int baudrate, char* fill,
+							int op, struct bench_result* res)
+{
+	double line_max = (double)baudrate / 10; /* 8n1, bytes per second */
+	double rate = 0, payload = 0, line = 0, other = res->time;
+	char phases_str[64];
+	unsigned int i = 0, len = 0;
+
+	if (res->time > 0) {
+		rate = res->bytes / res->time;
+		line = ((res->tx_bytes + res->rx_bytes) / res->time) / line_max;
+	}
+	/* No data goes through the line for erase */
+	if (op != BENCH_ERASE) {
+		payload = rate / line_max;
+	}
+	phases_str[0] = '\0';
+	for (i = 0; phases[i] != '\0'; i++) {
+		double time = res->cmd_time[phases[i] - 'A'];
+		other -= time;
+		if ((res->time > 0) && (time >= (res->time / 20)) && (len < (sizeof(phases_str) - 10))) {
+			len += snprintf(&phases_str[len], (sizeof(phases_str) - len), "%c:%.0f%% ",
+								phases[i], ((time * 100) / res->time));
+		}
+	}
+	printf("%-18s %7u %-6s %-5s %7u %7.3f %8.0f %6.1f%% %6.1f%% %6.2f  %s%s\n",
+			part->name, baudrate, fill, op_names[op], res->bytes, res->time, rate, (payload * 100),
+			(line * 100), ((res->round_trips * 1024.0) / res->bytes), phases_str,
+			((res->ret == 0) ? "" : "FAILED"));
+
+	if (csv == NULL) {
+		return;
+	}
+	fprintf(csv, "0x%08llx,%s,%u,%s,%s,%u,%s,%.6f,%.1f,%.4f,%.4f,%u,%u,%u,%.3f",
+			(unsigned long long)part->part_id, part->name, baudrate, fill, op_names[op], res->bytes,
+			((res->ret == 0) ? "OK" : "FAILED"), res->time, rate, payload, line,
+			res->tx_bytes, res->rx_bytes, res->round_trips, ((res->round_trips * 1024.0) / res->bytes));
+	for (i = 0; phases[i] != '\0'; i++) {
+		fprintf(csv, ",%.6f", res->cmd_time[phases[i] - 'A']);
+	}
+	fprintf(csv, ",%.6f\n", other);
+}
+
+/* Flash, dump and erase one simulated part */
+static int bench_part(FILE* csv, struct part_desc* part, unsigned int baudrate, char* fill, char* dump_name)
+{
+	struct bench_sim sim;
+	struct isp_transport* t = NULL;
+	struct flash_image image;
+	struct bench_result res;
+	int op = 0, ret = 0;
+
+	image.size = ((part->flash_size < max_size) ? part->flash_size : max_size);
+	image.data = malloc(image.size);
+	if (image.data == NULL) {
+		printf("Unable to allocate image.\n");
+		return -1;
+	}
+	bench_fill(image.data, image.size, fill);
+
+	if (bench_sim_start(&sim, part, baudrate) != 0) {
+		free(image.data);
+		return -1;
+	}
+	bench_quiet(1);
+	t = isp_transport_open(sim.device, baudrate);
+	if (t != NULL) {
+		ret = isp_connect(t, 10000, 1);
+	}
+	bench_quiet(0);
+	if ((t == NULL) || (ret < 0)) {
+		printf("Unable to connect to simulated %s.\n", part->name);
+		ret = -1;
+		goto out;
+	}
+	ret = 0;
+
+	for (op = 0; op < BENCH_NB_OPS; op++) {
+		memset(&res, 0, sizeof(res));
+		bench_quiet(1);
+		bench_op(t, op, part, &image, dump_name, &res);
+		bench_quiet(0);
+		bench_report(csv, part, baudrate, fill, op, &res);
+		if (res.ret != 0) {
+			ret = -1;
+		}
+	}
+
+out:
+	if (t != NULL) {
+		isp_transport_close(t);
+	}
+	bench_sim_stop(&sim);
+	free(image.data);
+	return ret;
+}
+
+int main(int argc, char** argv)
+{
+	struct parts_db* db = NULL;
+	FILE* csv = NULL;
+	char dump_name[] = "/tmp/lpcbench_XXXXXX";
+	char* baud_list = NULL;
+	char* baud = NULL;
+	char* fill_list = NULL;
+	char* fill = NULL;
+	char* save_baud = NULL;
+	char* save_fill = NULL;
+	unsigned int i = 0, nb_failed = 0;
+	int fd = -1, j = 0;
+
+	/* parameter parsing */
+	while(1) {
+		int option_index = 0;
+		int c = 0;
+
+		struct option long_options[] = {
+			{"parts", required_argument, 0, 'p'},
+			{"sim", required_argument, 0, 's'},
+			{"part", required_argument, 0, 'i'},
+			{"baudrates", required_argument, 0, 'b'},
+			{"fill", required_argument, 0, 'f'},
+			{"max-size", required_argument, 0, 'm'},
+			{"output", required_argument, 0, 'o'},
+			{"verbose", no_argument, 0, 'V'},
+			{"help", no_argument, 0, 'h'},
+			{"version", no_argument, 0, 'v'},
+			{0, 0, 0, 0}
+		};
+
+		c = getopt_long(argc, argv, "p:s:i:b:f:m:o:Vhv", long_options, &option_index);
+
+		/* no more options to parse */
+		if (c == -1) break;
+
+		switch (c) {
+			case 'p':
+				parts_file_name = strdup(optarg);
+				break;
+			case 's':
+				sim_name = strdup(optarg);
+				break;
+			case 'i':
+				part_ids = realloc(part_ids, ((nb_part_ids + 1) * sizeof(uint64_t)));
+				if (part_ids == NULL) {
+					printf("Unable to allocate parts list.\n");
+					return -1;
+				}
+				part_ids[nb_part_ids++] = strtoull(optarg, NULL, 0);
+				break;
+			case 'b':
+				baudrates = strdup(optarg);
+				break;
+			case 'f':
+				fills = strdup(optarg);
+				break;
+			case 'm':
+				max_size = strtoul(optarg, NULL, 0);
+				if (max_size < 256) {
+					printf("Image size limit must be 256 bytes or more.\n");
+					return -1;
+				}
+				break;
+			case 'o':
+				output_name = strdup(optarg);
+				break;
+			case 'V':
+				verbose = 1;
+				break;
+			case 'v':
+				printf("%s, version %s\n", PROG_NAME, VERSION);
+				return 0;
+			case 'h':
+			default:
+				help(argv[0]);
+				return 0;
+		}
+	}
+
+	db = parts_db_load(parts_file_name);
+	if (db == NULL) {
+		return -1;
+	}
+	if (output_name != NULL) {
+		csv = fopen(output_name, "w");
+		if (csv == NULL) {
+			perror("Unable to open output file");
+			parts_db_free(db);
+			return -1;
+		}
+		fprintf(csv, "part_id,part,baudrate,fill,operation,bytes,result,time_s,bytes_per_s,payload_util,"
+						"line_util,tx_bytes,rx_bytes,round_trips,round_trips_per_kb");
+		for (i = 0; phases[i] != '\0'; i++) {
+			fprintf(csv, ",time_%c", phases[i]);
+		}
+		fprintf(csv, ",time_other\n");
+	}
+	fd = mkstemp(dump_name);
+	if (fd < 0) {
+		perror("Unable to create dump file");
+		parts_db_free(db);
+		return -1;
+	}
+	close(fd);
+	/* Same images for each run */
+	srand(1);
+
+	printf("Payload : bytes/s over the line limit (8n1, blank sectors are skipped so it can be\n");
+	printf("over 100%%), line : all bytes sent and received, RT/KB : round trips per KB.\n");
+	printf("Phases are ISP commands : I blank check, P prepare, E erase, W write to RAM,\n");
+	printf("C copy to flash, R read, S read CRC, M compare.\n\n");
+	printf("%-18s %7s %-6s %-5s %7s %7s %8s %7s %7s %6s  %s\n", "Part", "Baud", "Fill", "Op",
+			"Bytes", "Time(s)", "Bytes/s", "Payload", "Line", "RT/KB", "Phases");
+	for (i = 0; i < db->nb_parts; i++) {
+		struct part_desc* part = &(db->parts[i]);
+		if (nb_part_ids != 0) {
+			for (j = 0; (j < nb_part_ids) && (part_ids[j] != part->part_id); j++);
+			if (j == nb_part_ids) {
+				continue;
+			}
+		}
+		baud_list = strdup(baudrates);
+		for (baud = strtok_r(baud_list, ",", &save_baud); baud != NULL; baud = strtok_r(NULL, ",", &save_baud)) {
+			fill_list = strdup(fills);
+			for (fill = strtok_r(fill_list, ",", &save_fill); fill != NULL; fill = strtok_r(NULL, ",", &save_fill)) {
+				if (bench_part(csv, part, strtoul(baud, NULL, 0), fill, dump_name) != 0) {
+					nb_failed++;
+				}
+			}
+			free(fill_list);
+		}
+		free(baud_list);
+	}
+
+	unlink(dump_name);
+	if (csv != NULL) {
+		fclose(csv);
+		printf("\nResults written to %s\n", output_name);
+	}
+	parts_db_free(db);
+	if (nb_failed != 0) {
+		printf("%u run(s) failed.\n", nb_failed);
+		return 1;
+	}
+	return 0;
+}
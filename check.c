@@ -59,7 +59,6 @@ void help(char *prog_name)
 	fprintf(stderr, "-----------------------------------------------------------------------\n");
 }
 
-int trace_on = 0;
 
 static int calc_user_code = 1; /* User code is computed by default */
 static int check_crp = 1; /* CRP is checked by default */
@@ -0,0 +1,160 @@
+#!/bin/bash
+#
+#   LPC ISP fault injection benchmark
+#
+# Runs lpcprog flash and dump commands against lpcisp-sim, with faults injected on the
+# line by the simulated target, and reports for each injected error rate the success
+# rate and the effective throughput of both commands.
+# Both lpcprog and lpcisp-sim must be built ("make all lpcisp-sim").
+#
+#  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+TOOLS=$(dirname "$0")
+PART=0x2540102B
+PARTS=${TOOLS}/lpctools_parts.def
+SIZE=16384
+BAUD=115200
+KIND=corrupt
+RATES="0 0.00001 0.00003 0.0001 0.0003 0.001"
+RUNS=5
+CSV=
+
+usage()
+{
+	echo "Usage: $0 [options]"
+	echo "  -P part_id : simulated part (default ${PART})"
+	echo "  -p file : parts description file (default ${PARTS})"
+	echo "  -s size : image size in bytes (default ${SIZE})"
+	echo "  -b baud : line speed (default ${BAUD})"
+	echo "  -k kind : fault kind, one of corrupt, drop, dup, lose or delay (default ${KIND})"
+	echo "  -r \"rates\" : injected error rates (default \"${RATES}\")"
+	echo "  -n runs : runs for each rate and command (default ${RUNS})"
+	echo "  -o file : also write the results to file, as CSV"
+	exit 1
+}
+
+while getopts "P:p:s:b:k:r:n:o:h" opt; do
+	case ${opt} in
+		P) PART=${OPTARG} ;;
+		p) PARTS=${OPTARG} ;;
+		s) SIZE=${OPTARG} ;;
+		b) BAUD=${OPTARG} ;;
+		k) KIND=${OPTARG} ;;
+		r) RATES=${OPTARG} ;;
+		n) RUNS=${OPTARG} ;;
+		o) CSV=${OPTARG} ;;
+		*) usage ;;
+	esac
+done
+
+for tool in lpcprog lpcisp-sim; do
+	if [ ! -x "${TOOLS}/${tool}" ]; then
+		echo "${TOOLS}/${tool} not found, build it first."
+		exit 1
+	fi
+done
+
+TMP=$(mktemp -d)
+trap 'rm -rf "${TMP}"' EXIT
+head -c "${SIZE}" /dev/urandom > "${TMP}/image.bin"
+
+# start_sim settings sim_options : starts the simulator and sets DEV to its pseudo-terminal
+start_sim()
+{
+	"${TOOLS}/lpcisp-sim" -p "${PARTS}" -b "${BAUD}" -d "fault:$1:pty:" $2 "${PART}" > "${TMP}/sim.log" 2>&1 &
+	SIM_PID=$!
+	for i in $(seq 50); do
+		DEV=$(sed -n 's/^Pseudo-terminal slave is //p' "${TMP}/sim.log")
+		if [ -n "${DEV}" ]; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	return 1
+}
+
+stop_sim()
+{
+	kill -INT "${SIM_PID}" 2>/dev/null
+	wait "${SIM_PID}" 2>/dev/null
+}
+
+now()
+{
+	date +%s.%N
+}
+
+# run command rate seed : one run, prints the duration in seconds, returns non zero on failure
+run()
+{
+	local cmd=$1 settings="${KIND}=$2,seed=$3" start end ret=0
+
+	rm -f "${TMP}/flash.bin" "${TMP}/dump.bin"
+	if [ "${cmd}" = "flash" ]; then
+		start_sim "${settings}" "-o ${TMP}/flash.bin" || return 1
+	else
+		start_sim "${settings}" "-i ${TMP}/image.bin" || return 1
+	fi
+	start=$(now)
+	if [ "${cmd}" = "flash" ]; then
+		"${TOOLS}/lpcprog" -p "${PARTS}" -b "${BAUD}" -d "${DEV}" -c flash "${TMP}/image.bin" > "${TMP}/run.log" 2>&1
+	else
+		"${TOOLS}/lpcprog" -p "${PARTS}" -b "${BAUD}" -d "${DEV}" -c dump "${TMP}/dump.bin" > "${TMP}/run.log" 2>&1
+	fi
+	ret=$?
+	end=$(now)
+	stop_sim
+	# Check the data really went through, the user code (vector 7) is changed by flash
+	if [ ${ret} -eq 0 ]; then
+		if [ "${cmd}" = "flash" ]; then
+			cmp -s -n 28 "${TMP}/image.bin" "${TMP}/flash.bin" && \
+				cmp -s -i 32 -n $((SIZE - 32)) "${TMP}/image.bin" "${TMP}/flash.bin"
+		else
+			cmp -s -n "${SIZE}" "${TMP}/image.bin" "${TMP}/dump.bin"
+		fi
+		ret=$?
+	fi
+	echo "${start} ${end}" | awk '{ printf("%.3f\n", $2 - $1) }'
+	return ${ret}
+}
+
+printf "%s errors injected, %u bytes image, %u bauds, %u runs per rate\n" "${KIND}" "${SIZE}" "${BAUD}" "${RUNS}"
+printf "%-8s %-10s %8s %10s %12s\n" "command" "rate" "success" "time (s)" "bytes/s"
+if [ -n "${CSV}" ]; then
+	echo "command,kind,rate,runs,ok,mean_time_s,bytes_per_s" > "${CSV}"
+fi
+for cmd in flash dump; do
+	for rate in ${RATES}; do
+		ok=0
+		total=0
+		for seed in $(seq "${RUNS}"); do
+			duration=$(run "${cmd}" "${rate}" "${seed}")
+			if [ $? -eq 0 ]; then
+				ok=$((ok + 1))
+				total=$(echo "${total} ${duration}" | awk '{ print $1 + $2 }')
+			fi
+		done
+		result=$(echo "${ok} ${RUNS} ${total} ${SIZE}" | awk '{
+			if ($1 > 0) { t = $3 / $1; bps = $4 / t } else { t = 0; bps = 0 }
+			printf("%u %.1f %.3f %.0f", $1, ($1 * 100) / $2, t, bps) }')
+		set -- ${result}
+		printf "%-8s %-10s %7s%% %10s %12s\n" "${cmd}" "${rate}" "$2" "$3" "$4"
+		if [ -n "${CSV}" ]; then
+			echo "${cmd},${KIND},${rate},${RUNS},$1,$3,$4" >> "${CSV}"
+		fi
+	done
+done
@@ -35,8 +35,9 @@
 #include <sys/stat.h>
 
 #include "isp_utils.h"
-
-extern int trace_on;
+#include "isp_uu.h"
+#include "isp_transport.h"
+#include "isp_commands.h"
 
 
 /* Max should be 1270 for read memory, a little bit more for writes */
@@ -45,12 +46,14 @@ extern int trace_on;
 
 #define SYNCHRO_START "?"
 #define SYNCHRO  "Synchronized\r\n"
-#define SYNCHRO_OK "OK\r\n"
+#define SYNCHRO_REPLY "Synchronized"
+#define SYNCHRO_OK "OK"
 #define DATA_BLOCK_OK "OK\r\n"
 #define DATA_BLOCK_RESEND "RESEND\r\n"
+#define DATA_BLOCK_REPLY_OK "OK"
 #define SYNCHRO_ECHO_OFF "A 0\r\n"
 
-#define ISP_ABORT ""  /* Not handled */
+#define ISP_ABORT "\033"  /* ESC, see isp_send_abort() */
 
 #define UNLOCK "U 23130\r\n"
 #define READ_UID "N\r\n"
@@ -65,6 +68,17 @@ extern int trace_on;
 #if (SERIAL_BUFSIZE < (MAX_BYTES_PER_LINE * LINES_PER_BLOCK + 10 + 2)) /* uuencoded data + checksum + \r\n */
 #error "SERIAL_BUFSIZE too small"
 #endif
+#if (REP_BUFSIZE < MAX_BYTES_PER_LINE)
+#error "REP_BUFSIZE too small"
+#endif
+
+/* Automatic link speed downgrade, see isp_link_record() */
+#define LINK_WINDOW_MASK  0xFFFF /* Sliding window over the last 16 data blocks */
+#define LINK_MAX_RESENDS  3 /* Resends within the window which trigger a downgrade */
+
+/* Device processing time allowed for some commands */
+#define ERASE_LATENCY_MS  400 /* Per sector */
+#define COPY_LATENCY_MS  200
 
 /* Order in this table is important */
 char* error_codes[] = {
@@ -90,78 +104,118 @@ char* error_codes[] = {
 	"CODE_READ_PROTECTION_ENABLED",
 };
 
-static int isp_ret_code(char* buf, char** endptr, int quiet)
+int isp_ret_code(struct isp_transport* t, char* buf, char** endptr, int quiet)
 {
 	unsigned int ret = 0;
 	ret = strtoul(buf, endptr, 10);
 	/* FIXME : Find how return code are sent (binary or ASCII) */
 	if (quiet != 1) {
-		if (ret > (sizeof(error_codes)/sizeof(char*))) {
+		if (ret >= (sizeof(error_codes)/sizeof(char*))) {
 			printf("Received unknown error code '%u' !\n", ret);
-		} else if ((ret != 0) || trace_on) {
+		} else if ((ret != 0) || t->trace) {
 			printf("Received error code '%u': %s\n", ret, error_codes[ret]);
 		}
 	}
 	return ret;
 }
 
+/* Read the return code line of a command.
+ * "latency_ms" is the time the device may need to execute the command.
+ */
+static int isp_get_ret_code(struct isp_transport* t, char* cmd_name, int quiet, unsigned int latency_ms)
+{
+	char buf[REP_BUFSIZE];
+	int len = 0;
+
+	len = isp_serial_readline(t, buf, REP_BUFSIZE, latency_ms);
+	if (len <= 0) {
+		printf("Error reading %s result.\n", cmd_name);
+		return -4;
+	}
+	/* Data left from an interrupted transfer is not a return code */
+	if (!isdigit((unsigned char)buf[0])) {
+		printf("Unexpected reply to %s: \"%s\".\n", cmd_name, buf);
+		return -4;
+	}
+	return isp_ret_code(t, buf, NULL, quiet);
+}
+
+/* Read the reply to one of the synchronisation steps. The line we sent is echoed before
+ * the reply.
+ * Returns 0 when the step is acknowledged.
+ */
+static int isp_connect_ack(struct isp_transport* t, const char* sent)
+{
+	char buf[REP_BUFSIZE];
+	int len = 0;
+
+	len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+	if ((len > 0) && (strncmp(sent, buf, len) == 0)) {
+		/* Echo, get the reply */
+		len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+	}
+	if ((len <= 0) || (strcmp(SYNCHRO_OK, buf) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
 
 /* Connect or reconnect to the target.
  * crystal_freq is in KHz
  * Return positive or NULL value when connection is OK, or negative value otherwise.
  */
-int isp_connect(unsigned int crystal_freq, int quiet)
+int isp_connect(struct isp_transport* t, unsigned int crystal_freq, int quiet)
 {
 	char buf[REP_BUFSIZE];
 	char freq[10];
+	int len = 0;
 
 	snprintf(freq, 8, "%d\r\n", crystal_freq);
 
+	/* Drop anything left from a previous session */
+	isp_serial_flush(t);
+
 	/* Send synchronize request */
-	if (isp_serial_write(SYNCHRO_START, strlen(SYNCHRO_START)) != strlen(SYNCHRO_START)) {
+	if (isp_serial_write(t, SYNCHRO_START, strlen(SYNCHRO_START)) != strlen(SYNCHRO_START)) {
 		printf("Unable to send synchronize request.\n");
 		return -5;
 	}
 	/* Wait for answer */
-	if (isp_serial_read(buf, REP_BUFSIZE, strlen(SYNCHRO)) < 0) {
+	len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+	if (len < 0) {
 		printf("Error reading synchronize answer.\n");
 		return -4;
 	}
-	/* Check answer, and acknowledge if OK */
-	if (strncmp(SYNCHRO, buf, strlen(SYNCHRO)) == 0) {
-		isp_serial_write(SYNCHRO, strlen(SYNCHRO));
+	/* Check answer (nothing received on timeout), and acknowledge if OK */
+	if ((len > 0) && (strcmp(SYNCHRO_REPLY, buf) == 0)) {
+		isp_serial_write(t, SYNCHRO, strlen(SYNCHRO));
 	} else {
 		if (quiet != 1) {
 			printf("Unable to synchronize, no synchro received.\n");
 		}
 		return -3;
 	}
-	/* Empty read buffer (echo is on) */
-	isp_serial_empty_buffer();
-	/* Read reply (OK) */
-	isp_serial_read(buf, REP_BUFSIZE, strlen(SYNCHRO_OK));
-	if (strncmp(SYNCHRO_OK, buf, strlen(SYNCHRO_OK)) != 0) {
+	/* Read reply (OK), after echo */
+	if (isp_connect_ack(t, SYNCHRO) != 0) {
 		printf("Unable to synchronize, synchro not acknowledged.\n");
 		return -2;
 	}
 
 	/* Documentation says we should send crystal frequency .. sending anything is OK */
-	isp_serial_write(freq, strlen(freq));
-	/* Empty read buffer (echo is on) */
-	isp_serial_empty_buffer();
-	/* Read reply (OK) */
-	isp_serial_read(buf, REP_BUFSIZE, strlen(SYNCHRO_OK));
-	if (strncmp(SYNCHRO_OK, buf, strlen(SYNCHRO_OK)) != 0) {
+	isp_serial_write(t, freq, strlen(freq));
+	/* Read reply (OK), after echo */
+	if (isp_connect_ack(t, freq) != 0) {
 		printf("Unable to synchronize, crystal frequency not acknowledged.\n");
 		return -2;
 	}
 
 	/* Turn off echo */
-	isp_serial_write(SYNCHRO_ECHO_OFF, strlen(SYNCHRO_ECHO_OFF));
-	/* Empty read buffer (echo still on) */
-	isp_serial_empty_buffer();
+	isp_serial_write(t, SYNCHRO_ECHO_OFF, strlen(SYNCHRO_ECHO_OFF));
+	/* Remove echo (echo still on) */
+	isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
 	/* Read eror code for command */
-	isp_serial_read(buf, REP_BUFSIZE, 3);
+	isp_get_ret_code(t, "echo-off", 1, SERIAL_LATENCY_MS);
 
 	/* Leave it even in quiet mode, so the user knows something is going on */
 	printf("Device session openned.\n");
@@ -169,32 +223,115 @@ int isp_connect(unsigned int crystal_freq, int quiet)
 	return 1;
 }
 
-int isp_send_cmd_no_args(char* cmd_name, char* cmd, int quiet)
+/* Abort the command in progress, if any, and drop what the target sent before
+ * stopping. Used to get back to a known state after a failed transfer.
+ * The escape character is documented in the user manuals of the LPC11xx and
+ * LPC17xx, but not as an ISP command.
+ */
+void isp_send_abort(struct isp_transport* t)
 {
-	char buf[5];
-	int ret = 0, len = 0;
+	char buf[REP_BUFSIZE];
+	int lines = 0;
+
+	isp_serial_write(t, ISP_ABORT, strlen(ISP_ABORT));
+	while ((lines++ < 100) && (isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS) > 0));
+	isp_serial_flush(t);
+}
+
+/* Get back to "baudrate" after a link failure, and check we still talk to the target.
+ * Returns 0 when the target answers at "baudrate".
+ */
+int isp_link_fallback(struct isp_transport* t, unsigned int baudrate)
+{
+	int i = 0;
+
+	/* The failure may have left the target in the middle of a transfer */
+	isp_send_abort(t);
+	/* The request is short, it may get through even on a bad link */
+	for (i = 0; (i < 3) && (t->baudrate != baudrate); i++) {
+		isp_send_cmd_set_baud_rate(t, baudrate, 1);
+	}
+	if (t->baudrate != baudrate) {
+		isp_transport_set_baud(t, baudrate);
+		isp_serial_flush(t);
+	}
+	/* First command after a lost link may fail, try twice */
+	if ((isp_cmd_part_id(t, 1) < 0) && (isp_cmd_part_id(t, 1) < 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Record the result of a data block transfer in the sliding window.
+ * Returns 1 when the resend rate calls for a lower link speed, which is possible only
+ * when t->min_baudrate is set and not reached yet.
+ */
+static int isp_link_record(struct isp_transport* t, int resent)
+{
+	unsigned int history = 0;
+	unsigned int nb_resends = 0;
+
+	t->link_history = (((t->link_history << 1) | (resent ? 1 : 0)) & LINK_WINDOW_MASK);
+	if (resent) {
+		t->resends++;
+	}
+	if ((t->min_baudrate == 0) || (t->baudrate <= t->min_baudrate)) {
+		return 0;
+	}
+	for (history = t->link_history; history != 0; history >>= 1) {
+		nb_resends += (history & 0x01);
+	}
+	return (nb_resends >= LINK_MAX_RESENDS);
+}
+
+/* Standard baudrates, in increasing order, used to find the next lower link speed */
+static unsigned int link_baudrates[] = {
+	9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 0,
+};
+
+/* Switch target and host to the next lower baudrate, not under t->min_baudrate.
+ * Returns 0 when the link is up at the new baudrate.
+ */
+static int isp_link_downgrade(struct isp_transport* t)
+{
+	unsigned int rate = t->min_baudrate;
+	int i = 0;
+
+	for (i = 0; link_baudrates[i] != 0; i++) {
+		if ((link_baudrates[i] < t->baudrate) && (link_baudrates[i] > rate)) {
+			rate = link_baudrates[i];
+		}
+	}
+	printf("Too many resends at %u bauds, going down to %u bauds.\n", t->baudrate, rate);
+	if (isp_link_fallback(t, rate) != 0) {
+		printf("Target lost while changing link speed.\n");
+		return -1;
+	}
+	t->link_history = 0;
+	t->downgrades++;
+	return 0;
+}
+
+int isp_send_cmd_no_args(struct isp_transport* t, char* cmd_name, char* cmd, int quiet)
+{
+	int ret = 0;
 
 	/* Send request */
-	if (isp_serial_write(cmd, strlen(cmd)) != (int)strlen(cmd)) {
+	isp_serial_command(t, cmd[0]);
+	if (isp_serial_write(t, cmd, strlen(cmd)) != (int)strlen(cmd)) {
 		printf("Unable to send %s request.\n", cmd_name);
 		return -5;
 	}
 	/* Wait for answer */
-	usleep( 5000 );
-	len = isp_serial_read(buf, 3, 3);
-	if (len <= 0) {
-		printf("Error reading %s acknowledge.\n", cmd_name);
-		return -4;
-	}
-	ret = isp_ret_code(buf, NULL, quiet);
+	ret = isp_get_ret_code(t, cmd_name, quiet, SERIAL_LATENCY_MS);
 	return ret;
 }
 
-int isp_cmd_unlock(int quiet)
+int isp_cmd_unlock(struct isp_transport* t, int quiet)
 {
 	int ret = 0;
 
-	ret = isp_send_cmd_no_args("unlock", UNLOCK, quiet);
+	ret = isp_send_cmd_no_args(t, "unlock", UNLOCK, quiet);
 	if (ret != 0) {
 		printf("Unlock error.\n");
 		return -1;
@@ -206,48 +343,58 @@ int isp_cmd_unlock(int quiet)
 	return 0;
 }
 
-int isp_cmd_read_uid(void)
+int isp_read_uid(struct isp_transport* t, uint32_t* uid, int quiet)
 {
 	char buf[REP_BUFSIZE];
-	char* tmp = NULL;
 	int i = 0, ret = 0, len = 0;
-	unsigned long int uid[4];
 
-	ret = isp_send_cmd_no_args("read-uid", READ_UID, 0);
+	ret = isp_send_cmd_no_args(t, "read-uid", READ_UID, quiet);
 	if (ret != 0) {
-		printf("Read UID error.\n");
+		if (quiet != 1) {
+			printf("Read UID error.\n");
+		}
 		return ret;
 	}
-	len = isp_serial_read(buf, REP_BUFSIZE, 50);
-	if (len <= 0) {
-		printf("Error reading uid.\n");
-		return -2;
-	}
-	tmp = buf;
+	/* One line for each of the four words */
 	for (i=0; i<4; i++) {
-		static char* endptr = NULL;
-		uid[i] = strtoul(tmp, &endptr, 10);
-		tmp = endptr;
+		len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+		if (len <= 0) {
+			printf("Error reading uid.\n");
+			return -2;
+		}
+		uid[i] = strtoul(buf, NULL, 10);
+	}
+	return 0;
+}
+
+int isp_cmd_read_uid(struct isp_transport* t)
+{
+	uint32_t uid[4];
+	int ret = 0;
+
+	ret = isp_read_uid(t, uid, 0);
+	if (ret != 0) {
+		return ret;
 	}
-	printf("UID: 0x%08lx - 0x%08lx - 0x%08lx - 0x%08lx\n", uid[0], uid[1], uid[2], uid[3]);
+	printf("UID: 0x%08x - 0x%08x - 0x%08x - 0x%08x\n", uid[0], uid[1], uid[2], uid[3]);
 
 	return 0;
 }
 
-int isp_cmd_part_id(int quiet)
+int isp_cmd_part_id(struct isp_transport* t, int quiet)
 {
 	char buf[REP_BUFSIZE];
 	int ret = 0, len = 0;
 	unsigned long int part_id = 0;
 
-	ret = isp_send_cmd_no_args("read-part-id", READ_PART_ID, quiet);
+	ret = isp_send_cmd_no_args(t, "read-part-id", READ_PART_ID, quiet);
 	if (ret != 0) {
 		if (quiet != 1) {
 			printf("Read part ID error.\n");
 		}
 		return ret;
 	}
-	len = isp_serial_read(buf, REP_BUFSIZE, 15);
+	len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
 	if (len <= 0) {
 		printf("Error reading part ID.\n");
 		return -2;
@@ -261,31 +408,32 @@ int isp_cmd_part_id(int quiet)
 	return part_id;
 }
 
-int isp_cmd_boot_version(void)
+int isp_cmd_boot_version(struct isp_transport* t)
 {
 	char buf[REP_BUFSIZE];
-	int ret = 0, len = 0;
-	char* tmp = NULL;
+	int i = 0, ret = 0, len = 0;
 	unsigned int ver[2];
 
-	ret = isp_send_cmd_no_args("read-boot-version", READ_BOOT_VERSION, 0);
+	ret = isp_send_cmd_no_args(t, "read-boot-version", READ_BOOT_VERSION, 0);
 	if (ret != 0) {
 		printf("Read boot version error.\n");
 		return ret;
 	}
-	len = isp_serial_read(buf, REP_BUFSIZE, 20);
-	if (len <= 0) {
-		printf("Error reading boot version.\n");
-		return -2;
+	/* Minor and major on two lines */
+	for (i=0; i<2; i++) {
+		len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+		if (len <= 0) {
+			printf("Error reading boot version.\n");
+			return -2;
+		}
+		ver[i] = strtoul(buf, NULL, 10);
 	}
-	ver[0] = strtoul(buf, &tmp, 10);
-	ver[1] = strtoul(tmp, NULL, 10);
 	printf("Boot code version is %u.%u\n", ver[1], ver[0]);
 
 	return 0;
 }
 
-int isp_send_cmd_two_args(char* cmd_name, char cmd, unsigned int arg1, unsigned int arg2)
+int isp_send_cmd_two_args(struct isp_transport* t, char* cmd_name, char cmd, unsigned int arg1, unsigned int arg2)
 {
 	char buf[REP_BUFSIZE];
 	int ret = 0, len = 0;
@@ -297,53 +445,36 @@ int isp_send_cmd_two_args(char* cmd_name, char cmd, unsigned int arg1, unsigned
 	}
 
 	/* Send request */
-	if (isp_serial_write(buf, len) != len) {
+	isp_serial_command(t, cmd);
+	if (isp_serial_write(t, buf, len) != len) {
 		printf("Unable to send %s request.\n", cmd_name);
 		return -5;
 	}
 	/* Wait for answer */
-	usleep( 5000 );
-	len = isp_serial_read(buf, 3, 3);
-	if (len <= 0) {
-		printf("Error reading %s acknowledge.\n", cmd_name);
-		return -4;
-	}
-	ret = isp_ret_code(buf, NULL, 0);
+	ret = isp_get_ret_code(t, cmd_name, 0, SERIAL_LATENCY_MS);
 	return ret;
 }
 
-static int get_remaining_blocksize(unsigned int count, unsigned int actual_count, char* dir, unsigned int i)
+/* Compute the number of lines of the next block */
+static unsigned int get_block_lines(struct isp_transport* t, unsigned int count, unsigned int actual_count, char* dir, unsigned int i)
 {
-	unsigned int blocksize = 0;
 	unsigned int remain = count - actual_count;
+	unsigned int lines = LINES_PER_BLOCK;
 
-	if (remain >= MAX_DATA_BLOCK_SIZE) {
-		blocksize = (MAX_BYTES_PER_LINE * LINES_PER_BLOCK);
-		if (trace_on) {
-			printf("%s block %d (%d line(s)).\n", dir, i, LINES_PER_BLOCK);
-		}
-	} else {
-		unsigned int nb_last_lines = (remain / LINE_DATA_LENGTH);
+	if (remain < MAX_DATA_BLOCK_SIZE) {
+		lines = (remain / LINE_DATA_LENGTH);
 		if (remain % LINE_DATA_LENGTH) {
-			nb_last_lines += 1;
-		}
-		/* 4 bytes transmitted for each 3 data bytes */
-		blocksize = ((remain / 3) * 4);
-		if (remain % 3) {
-			blocksize += 4;
-		}
-		/* Add one byte per line for the starting "length character" and two bytes per
-		 * line for the ending "\r\n" */
-		blocksize += (3 * nb_last_lines);
-		if (trace_on) {
-			printf("%s block %d of size %u (%d line(s)).\n", dir, i, blocksize, nb_last_lines);
+			lines += 1;
 		}
 	}
-	return blocksize;
+	if (t->trace) {
+		printf("%s block %d (%d line(s)).\n", dir, i, lines);
+	}
+	return lines;
 }
 
 /* Compute the number of blocks of the transmitted data. */
-static int get_nb_blocks(unsigned int count, char* dir)
+static int get_nb_blocks(struct isp_transport* t, unsigned int count, char* dir)
 {
 	unsigned int lines = 0;
 	unsigned int blocks = 0;
@@ -357,118 +488,153 @@ static int get_nb_blocks(unsigned int count, char* dir)
 	if (lines % LINES_PER_BLOCK) {
 		blocks += 1;
 	}
-	if (trace_on) {
+	if (t->trace) {
 		printf("%s %d block(s) (%d line(s)).\n", dir, blocks, lines);
 	}
 
 	return blocks;
 }
 
-static unsigned int calc_checksum(unsigned char* data, unsigned int size)
-{
-	unsigned int i = 0;
-	unsigned int checksum = 0;
-
-	for (i=0; i<size; i++) {
-		checksum += data[i];
-	}
-	return checksum;
-}
-
 /*
- * perform read-memory operation
- * read 'count' bytes from 'addr' to 'data' buffer
+ * perform read-memory operation, streaming version
+ * read 'count' bytes from 'addr', and hand each block to 'sink' once verified and
+ * acknowledged
  */
-int isp_read_memory(char* data, uint32_t addr, unsigned int count, unsigned int uuencoded)
+int isp_read_memory_stream(struct isp_transport* t, uint32_t addr, unsigned int count, unsigned int uuencoded,
+							isp_read_sink sink, void* priv)
 {
 	/* Serial communication */
-	char buf[SERIAL_BUFSIZE];
+	char buf[REP_BUFSIZE];
 	int ret = 0, len = 0;
 	/* Reply handling */
+	char block_data[MAX_DATA_BLOCK_SIZE];
 	unsigned int blocks = 0;
 	unsigned int total_bytes_received = 0; /* actual count of bytes received */
 	unsigned int i = 0;
+	int resend_request_for_block = 0;
 
 	/* Send command */
-	ret = isp_send_cmd_two_args("read-memory", 'R', addr, count);
+	ret = isp_send_cmd_two_args(t, "read-memory", 'R', addr, count);
 	if (ret != 0) {
 		printf("Error when trying to read %u bytes of memory at address 0x%08x.\n", count, addr);
 		return ret;
 	}
 
 	if (uuencoded == 0) {
-		len = isp_serial_read(data, count, count);
-		if (len <= 0) {
-			printf("Error reading memory.\n");
-			return -6;
-		}
-		if (len == (int)count) {
-			return len;
-		}
-		/* Wait some time before reading possible remaining data */
-		usleep( 1000 );
-		len += isp_serial_read((data + len), (count - len), (count - len));
-		if (len < 0) { /* Length may be null, as we may already have received everything */
-			printf("Error reading memory.\n");
-			return -5;
+		/* No blocks, hand the data over as it comes */
+		while (total_bytes_received < count) {
+			unsigned int size = (count - total_bytes_received);
+			if (size > MAX_DATA_BLOCK_SIZE) {
+				size = MAX_DATA_BLOCK_SIZE;
+			}
+			len = isp_serial_read_exact(t, block_data, size);
+			if (len <= 0) {
+				printf("Error reading memory.\n");
+				return -6;
+			}
+			if (sink(priv, (addr + total_bytes_received), block_data, len) != 0) {
+				isp_send_abort(t);
+				break;
+			}
+			total_bytes_received += len;
+			if (len != (int)size) {
+				break;
+			}
 		}
-		return len;
+		return total_bytes_received;
 	}
 
 	/* Now, find the number of blocks of the reply. */
-	blocks = get_nb_blocks(count, "Reading");
+	blocks = get_nb_blocks(t, count, "Reading");
 
 	/* Receive and decode the data */
 	for (i=0; i<blocks; i++) {
-		unsigned int blocksize = 0, decoded_size = 0;
-		unsigned int received_checksum = 0, computed_checksum = 0;
-		static int resend_request_for_block = 0;
+		unsigned int nb_lines = 0, line = 0, decoded_size = 0;
+		unsigned int received_checksum = 0;
+		uint32_t computed_checksum = 0;
+		int block_ok = 1;
 
 		/* First compute the next block size */
-		blocksize = get_remaining_blocksize(count, total_bytes_received, "Reading", i);
-		/* Read the uuencoded data */
-		len = isp_serial_read(buf, SERIAL_BUFSIZE, blocksize);
-		if (len <= 0) {
-			printf("Error reading memory.\n");
-			ret = -6;
+		nb_lines = get_block_lines(t, count, total_bytes_received, "Reading", i);
+		/* Read and decode the uuencoded lines. This must be done before sending
+		 * acknowledge because we must compute the checksum */
+		for (line = 0; line < nb_lines; line++) {
+			unsigned int expected = count - (total_bytes_received + decoded_size);
+
+			if (expected > LINE_DATA_LENGTH) {
+				expected = LINE_DATA_LENGTH;
+			}
+			len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+			if (len <= 0) {
+				printf("Error reading memory.\n");
+				ret = -6;
+				break;
+			}
+			/* Check line length, a corrupted line would overflow the data buffer */
+			if ((buf[0] != (char)(' ' + expected)) || (len != (int)(1 + (((expected + 2) / 3) * 4)))) {
+				block_ok = 0;
+				continue;
+			}
+			/* Length checked, decode in place and compute the checksum on the way */
+			isp_uu_decode_sum((block_data + decoded_size), buf, len, &computed_checksum);
+			decoded_size += expected;
+		}
+		if (ret != 0) {
 			break;
 		}
-		usleep( 1000 );
-		/* Now read the checksum, maybe not yet received */
-		len += isp_serial_read((buf + len), (SERIAL_BUFSIZE - len), ((len > (int)blocksize) ? 0 : 3));
-		if (len < 0) { /* Length may be null, as we may already have received everything */
+		/* Now read the checksum */
+		len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+		if (len <= 0) {
 			printf("Error reading memory (checksum part).\n");
 			ret = -5;
 			break;
 		}
-		/* Decode. This must be done before sending acknowledge because we must
-		 * compute the checksum */
-		decoded_size = isp_uu_decode((data + total_bytes_received), buf, blocksize);
-		received_checksum = strtoul((buf + blocksize), NULL, 10);
-		computed_checksum = calc_checksum((unsigned char*)(data + total_bytes_received), decoded_size);
-		if (trace_on) {
+		received_checksum = strtoul(buf, NULL, 10);
+		if (t->trace) {
 			printf("Decoded Data :\n");
-			isp_dump((unsigned char*)(data + total_bytes_received), decoded_size);
+			isp_dump((unsigned char*)block_data, decoded_size);
 		}
-		if (computed_checksum == received_checksum) {
+		if (block_ok && (computed_checksum == received_checksum)) {
 			resend_request_for_block = 0; /* reset resend request counter */
-			if (trace_on) {
+			isp_link_record(t, 0);
+			if (t->trace) {
 				printf("Reading of blocks %u OK, contained %u bytes\n", i, decoded_size);
 			}
-			/* Acknowledge data */
-			if (isp_serial_write(DATA_BLOCK_OK, strlen(DATA_BLOCK_OK)) != strlen(DATA_BLOCK_OK)) {
+			/* Acknowledge data, the target sends the next block while the sink works */
+			if (isp_serial_write(t, DATA_BLOCK_OK, strlen(DATA_BLOCK_OK)) != strlen(DATA_BLOCK_OK)) {
 				printf("Unable to send acknowledge.\n");
 				ret = -4;
 				break;
 			}
+			if (sink(priv, (addr + total_bytes_received), block_data, decoded_size) != 0) {
+				/* Caller is not interrested in the remaining data */
+				if ((i + 1) < blocks) {
+					isp_send_abort(t);
+				}
+				total_bytes_received += decoded_size;
+				break;
+			}
 			/* Add data length to sum of received data */
 			total_bytes_received += decoded_size;
 		} else {
 			resend_request_for_block++;
-			if (trace_on) {
+			if (t->trace) {
 				printf("Checksum error for block %u (received %u, computed %u) error number: %d.\n",
 						i, received_checksum, computed_checksum, resend_request_for_block);
 			}
+			if (isp_link_record(t, 1)) {
+				/* Continue at a lower speed with a new request for the remaining data */
+				if (isp_link_downgrade(t) != 0) {
+					ret = -7;
+					break;
+				}
+				len = isp_read_memory_stream(t, (addr + total_bytes_received), (count - total_bytes_received),
+										uuencoded, sink, priv);
+				if (len > 0) {
+					total_bytes_received += len;
+				}
+				break;
+			}
 			if (resend_request_for_block > 3) {
 				printf("Block %d still wrong after 3 attempts, aborting.\n", i);
 				ret = -2;
@@ -477,7 +643,7 @@ int isp_read_memory(char* data, uint32_t addr, unsigned int count, unsigned int
 			/* Back to previous block */
 			i--;
 			/* Ask for resend */
-			if (isp_serial_write(DATA_BLOCK_RESEND, strlen(DATA_BLOCK_RESEND)) != strlen(DATA_BLOCK_RESEND)) {
+			if (isp_serial_write(t, DATA_BLOCK_RESEND, strlen(DATA_BLOCK_RESEND)) != strlen(DATA_BLOCK_RESEND)) {
 				printf("Unable to send resend request.\n");
 				ret = -1;
 				break;
@@ -488,12 +654,80 @@ int isp_read_memory(char* data, uint32_t addr, unsigned int count, unsigned int
 	return total_bytes_received;
 }
 
+/* Sink for isp_read_memory(), copy data to the caller buffer */
+struct isp_read_buffer {
+	char* data;
+	uint32_t addr;
+};
+
+static int isp_read_sink_buffer(void* priv, uint32_t addr, const char* data, unsigned int len)
+{
+	struct isp_read_buffer* dest = priv;
+
+	memcpy((dest->data + (addr - dest->addr)), data, len);
+	return 0;
+}
+
+/*
+ * perform read-memory operation
+ * read 'count' bytes from 'addr' to 'data' buffer
+ */
+int isp_read_memory(struct isp_transport* t, char* data, uint32_t addr, unsigned int count, unsigned int uuencoded)
+{
+	struct isp_read_buffer dest = { data, addr, };
+
+	return isp_read_memory_stream(t, addr, count, uuencoded, isp_read_sink_buffer, &dest);
+}
+
+/* Sink writing the data to the file descriptor pointed to by 'priv' */
+int isp_read_sink_fd(void* priv, uint32_t addr, const char* data, unsigned int len)
+{
+	int fd = *(int*)priv;
+	unsigned int done = 0;
+
+	(void)addr;
+	while (done < len) {
+		int nb = write(fd, (data + done), (len - done));
+		if (nb <= 0) {
+			if ((nb < 0) && (errno == EINTR)) {
+				continue;
+			}
+			perror("File write error");
+			return -1;
+		}
+		done += nb;
+	}
+	return 0;
+}
+
+
+/* uuencode the first block of 'count' bytes of data, with the checksum line, in 'buf'.
+ * Returns the size of the encoded block.
+ */
+static unsigned int isp_encode_block(struct isp_transport* t, char* buf, char* data, unsigned int count)
+{
+	unsigned int datasize = count;
+	unsigned int encoded_size = 0;
+	uint32_t computed_checksum = 0;
+
+	if (datasize >= MAX_DATA_BLOCK_SIZE) {
+		datasize = MAX_DATA_BLOCK_SIZE;
+	}
+	/* uuencode data, and add checksum */
+	encoded_size = isp_uu_encode_sum(buf, data, datasize, &computed_checksum);
+	encoded_size += snprintf((buf + encoded_size), 12, "%u\r\n", computed_checksum);
+	if (t->trace) {
+		printf("Encoded Data :\n");
+		isp_dump((unsigned char*)buf, encoded_size);
+	}
+	return encoded_size;
+}
 
 /*
  * perform write-to-ram operation
  * send 'count' bytes from 'data' to 'addr' in RAM
  */
-int isp_send_buf_to_ram(char* data, unsigned long int addr, unsigned int count, unsigned int perform_uuencode)
+int isp_send_buf_to_ram(struct isp_transport* t, char* data, unsigned long int addr, unsigned int count, unsigned int perform_uuencode)
 {
 	/* Serial communication */
 	int ret = 0, len = 0;
@@ -501,9 +735,15 @@ int isp_send_buf_to_ram(char* data, unsigned long int addr, unsigned int count,
 	unsigned int blocks = 0;
 	unsigned int total_bytes_sent = 0;
 	unsigned int i = 0;
+	int resend_requested_for_block = 0;
+	/* Two encoded blocks : the one being sent and the next one */
+	char encoded[2][SERIAL_BUFSIZE];
+	unsigned int encoded_size[2];
+	unsigned int cur = 0;
+	int next_ready = 0;
 
 	/* Send write-to-ram request */
-	ret = isp_send_cmd_two_args("write-to-ram", 'W', addr, count);
+	ret = isp_send_cmd_two_args(t, "write-to-ram", 'W', addr, count);
 	if (ret != 0) {
 		printf("Error when trying to start write procedure to address 0x%08lx.\n", addr);
 		return -8;
@@ -511,7 +751,7 @@ int isp_send_buf_to_ram(char* data, unsigned long int addr, unsigned int count,
 
 	/* First check if we must UU-encode data */
 	if (perform_uuencode == 0) {
-		if (isp_serial_write(data, count) != (int)count) {
+		if (isp_serial_write(t, data, count) != (int)count) {
 			printf("Error sending raw binary data.\n");
 			return -7;
 		}
@@ -519,60 +759,69 @@ int isp_send_buf_to_ram(char* data, unsigned long int addr, unsigned int count,
 		return 0;
 	}
 	/* Now, find the number of blocks of data to send. */
-	blocks = get_nb_blocks(count, "Sending");
+	blocks = get_nb_blocks(t, count, "Sending");
+
+	/* Encode the first block, the next ones are encoded while the previous one is on
+	 * the line and waiting for acknowledge */
+	encoded_size[0] = isp_encode_block(t, encoded[0], data, count);
 
-	/* Encode and send the data */
+	/* Send the data */
 	for (i=0; i<blocks; i++) {
-		char buf[SERIAL_BUFSIZE]; /* Store encoded data, to be sent to the microcontroller */
 		char repbuf[REP_BUFSIZE];
-		unsigned int datasize = 0, encoded_size = 0;
-		unsigned int computed_checksum = 0;
-		static int resend_requested_for_block = 0;
+		unsigned int datasize = 0;
+		unsigned int next = ((cur + 1) & 0x01);
 
-		/* First compute the next block size */
 		datasize = (count - total_bytes_sent);
 		if (datasize >= MAX_DATA_BLOCK_SIZE) {
 			datasize = MAX_DATA_BLOCK_SIZE;
 		}
-
-		/* uuencode data */
-		encoded_size = isp_uu_encode(buf, data + total_bytes_sent, datasize);
-		/* Add checksum */
-		computed_checksum = calc_checksum((unsigned char*)(data + total_bytes_sent), datasize);
-		encoded_size += snprintf((buf + encoded_size), 12, "%u\r\n", computed_checksum);
-		if (trace_on) {
-			printf("Encoded Data :\n");
-			isp_dump((unsigned char*)buf, encoded_size);
-		}
-		if (isp_serial_write(buf, encoded_size) != (int)encoded_size) {
+		if (isp_serial_write(t, encoded[cur], encoded_size[cur]) != (int)encoded_size[cur]) {
 			printf("Error sending uuencoded data.\n");
 			ret = -6;
 			break;
 		}
+		/* Prepare the next block, unless already done (this block is being sent again) */
+		if ((next_ready == 0) && ((i + 1) < blocks)) {
+			encoded_size[next] = isp_encode_block(t, encoded[next], (data + total_bytes_sent + datasize),
+													(count - total_bytes_sent - datasize));
+			next_ready = 1;
+		}
 
-		usleep( 20000 );
-		len = isp_serial_read(repbuf, REP_BUFSIZE, 4);
+		len = isp_serial_readline(t, repbuf, REP_BUFSIZE, SERIAL_LATENCY_MS);
 		if (len <= 0) {
 			printf("Error reading write acknowledge.\n");
 			return -5;
 		}
-		if (strncmp(DATA_BLOCK_OK, repbuf, strlen(DATA_BLOCK_OK)) == 0) {
+		if (strcmp(DATA_BLOCK_REPLY_OK, repbuf) == 0) {
 			total_bytes_sent += datasize;
 			resend_requested_for_block = 0; /* reset resend request counter */
-			if (trace_on) {
+			isp_link_record(t, 0);
+			if (t->trace) {
 				printf("Block %d sent.\n", i);
 			}
+			cur = next;
+			next_ready = 0;
 		} else {
 			resend_requested_for_block++;
-			if (trace_on) {
+			if (t->trace) {
 				printf("Checksum error for block %u, error number: %d.\n", i, resend_requested_for_block);
 			}
+			if (isp_link_record(t, 1)) {
+				/* Continue at a lower speed with a new request for the remaining data */
+				if (isp_link_downgrade(t) != 0) {
+					ret = -9;
+					break;
+				}
+				ret = isp_send_buf_to_ram(t, (data + total_bytes_sent), (addr + total_bytes_sent),
+										(count - total_bytes_sent), perform_uuencode);
+				break;
+			}
 			if (resend_requested_for_block >= 3) {
 				printf("Block %d still wrong after 3 attempts, aborting.\n", i);
 				ret = -2;
 				break;
 			}
-			/* Back to previous block */
+			/* Back to previous block, the encoded block is kept for resend */
 			i--;
 		}
 	}
@@ -581,11 +830,60 @@ int isp_send_buf_to_ram(char* data, unsigned long int addr, unsigned int count,
 }
 
 
-int isp_send_cmd_address(char cmd, uint32_t addr1, uint32_t addr2, uint32_t length, char* name)
+/*
+ * Check the link with a write-to-ram / read-memory round trip of 'count' bytes of a test
+ * pattern at 'addr' in RAM.
+ * Returns the number of data blocks which had to be sent again, or a negative value when
+ * the round trip failed.
+ */
+int isp_link_test(struct isp_transport* t, uint32_t addr, unsigned int count, unsigned int uuencoded)
+{
+	char* pattern = NULL;
+	char* readback = NULL;
+	unsigned int resends = t->resends;
+	unsigned int i = 0;
+	int ret = 0, len = 0;
+
+	pattern = malloc(count);
+	readback = malloc(count);
+	if ((pattern == NULL) || (readback == NULL)) {
+		printf("Unable to allocate link test buffers.\n");
+		ret = -10;
+		goto out;
+	}
+	/* Walk through all byte values, with changing neighbours */
+	for (i = 0; i < count; i++) {
+		pattern[i] = (char)((i * 37) ^ (i >> 8));
+	}
+
+	ret = isp_send_buf_to_ram(t, pattern, addr, count, uuencoded);
+	if (ret != 0) {
+		ret = -2;
+		goto out;
+	}
+	len = isp_read_memory(t, readback, addr, count, uuencoded);
+	if (len != (int)count) {
+		ret = -3;
+		goto out;
+	}
+	if (memcmp(pattern, readback, count) != 0) {
+		printf("Link test data mismatch.\n");
+		ret = -1;
+		goto out;
+	}
+	ret = (t->resends - resends);
+
+out:
+	free(pattern);
+	free(readback);
+	return ret;
+}
+
+
+int isp_send_cmd_address(struct isp_transport* t, char cmd, uint32_t addr1, uint32_t addr2, uint32_t length, char* name)
 {
 	char buf[SERIAL_BUFSIZE];
 	int ret = 0, len = 0;
-	char* tmp = NULL;
 
 	/* Create request */
 	len = snprintf(buf, SERIAL_BUFSIZE, "%c %u %u %u\r\n", cmd, addr1, addr2, length);
@@ -594,23 +892,41 @@ int isp_send_cmd_address(char cmd, uint32_t addr1, uint32_t addr2, uint32_t leng
 	}
 
 	/* Send request */
-	if (isp_serial_write(buf, len) != len) {
+	isp_serial_command(t, cmd);
+	if (isp_serial_write(t, buf, len) != len) {
 		printf("Unable to send %s request.\n", name);
 		return -5;
 	}
 	/* Wait for answer */
-	usleep( 5000 );
-	len = isp_serial_read(buf, 3, 3);
-	if (len <= 0) {
-		printf("Error reading %s result.\n", name);
+	ret = isp_get_ret_code(t, name, 0, ((cmd == 'C') ? COPY_LATENCY_MS : SERIAL_LATENCY_MS));
+	return ret;
+}
+
+
+/* Get the CRC-32 of "count" bytes at "addr" using the read CRC checksum command, which
+ * is not supported by all parts.
+ * Returns 0 on success, the ISP return code or a negative value on error.
+ */
+int isp_read_crc(struct isp_transport* t, uint32_t addr, unsigned int count, uint32_t* crc)
+{
+	char buf[REP_BUFSIZE];
+	int ret = 0, len = 0;
+
+	ret = isp_send_cmd_two_args(t, "read-crc", 'S', addr, count);
+	if (ret != 0) {
+		return ret;
+	}
+	len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+	if ((len <= 0) || (buf[0] < '0') || (buf[0] > '9')) {
+		printf("Invalid read-crc reply.\n");
 		return -4;
 	}
-	ret = isp_ret_code(buf, &tmp, 0);
-	return ret;
+	*crc = strtoul(buf, NULL, 10);
+	return 0;
 }
 
 
-int isp_send_cmd_go(uint32_t addr, char mode)
+int isp_send_cmd_go(struct isp_transport* t, uint32_t addr, char mode)
 {
 	char buf[SERIAL_BUFSIZE];
 	int ret = 0, len = 0;
@@ -631,18 +947,16 @@ int isp_send_cmd_go(uint32_t addr, char mode)
 	}
 
 	/* Send go request */
-	if (isp_serial_write(buf, len) != len) {
+	isp_serial_command(t, 'G');
+	if (isp_serial_write(t, buf, len) != len) {
 		printf("Unable to send go request.\n");
 		return -4;
 	}
 	/* Wait for answer */
-	usleep( 5000 );
-	len = isp_serial_read(buf, SERIAL_BUFSIZE, 3);
-	if (len <= 0) {
-		printf("Error reading go result.\n");
+	ret = isp_get_ret_code(t, "go", 0, SERIAL_LATENCY_MS);
+	if (ret < 0) {
 		return -3;
 	}
-	ret = isp_ret_code(buf, NULL, 0);
 	if (ret != 0) {
 		printf("Error when trying to execute program at 0x%08x in '%c' mode.\n", addr, mode);
 		return -1;
@@ -651,7 +965,7 @@ int isp_send_cmd_go(uint32_t addr, char mode)
 	return 0;
 }
 
-int isp_send_cmd_sectors(char* name, char cmd, int first_sector, int last_sector, int quiet)
+int isp_send_cmd_sectors(struct isp_transport* t, char* name, char cmd, int first_sector, int last_sector, int quiet)
 {
 	char buf[SERIAL_BUFSIZE];
 	int ret = 0, len = 0;
@@ -667,20 +981,60 @@ int isp_send_cmd_sectors(char* name, char cmd, int first_sector, int last_sector
 		len = SERIAL_BUFSIZE;
 	}
 	/* Send request */
-	if (isp_serial_write(buf, len) != len) {
+	isp_serial_command(t, cmd);
+	if (isp_serial_write(t, buf, len) != len) {
 		printf("Unable to send %s request.\n", name);
 		return -5;
 	}
 	/* Wait for answer */
-	usleep( 5000 );
-	len = isp_serial_read(buf, 3, 3); /* Read at exactly 3 bytes, so caller can retreive info */
-	if (len <= 0) {
-		printf("Error reading %s result.\n", name);
-		return -4;
-	}
-	ret = isp_ret_code(buf, NULL, quiet);
+	/* Only read the return code line, so caller can retreive info */
+	ret = isp_get_ret_code(t, name, quiet,
+			((cmd == 'E') ? (ERASE_LATENCY_MS * (last_sector - first_sector + 1)) : SERIAL_LATENCY_MS));
 
 	return ret;
 }
 
+/*
+ * perform set-baud-rate operation
+ * The target replies at the current baudrate and then switches to the new one, which
+ * is when the host side is switched too.
+ */
+int isp_send_cmd_set_baud_rate(struct isp_transport* t, unsigned int baudrate, unsigned int stop_bits)
+{
+	char buf[REP_BUFSIZE];
+	int ret = 0, len = 0;
+
+	if ((stop_bits != 1) && (stop_bits != 2)) {
+		printf("Error: stop bits must be 1 or 2 for set-baud-rate command.\n");
+		return -6;
+	}
+
+	/* Create set-baud-rate request */
+	len = snprintf(buf, REP_BUFSIZE, "B %u %u\r\n", baudrate, stop_bits);
+
+	/* Send request */
+	isp_serial_command(t, 'B');
+	if (isp_serial_write(t, buf, len) != len) {
+		printf("Unable to send set-baud-rate request.\n");
+		return -5;
+	}
+	/* Wait for answer */
+	ret = isp_get_ret_code(t, "set-baud-rate", 0, SERIAL_LATENCY_MS);
+	if (ret != 0) {
+		printf("Target refused to switch to %u bauds.\n", baudrate);
+		return ((ret < 0) ? ret : -ret);
+	}
+
+	/* Now switch host side */
+	if (isp_transport_set_baud(t, baudrate) != 0) {
+		printf("Unable to set host side baudrate to %u, target is lost.\n", baudrate);
+		return -3;
+	}
+	/* Drop anything received during the switch */
+	isp_serial_flush(t);
+	if (t->trace) {
+		printf("Now talking at %u bauds.\n", baudrate);
+	}
 
+	return 0;
+}
@@ -23,6 +23,9 @@
 #ifndef ISP_COMMANDS_H
 #define ISP_COMMANDS_H
 
+#include <stdint.h>
+#include "isp_transport.h"
+
 
 extern char* error_codes[];
 
@@ -51,73 +54,122 @@ extern char* error_codes[];
 /* Connect or reconnect to the target.
  * Return positive or NULL value when connection is OK, or negative value otherwise.
  */
-int isp_connect(unsigned int crystal_freq, int quiet);
+int isp_connect(struct isp_transport* t, unsigned int crystal_freq, int quiet);
+
+/* Abort the command in progress, if any, and drop pending replies */
+void isp_send_abort(struct isp_transport* t);
+
+/* Get back to 'baudrate' after a link failure.
+ * Returns 0 when the target answers at 'baudrate'. */
+int isp_link_fallback(struct isp_transport* t, unsigned int baudrate);
 
 
 /*
  * Helper functions
  */
-int isp_send_cmd_no_args(char* cmd_name, char* cmd, int quiet);
-int isp_send_cmd_two_args(char* cmd_name, char cmd, unsigned int arg1, unsigned int arg2);
-int isp_send_cmd_address(char cmd, uint32_t addr1, uint32_t addr2, uint32_t length, char* name);
-int isp_send_cmd_sectors(char* name, char cmd, int first_sector, int last_sector, int quiet);
+/* Parse the ISP return code at the start of "buf", "endptr" is set as by strtoul().
+ * Error codes are reported unless "quiet" is 1. */
+int isp_ret_code(struct isp_transport* t, char* buf, char** endptr, int quiet);
+
+int isp_send_cmd_no_args(struct isp_transport* t, char* cmd_name, char* cmd, int quiet);
+int isp_send_cmd_two_args(struct isp_transport* t, char* cmd_name, char cmd, unsigned int arg1, unsigned int arg2);
+int isp_send_cmd_address(struct isp_transport* t, char cmd, uint32_t addr1, uint32_t addr2, uint32_t length, char* name);
+int isp_send_cmd_sectors(struct isp_transport* t, char* name, char cmd, int first_sector, int last_sector, int quiet);
 
 
-int isp_cmd_unlock(int quiet);
+int isp_cmd_unlock(struct isp_transport* t, int quiet);
 
-int isp_cmd_read_uid(void);
+int isp_cmd_read_uid(struct isp_transport* t);
+/* Read the four words of the device unique ID to "uid" */
+int isp_read_uid(struct isp_transport* t, uint32_t* uid, int quiet);
 
-int isp_cmd_part_id(int quiet);
+int isp_cmd_part_id(struct isp_transport* t, int quiet);
 
-int isp_cmd_boot_version(void);
+int isp_cmd_boot_version(struct isp_transport* t);
 
 /*
  * read-memory
  * aruments : address count file
  * read 'count' bytes from 'address', store then in 'file'
  */
-int isp_cmd_read_memory(int arg_count, char** args);
+int isp_cmd_read_memory(struct isp_transport* t, int arg_count, char** args);
 /*
  * perform read-memory operation
  * read 'count' bytes from 'addr' to 'data' buffer
  */
-int isp_read_memory(char* data, uint32_t addr, unsigned int count, unsigned int uuencoded);
+int isp_read_memory(struct isp_transport* t, char* data, uint32_t addr, unsigned int count, unsigned int uuencoded);
+/*
+ * perform read-memory operation, streaming version
+ * read 'count' bytes from 'addr', each block is handed to 'sink' as soon as its checksum
+ * is verified and acknowledged. The sink returns 0 to go on, or any other value to stop
+ * the transfer.
+ * Returns the number of bytes handed to the sink, or a negative value on error.
+ */
+typedef int (*isp_read_sink)(void* priv, uint32_t addr, const char* data, unsigned int len);
+int isp_read_memory_stream(struct isp_transport* t, uint32_t addr, unsigned int count, unsigned int uuencoded,
+							isp_read_sink sink, void* priv);
+/* Sink writing the data to the file descriptor pointed to by 'priv' (int*) */
+int isp_read_sink_fd(void* priv, uint32_t addr, const char* data, unsigned int len);
 
 /*
  * write-to-ram
  * aruments : address file
  * send 'file' to 'address' in ram
  */
-int isp_cmd_write_to_ram(int arg_count, char** args);
+int isp_cmd_write_to_ram(struct isp_transport* t, int arg_count, char** args);
 /*
  * perform write-to-ram operation
  * send 'count' bytes from 'data' to 'addr' in RAM
  */
-int isp_send_buf_to_ram(char* data, unsigned long int addr, unsigned int count, unsigned int perform_uuencode);
+int isp_send_buf_to_ram(struct isp_transport* t, char* data, unsigned long int addr, unsigned int count, unsigned int perform_uuencode);
+
+/*
+ * Check the link with a write-to-ram / read-memory round trip of 'count' bytes at 'addr'
+ * in RAM. Returns the number of resends needed, or a negative value on failure.
+ */
+int isp_link_test(struct isp_transport* t, uint32_t addr, unsigned int count, unsigned int uuencoded);
 
 
-int isp_cmd_compare(int arg_count, char** args);
+int isp_cmd_compare(struct isp_transport* t, int arg_count, char** args);
 
-int isp_cmd_copy_ram_to_flash(int arg_count, char** args);
+int isp_cmd_copy_ram_to_flash(struct isp_transport* t, int arg_count, char** args);
 
 /*
  * go
  * aruments : address mode
  * execute program at 'address' (> 0x200) in 'mode' ('arm' or 'thumb')
  */
-int isp_cmd_go(int arg_count, char** args);
+int isp_cmd_go(struct isp_transport* t, int arg_count, char** args);
 /*
  * perform go operation
  * start user program at 'addr' in 'mode'
  * mode is 'T' for thumb or 'A' for arm.
  */
-int isp_send_cmd_go(uint32_t addr, char mode);
+int isp_send_cmd_go(struct isp_transport* t, uint32_t addr, char mode);
+
+/* Get the CRC-32 of "count" bytes at "addr" (read CRC checksum command, not supported by
+ * all parts).
+ * Returns 0 on success, the ISP return code or a negative value on error.
+ */
+int isp_read_crc(struct isp_transport* t, uint32_t addr, unsigned int count, uint32_t* crc);
+
+/*
+ * set-baud-rate
+ * aruments : baudrate [stop_bits]
+ * change the baudrate of the target, and then of the host
+ */
+int isp_cmd_set_baud_rate(struct isp_transport* t, int arg_count, char** args);
+/*
+ * perform set-baud-rate operation
+ * switch target and then host to 'baudrate' with 'stop_bits' (1 or 2) stop bits.
+ */
+int isp_send_cmd_set_baud_rate(struct isp_transport* t, unsigned int baudrate, unsigned int stop_bits);
 
-int isp_cmd_blank_check(int arg_count, char** args);
+int isp_cmd_blank_check(struct isp_transport* t, int arg_count, char** args);
 
-int isp_cmd_prepare_for_write(int arg_count, char** args);
+int isp_cmd_prepare_for_write(struct isp_transport* t, int arg_count, char** args);
 
-int isp_cmd_erase(int arg_count, char** args);
+int isp_cmd_erase(struct isp_transport* t, int arg_count, char** args);
 
 
 #endif /* ISP_COMMANDS_H */
@@ -0,0 +1,64 @@
+/*********************************************************************
+ *
+ *   LPC ISP - Non standard serial line speeds
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+/* This is kept out of isp_transport.c because the kernel termios2 definitions from
+ * <asm/termbits.h> conflict with the libc ones from <termios.h>.
+ */
+
+#include <stdio.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#endif
+
+
+/* Set any baudrate on a serial line, using termios2 and BOTHER.
+ * Returns 0 on success, negative value on error.
+ */
+int isp_serial_set_custom_speed(int fd, unsigned int baudrate)
+{
+#if defined(__linux__) && defined(BOTHER)
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) != 0) {
+		perror("Unable to get serial line settings");
+		return -1;
+	}
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_ospeed = baudrate;
+	tio.c_cflag &= ~(CBAUD << IBSHIFT);
+	tio.c_cflag |= (BOTHER << IBSHIFT);
+	tio.c_ispeed = baudrate;
+	if (ioctl(fd, TCSETS2, &tio) != 0) {
+		perror("Unable to set serial line speed");
+		return -1;
+	}
+	return 0;
+#else
+	(void)fd;
+	printf("Non standard baudrate %u not supported on this system.\n", baudrate);
+	return -3;
+#endif
+}
+
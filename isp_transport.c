@@ -0,0 +1,921 @@
+/*********************************************************************
+ *
+ *   LPC ISP - Transport layer
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+#define _GNU_SOURCE /* posix_openpt, ptsname */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <unistd.h> /* for open, close */
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include <string.h> /* memcpy, strncmp */
+
+#include <termios.h> /* serial */
+#include <poll.h>
+
+#include <sys/socket.h> /* tcp */
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "isp_utils.h"
+#include "isp_transport.h"
+
+
+/* ---- File descriptor based transports helpers ----------------------------------*/
+
+/* Wait for "events" on fd until deadline.
+ * Returns 1 when ready, 0 on timeout, or -1 on error.
+ */
+static int isp_fd_poll(int fd, short events, struct timespec* deadline)
+{
+	struct pollfd pfd;
+	int ret = 0;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	do {
+		ret = poll(&pfd, 1, isp_deadline_remaining_ms(deadline));
+	} while ((ret < 0) && (errno == EINTR));
+
+	if (ret < 0) {
+		perror("Serial poll error");
+		return -1;
+	}
+	if ((ret > 0) && (pfd.revents & POLLNVAL)) {
+		printf("serial_poll: invalid file descriptor.\n");
+		return -1;
+	}
+	/* POLLERR and POLLHUP are reported by the following read() or write() */
+	return (ret > 0) ? 1 : 0;
+}
+
+static int isp_fd_read(struct isp_transport* t, char* buf, unsigned int len, struct timespec* deadline)
+{
+	int nb = 0;
+
+	do {
+		nb = read(t->fd, buf, len);
+		if (nb > 0) {
+			return nb;
+		}
+		if (nb == 0) {
+			printf("serial_read: end of file !!!!\n");
+			return -2;
+		}
+		if (errno == EINTR) {
+			nb = 1;
+			continue;
+		}
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+			perror("Serial read error");
+			return -1;
+		}
+		nb = isp_fd_poll(t->fd, POLLIN, deadline);
+	} while (nb > 0);
+
+	return nb;
+}
+
+static int isp_fd_write(struct isp_transport* t, const char* buf, unsigned int len, struct timespec* deadline)
+{
+	int nb = 0;
+
+	do {
+		nb = write(t->fd, buf, len);
+		if (nb >= 0) {
+			return nb;
+		}
+		if (errno == EINTR) {
+			nb = 1;
+			continue;
+		}
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+			perror("Serial write error");
+			return -1;
+		}
+		nb = isp_fd_poll(t->fd, POLLOUT, deadline);
+	} while (nb > 0);
+
+	return nb;
+}
+
+static void isp_fd_close(struct isp_transport* t)
+{
+	if (t->fd >= 0) {
+		close(t->fd);
+		t->fd = -1;
+	}
+}
+
+
+/* ---- Serial line ----------------------------------------------------------------*/
+
+struct serial_speed {
+	unsigned int baudrate;
+	speed_t speed;
+};
+
+static struct serial_speed serial_speeds[] = {
+	{ 1200, B1200 },
+	{ 2400, B2400 },
+	{ 4800, B4800 },
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+	{ 57600, B57600 },
+	{ 115200, B115200 },
+#ifdef B230400
+	{ 230400, B230400 },
+#endif
+#ifdef B460800
+	{ 460800, B460800 },
+#endif
+#ifdef B921600
+	{ 921600, B921600 },
+#endif
+	{ 0, B0 },
+};
+
+static int isp_serial_speed(unsigned int baudrate, speed_t* speed)
+{
+	int i = 0;
+
+	for (i = 0; serial_speeds[i].baudrate != 0; i++) {
+		if (serial_speeds[i].baudrate == baudrate) {
+			*speed = serial_speeds[i].speed;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* In isp_serial_bother.c */
+int isp_serial_set_custom_speed(int fd, unsigned int baudrate);
+
+/* Change line speed once all pending output has been sent.
+ * Speeds without a termios constant are set using termios2 (Linux only).
+ */
+static int isp_serial_set_baud(struct isp_transport* t, unsigned int baudrate)
+{
+	struct termios tio;
+	speed_t speed;
+
+	if (isp_serial_speed(baudrate, &speed) != 0) {
+		tcdrain(t->fd);
+		if (isp_serial_set_custom_speed(t->fd, baudrate) != 0) {
+			printf("Unsupported baudrate: %u.\n", baudrate);
+			return -3;
+		}
+		t->baudrate = baudrate;
+		return 0;
+	}
+	if (tcgetattr(t->fd, &tio) != 0) {
+		perror("Unable to get serial line settings");
+		return -1;
+	}
+	cfsetospeed(&tio, speed);
+	cfsetispeed(&tio, speed);
+	if (tcsetattr(t->fd, TCSADRAIN, &tio) != 0) {
+		perror("Unable to set serial line speed");
+		return -1;
+	}
+	t->baudrate = baudrate;
+	return 0;
+}
+
+/* Open the serial device and set it up.
+ * Actal setup is done according to LPC11xx user's manual.
+ * Only baudrate can be changed using command line option.
+ */
+static int isp_serial_open(struct isp_transport* t, char* path)
+{
+	struct termios tio;
+	speed_t speed = B115200;
+	int custom_speed = 0;
+
+	if (isp_serial_speed(t->baudrate, &speed) != 0) {
+		custom_speed = 1; /* Set using termios2 once the line is configured */
+		speed = B115200;
+	}
+
+	/* Open serial port */
+	t->fd = open(path, O_RDWR | O_NONBLOCK | O_NOCTTY);
+	if (t->fd < 0) {
+		perror("Unable to open serial_device");
+		printf("Tried to open \"%s\".\n", path);
+		return -1;
+	}
+	/* Setup serial port */
+	memset(&tio, 0, sizeof(tio));
+	tio.c_iflag = IXON | IXOFF;  /* See section 21.4.4 of LPC11xx user's manual (UM10398) */
+	tio.c_cflag = CS8 | CREAD | CLOCAL;  /* 8n1, see termios.h for more information */
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 5;
+	cfsetospeed(&tio, speed);
+	cfsetispeed(&tio, speed);
+	tcsetattr(t->fd, TCSANOW, &tio);
+	if (custom_speed) {
+		return isp_serial_set_baud(t, t->baudrate);
+	}
+
+	return 0;
+}
+
+static int isp_serial_drain(struct isp_transport* t)
+{
+	return tcdrain(t->fd);
+}
+
+static struct isp_transport_ops serial_ops = {
+	.name = "serial",
+	.open = isp_serial_open,
+	.read = isp_fd_read,
+	.write = isp_fd_write,
+	.drain = isp_serial_drain,
+	.set_baud = isp_serial_set_baud,
+	.close = isp_fd_close,
+};
+
+
+/* ---- Pseudo-terminal ------------------------------------------------------------*/
+
+struct isp_pty {
+	int slave_fd; /* Keep the slave side open so the master does not get hung up */
+	char* slave_name;
+};
+
+static int isp_pty_set_raw(int fd)
+{
+	struct termios tio;
+
+	if (tcgetattr(fd, &tio) != 0) {
+		perror("Unable to get pseudo-terminal settings");
+		return -1;
+	}
+	cfmakeraw(&tio);
+	return tcsetattr(fd, TCSANOW, &tio);
+}
+
+/* An empty path creates a new pseudo-terminal, else the path is the one of an existing
+ * pseudo-terminal. There is no line speed on a pseudo-terminal, the baudrate is only used
+ * for timeouts. */
+static int isp_pty_open(struct isp_transport* t, char* path)
+{
+	struct isp_pty* pty = NULL;
+	char* name = NULL;
+
+	if (path[0] != '\0') {
+		t->fd = open(path, O_RDWR | O_NONBLOCK | O_NOCTTY);
+		if (t->fd < 0) {
+			perror("Unable to open pseudo-terminal");
+			printf("Tried to open \"%s\".\n", path);
+			return -1;
+		}
+		return isp_pty_set_raw(t->fd);
+	}
+
+	pty = calloc(1, sizeof(struct isp_pty));
+	if (pty == NULL) {
+		printf("Unable to allocate pseudo-terminal data.\n");
+		return -4;
+	}
+	pty->slave_fd = -1;
+	t->priv = pty;
+	t->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if ((t->fd < 0) || (grantpt(t->fd) != 0) || (unlockpt(t->fd) != 0)) {
+		perror("Unable to create pseudo-terminal");
+		return -1;
+	}
+	name = ptsname(t->fd);
+	if (name == NULL) {
+		perror("Unable to get pseudo-terminal name");
+		return -1;
+	}
+	pty->slave_name = strdup(name);
+	pty->slave_fd = open(pty->slave_name, O_RDWR | O_NOCTTY);
+	if (pty->slave_fd < 0) {
+		perror("Unable to open pseudo-terminal slave");
+		return -1;
+	}
+	if (isp_pty_set_raw(pty->slave_fd) != 0) {
+		return -1;
+	}
+	printf("Pseudo-terminal slave is %s\n", pty->slave_name);
+	return 0;
+}
+
+static int isp_pty_drain(struct isp_transport* t __attribute__((unused)))
+{
+	return 0;
+}
+
+static int isp_pty_set_baud(struct isp_transport* t, unsigned int baudrate)
+{
+	t->baudrate = baudrate;
+	return 0;
+}
+
+static void isp_pty_close(struct isp_transport* t)
+{
+	struct isp_pty* pty = t->priv;
+
+	isp_fd_close(t);
+	if (pty != NULL) {
+		if (pty->slave_fd >= 0) {
+			close(pty->slave_fd);
+		}
+		free(pty->slave_name);
+		free(pty);
+		t->priv = NULL;
+	}
+}
+
+static struct isp_transport_ops pty_ops = {
+	.name = "pty",
+	.open = isp_pty_open,
+	.read = isp_fd_read,
+	.write = isp_fd_write,
+	.drain = isp_pty_drain,
+	.set_baud = isp_pty_set_baud,
+	.close = isp_pty_close,
+};
+
+
+/* ---- TCP socket -----------------------------------------------------------------*/
+
+/* Path is "host:port". The line speed is set on the serial server side, the baudrate is
+ * only used for timeouts. */
+static int isp_tcp_open(struct isp_transport* t, char* path)
+{
+	struct addrinfo hints;
+	struct addrinfo* res = NULL;
+	struct addrinfo* ai = NULL;
+	char* host = strdup(path);
+	char* port = NULL;
+	int ret = 0, one = 1;
+
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		printf("TCP transport needs \"host:port\", got \"%s\".\n", path);
+		free(host);
+		return -2;
+	}
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret != 0) {
+		printf("Unable to resolve \"%s\": %s\n", path, gai_strerror(ret));
+		free(host);
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		t->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (t->fd < 0) {
+			continue;
+		}
+		if (connect(t->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(t->fd);
+		t->fd = -1;
+	}
+	freeaddrinfo(res);
+	free(host);
+	if (t->fd < 0) {
+		perror("Unable to connect to serial server");
+		printf("Tried to connect to \"%s\".\n", path);
+		return -1;
+	}
+	/* Commands are small, do not let them wait for more data */
+	setsockopt(t->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(t->fd, F_SETFL, (fcntl(t->fd, F_GETFL) | O_NONBLOCK));
+
+	return 0;
+}
+
+static int isp_tcp_write(struct isp_transport* t, const char* buf, unsigned int len, struct timespec* deadline)
+{
+	int nb = 0;
+
+	do {
+		nb = send(t->fd, buf, len, MSG_NOSIGNAL);
+		if (nb >= 0) {
+			return nb;
+		}
+		if (errno == EINTR) {
+			nb = 1;
+			continue;
+		}
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+			perror("Socket write error");
+			return -1;
+		}
+		nb = isp_fd_poll(t->fd, POLLOUT, deadline);
+	} while (nb > 0);
+
+	return nb;
+}
+
+static struct isp_transport_ops tcp_ops = {
+	.name = "tcp",
+	.open = isp_tcp_open,
+	.read = isp_fd_read,
+	.write = isp_tcp_write,
+	.drain = isp_pty_drain,
+	.set_baud = isp_pty_set_baud,
+	.close = isp_fd_close,
+};
+
+
+/* ---- In-memory loopback ---------------------------------------------------------*/
+
+struct isp_loop {
+	char* buf;
+	unsigned int size;
+	unsigned int start; /* First byte not read yet */
+	unsigned int end;
+	isp_loop_peer peer;
+	void* peer_priv;
+};
+
+static int isp_loop_open(struct isp_transport* t, char* path __attribute__((unused)))
+{
+	struct isp_loop* loop = malloc(sizeof(struct isp_loop));
+
+	if (loop == NULL) {
+		printf("Unable to allocate loopback data.\n");
+		return -4;
+	}
+	memset(loop, 0, sizeof(struct isp_loop));
+	t->priv = loop;
+	return 0;
+}
+
+/* Nothing can get in the loop while we wait, so the read never waits */
+static int isp_loop_read(struct isp_transport* t, char* buf, unsigned int len,
+							struct timespec* deadline __attribute__((unused)))
+{
+	struct isp_loop* loop = t->priv;
+	unsigned int avail = loop->end - loop->start;
+
+	if (len > avail) {
+		len = avail;
+	}
+	memcpy(buf, (loop->buf + loop->start), len);
+	loop->start += len;
+	if (loop->start == loop->end) {
+		loop->start = 0;
+		loop->end = 0;
+	}
+	return len;
+}
+
+static int isp_loop_write(struct isp_transport* t, const char* buf, unsigned int len,
+							struct timespec* deadline __attribute__((unused)))
+{
+	struct isp_loop* loop = t->priv;
+
+	if (loop->peer != NULL) {
+		return loop->peer(t, buf, len, loop->peer_priv);
+	}
+	return isp_transport_loop_push(t, buf, len);
+}
+
+static void isp_loop_close(struct isp_transport* t)
+{
+	struct isp_loop* loop = t->priv;
+
+	if (loop != NULL) {
+		free(loop->buf);
+		free(loop);
+		t->priv = NULL;
+	}
+}
+
+static struct isp_transport_ops loop_ops = {
+	.name = "loop",
+	.open = isp_loop_open,
+	.read = isp_loop_read,
+	.write = isp_loop_write,
+	.drain = isp_pty_drain,
+	.set_baud = isp_pty_set_baud,
+	.close = isp_loop_close,
+};
+
+void isp_transport_loop_set_peer(struct isp_transport* t, isp_loop_peer peer, void* priv)
+{
+	struct isp_loop* loop = t->priv;
+
+	if (t->ops != &loop_ops) {
+		return;
+	}
+	loop->peer = peer;
+	loop->peer_priv = priv;
+}
+
+/* Queue data to be read from the loopback */
+int isp_transport_loop_push(struct isp_transport* t, const char* buf, unsigned int len)
+{
+	struct isp_loop* loop = t->priv;
+
+	if (t->ops != &loop_ops) {
+		return -1;
+	}
+	if ((loop->end + len) > loop->size) {
+		/* Move unread data to the beginning of the buffer, and grow it if needed */
+		unsigned int used = loop->end - loop->start;
+		memmove(loop->buf, (loop->buf + loop->start), used);
+		loop->start = 0;
+		loop->end = used;
+		if ((used + len) > loop->size) {
+			char* tmp = realloc(loop->buf, (used + len) * 2);
+			if (tmp == NULL) {
+				printf("Unable to grow loopback buffer.\n");
+				return -1;
+			}
+			loop->buf = tmp;
+			loop->size = (used + len) * 2;
+		}
+	}
+	memcpy((loop->buf + loop->end), buf, len);
+	loop->end += len;
+	return len;
+}
+
+
+/* ---- Fault injection -------------------------------------------------------------*/
+
+/* Path is "settings:device", where device is any other transport and settings a coma
+ * separated list of "key=value" fault injection settings, for both directions :
+ *   - corrupt=P : probability for each byte to get one bit flipped
+ *   - drop=P : probability for each byte to be lost
+ *   - dup=P : probability for each byte to be doubled
+ *   - lose=P : probability for each chunk of data (request or reply) to be lost
+ *   - delay=P : probability for each chunk of data to be delayed by delay_ms
+ *   - delay_ms=N : delay in milliseconds, defaults to 200
+ *   - seed=N : seed of the random generator, for reproducible runs
+ */
+#define FAULT_BUF_SIZE  4096
+
+struct isp_fault {
+	struct isp_transport* inner;
+	double corrupt;
+	double drop;
+	double dup;
+	double lose;
+	double delay;
+	unsigned int delay_ms;
+	uint64_t rand_state;
+	/* Received data, after fault injection, and when it can be read */
+	char pending[2 * FAULT_BUF_SIZE];
+	unsigned int pending_len;
+	struct timespec release;
+	/* Statistics */
+	unsigned int nb_corrupted;
+	unsigned int nb_dropped;
+	unsigned int nb_duplicated;
+	unsigned int nb_lost;
+	unsigned int nb_delayed;
+};
+
+/* xorshift64*, uniform in [0, 1) */
+static double isp_fault_random(struct isp_fault* fault)
+{
+	uint64_t x = fault->rand_state;
+
+	x ^= (x >> 12);
+	x ^= (x << 25);
+	x ^= (x >> 27);
+	fault->rand_state = x;
+	return (((x * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+static int isp_fault_hit(struct isp_fault* fault, double rate, unsigned int* count)
+{
+	if ((rate > 0) && (isp_fault_random(fault) < rate)) {
+		(*count)++;
+		return 1;
+	}
+	return 0;
+}
+
+/* Copy "len" bytes from "src" to "dest" with byte faults. "dest" must hold twice "len".
+ * Returns the number of bytes in "dest". */
+static unsigned int isp_fault_mangle(struct isp_fault* fault, const char* src, unsigned int len, char* dest)
+{
+	unsigned int i = 0, out = 0;
+
+	if (isp_fault_hit(fault, fault->lose, &fault->nb_lost)) {
+		return 0;
+	}
+	for (i = 0; i < len; i++) {
+		char c = src[i];
+		if (isp_fault_hit(fault, fault->drop, &fault->nb_dropped)) {
+			continue;
+		}
+		if (isp_fault_hit(fault, fault->corrupt, &fault->nb_corrupted)) {
+			c ^= (1 << (int)(isp_fault_random(fault) * 8));
+		}
+		dest[out++] = c;
+		if (isp_fault_hit(fault, fault->dup, &fault->nb_duplicated)) {
+			dest[out++] = c;
+		}
+	}
+	return out;
+}
+
+static int isp_fault_open(struct isp_transport* t, char* path)
+{
+	struct isp_fault* fault = NULL;
+	char* settings = strdup(path);
+	char* device = NULL;
+	char* setting = NULL;
+	char* saveptr = NULL;
+	int ret = 0;
+
+	device = strchr(settings, ':');
+	if (device == NULL) {
+		printf("Fault injection transport needs \"settings:device\", got \"%s\".\n", path);
+		free(settings);
+		return -2;
+	}
+	*device++ = '\0';
+
+	fault = malloc(sizeof(struct isp_fault));
+	if (fault == NULL) {
+		printf("Unable to allocate fault injection data.\n");
+		free(settings);
+		return -4;
+	}
+	memset(fault, 0, sizeof(struct isp_fault));
+	fault->delay_ms = 200;
+	fault->rand_state = 0x9E3779B97F4A7C15ULL;
+	t->priv = fault;
+
+	for (setting = strtok_r(settings, ",", &saveptr); setting != NULL; setting = strtok_r(NULL, ",", &saveptr)) {
+		char* value = strchr(setting, '=');
+		double* rate = NULL;
+
+		if (value == NULL) {
+			printf("Fault injection setting \"%s\" has no value.\n", setting);
+			ret = -2;
+			goto out;
+		}
+		*value++ = '\0';
+		if (strcmp(setting, "corrupt") == 0) {
+			rate = &fault->corrupt;
+		} else if (strcmp(setting, "drop") == 0) {
+			rate = &fault->drop;
+		} else if (strcmp(setting, "dup") == 0) {
+			rate = &fault->dup;
+		} else if (strcmp(setting, "lose") == 0) {
+			rate = &fault->lose;
+		} else if (strcmp(setting, "delay") == 0) {
+			rate = &fault->delay;
+		} else if (strcmp(setting, "delay_ms") == 0) {
+			fault->delay_ms = strtoul(value, NULL, 0);
+			continue;
+		} else if (strcmp(setting, "seed") == 0) {
+			/* The generator state must not be nul */
+			fault->rand_state ^= strtoull(value, NULL, 0) * 0xBF58476D1CE4E5B9ULL;
+			if (fault->rand_state == 0) {
+				fault->rand_state = 1;
+			}
+			continue;
+		} else {
+			printf("Unknown fault injection setting \"%s\".\n", setting);
+			ret = -2;
+			goto out;
+		}
+		*rate = strtod(value, NULL);
+	}
+
+	fault->inner = isp_transport_open(device, t->baudrate);
+	if (fault->inner == NULL) {
+		ret = -1;
+		goto out;
+	}
+	t->fd = fault->inner->fd;
+
+out:
+	free(settings);
+	return ret;
+}
+
+static int isp_fault_read(struct isp_transport* t, char* buf, unsigned int len, struct timespec* deadline)
+{
+	struct isp_fault* fault = t->priv;
+	char data[FAULT_BUF_SIZE];
+	int nb = 0;
+
+	while (fault->pending_len == 0) {
+		nb = fault->inner->ops->read(fault->inner, data, FAULT_BUF_SIZE, deadline);
+		if (nb <= 0) {
+			return nb;
+		}
+		fault->pending_len = isp_fault_mangle(fault, data, nb, fault->pending);
+		isp_deadline_set(&fault->release, 0);
+		if (isp_fault_hit(fault, fault->delay, &fault->nb_delayed)) {
+			isp_deadline_set(&fault->release, fault->delay_ms);
+		}
+	}
+	/* Delayed data is not there before its release time */
+	if (isp_deadline_remaining_ms(&fault->release) > isp_deadline_remaining_ms(deadline)) {
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+		return 0;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &fault->release, NULL);
+
+	if (len > fault->pending_len) {
+		len = fault->pending_len;
+	}
+	memcpy(buf, fault->pending, len);
+	fault->pending_len -= len;
+	memmove(fault->pending, &fault->pending[len], fault->pending_len);
+	return len;
+}
+
+static int isp_fault_write(struct isp_transport* t, const char* buf, unsigned int len, struct timespec* deadline)
+{
+	struct isp_fault* fault = t->priv;
+	char data[2 * FAULT_BUF_SIZE];
+	unsigned int size = 0, done = 0;
+
+	if (len > FAULT_BUF_SIZE) {
+		len = FAULT_BUF_SIZE;
+	}
+	size = isp_fault_mangle(fault, buf, len, data);
+	if (isp_fault_hit(fault, fault->delay, &fault->nb_delayed)) {
+		usleep(fault->delay_ms * 1000);
+	}
+	while (done < size) {
+		int nb = fault->inner->ops->write(fault->inner, (data + done), (size - done), deadline);
+		if (nb <= 0) {
+			return nb;
+		}
+		done += nb;
+	}
+	return len;
+}
+
+static int isp_fault_drain(struct isp_transport* t)
+{
+	struct isp_fault* fault = t->priv;
+
+	return isp_transport_drain(fault->inner);
+}
+
+static int isp_fault_set_baud(struct isp_transport* t, unsigned int baudrate)
+{
+	struct isp_fault* fault = t->priv;
+	int ret = 0;
+
+	ret = isp_transport_set_baud(fault->inner, baudrate);
+	if (ret == 0) {
+		t->baudrate = baudrate;
+	}
+	return ret;
+}
+
+static void isp_fault_close(struct isp_transport* t)
+{
+	struct isp_fault* fault = t->priv;
+
+	if (fault == NULL) {
+		return;
+	}
+	if (fault->nb_corrupted || fault->nb_dropped || fault->nb_duplicated || fault->nb_lost || fault->nb_delayed) {
+		printf("Injected faults : %u byte(s) corrupted, %u dropped, %u doubled, %u chunk(s) lost, %u delayed.\n",
+				fault->nb_corrupted, fault->nb_dropped, fault->nb_duplicated, fault->nb_lost, fault->nb_delayed);
+	}
+	isp_transport_close(fault->inner);
+	free(fault);
+	t->priv = NULL;
+	t->fd = -1;
+}
+
+static struct isp_transport_ops fault_ops = {
+	.name = "fault",
+	.open = isp_fault_open,
+	.read = isp_fault_read,
+	.write = isp_fault_write,
+	.drain = isp_fault_drain,
+	.set_baud = isp_fault_set_baud,
+	.close = isp_fault_close,
+};
+
+
+char* isp_transport_pty_name(struct isp_transport* t)
+{
+	struct isp_pty* pty = t->priv;
+
+	if ((t->ops == &fault_ops) && (t->priv != NULL)) {
+		return isp_transport_pty_name(((struct isp_fault*)t->priv)->inner);
+	}
+	if ((t->ops != &pty_ops) || (pty == NULL)) {
+		return NULL;
+	}
+	return pty->slave_name;
+}
+
+
+/* ---- Transport selection --------------------------------------------------------*/
+
+struct transport_prefix {
+	char* prefix;
+	struct isp_transport_ops* ops;
+};
+
+static struct transport_prefix transports[] = {
+	{ "tcp:", &tcp_ops },
+	{ "pty:", &pty_ops },
+	{ "loop:", &loop_ops },
+	{ "fault:", &fault_ops },
+	{ NULL, &serial_ops }, /* Default, must be last */
+};
+
+struct isp_transport* isp_transport_open(char* device, unsigned int baudrate)
+{
+	struct isp_transport* t = NULL;
+	int i = 0;
+
+	if (device == NULL) {
+		printf("No serial device given on command line\n");
+		return NULL;
+	}
+	if (baudrate == 0) {
+		printf("Invalid baudrate: %u.\n", baudrate);
+		return NULL;
+	}
+
+	t = malloc(sizeof(struct isp_transport));
+	if (t == NULL) {
+		printf("Unable to allocate transport.\n");
+		return NULL;
+	}
+	memset(t, 0, sizeof(struct isp_transport));
+	t->fd = -1;
+	t->baudrate = baudrate;
+
+	for (i = 0; transports[i].prefix != NULL; i++) {
+		if (strncmp(device, transports[i].prefix, strlen(transports[i].prefix)) == 0) {
+			device += strlen(transports[i].prefix);
+			break;
+		}
+	}
+	t->ops = transports[i].ops;
+
+	if (t->ops->open(t, device) != 0) {
+		isp_transport_close(t);
+		return NULL;
+	}
+	return t;
+}
+
+void isp_transport_close(struct isp_transport* t)
+{
+	if (t == NULL) {
+		return;
+	}
+	t->ops->close(t);
+	free(t);
+}
+
+int isp_transport_set_baud(struct isp_transport* t, unsigned int baudrate)
+{
+	return t->ops->set_baud(t, baudrate);
+}
+
+int isp_transport_drain(struct isp_transport* t)
+{
+	return t->ops->drain(t);
+}
+
@@ -0,0 +1,131 @@
+/*********************************************************************
+ *
+ *   LPC ISP - Transport layer
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+#ifndef ISP_TRANSPORT_H
+#define ISP_TRANSPORT_H
+
+#include <time.h> /* struct timespec */
+
+
+struct isp_transport;
+struct part_desc;
+
+/* Transport operations.
+ * read and write must not block past "deadline". They return the number of bytes
+ * transfered, 0 on timeout, or a negative value on error (end of file included).
+ */
+struct isp_transport_ops {
+	char* name;
+	int (*open)(struct isp_transport* t, char* path);
+	int (*read)(struct isp_transport* t, char* buf, unsigned int len, struct timespec* deadline);
+	int (*write)(struct isp_transport* t, const char* buf, unsigned int len, struct timespec* deadline);
+	/* Wait for all written data to be sent on the line */
+	int (*drain)(struct isp_transport* t);
+	int (*set_baud)(struct isp_transport* t, unsigned int baudrate);
+	void (*close)(struct isp_transport* t);
+};
+
+/* Size of the receive ring buffer, must be a power of two.
+ * Big enougth to hold a full uuencoded block with its checksum. */
+#define ISP_RX_RING_SIZE 4096
+
+/* Session with one target.
+ * All the ISP operations get it, so that sessions with different targets can be run
+ * from different threads. The only process wide data (uuencode kernel, CRC table) is
+ * set up once and read only afterwards.
+ */
+struct isp_transport {
+	struct isp_transport_ops* ops;
+	int fd;
+	unsigned int baudrate; /* Line speed in bits per second, used for timeouts */
+	void* priv; /* Transport specific data */
+	/* Target part once identified, NULL before. Belongs to the parts database (see
+	 * parts.h), which may be shared by sessions. */
+	struct part_desc* part;
+	/* Receive ring buffer, see isp_serial_* functions in isp_utils.c */
+	char rx_buf[ISP_RX_RING_SIZE];
+	unsigned int rx_head; /* Index of the first byte not consumed */
+	unsigned int rx_count; /* Number of bytes received and not consumed */
+	struct timespec last_rx; /* When data was last received */
+	/* When the data written so far is out on the line, the device can not reply before */
+	struct timespec tx_end;
+	/* Minimum time between data received from the device and the next request, for
+	 * devices which are not ready right after replying. 0 when not needed. */
+	unsigned int cmd_gap_us;
+	/* Trace of the communication with the target : 1 for the data sent and the protocol
+	 * steps, 2 to also dump all data received. */
+	int trace;
+	/* Link statistics, updated by the isp commands */
+	unsigned int resends; /* Data blocks transfered again after a checksum error */
+	unsigned int link_history; /* One bit per data block, set if resent, last in bit 0 */
+	unsigned int downgrades; /* Automatic link speed reductions */
+	/* Lowest baudrate for automatic link speed reduction when too many blocks are resent,
+	 * 0 to disable (see isp_read_memory() and isp_send_buf_to_ram()) */
+	unsigned int min_baudrate;
+	/* Traffic statistics, updated by the isp_serial_* functions */
+	unsigned int tx_bytes;
+	unsigned int rx_bytes;
+	unsigned int round_trips; /* Replies started, each one after data has been sent */
+	int reply_wait; /* Data has been sent since data was last received */
+	/* Time spent and number of requests for each ISP command, indexed by command letter
+	 * from 'A', a command lasting until the next request (see isp_serial_command()) */
+	char cur_cmd;
+	struct timespec cmd_start;
+	double cmd_time[26];
+	unsigned int cmd_count[26];
+};
+
+
+/* Open a transport to the target.
+ * "device" selects the transport :
+ *   - "tcp:host:port" : TCP connection to a serial server (ser2net or equivalent)
+ *   - "pty:" : create a new pseudo-terminal, the slave path is printed
+ *   - "pty:/dev/pts/N" : use an existing pseudo-terminal
+ *   - "loop:" : in-memory loopback (see isp_transport_loop_set_peer())
+ *   - "fault:settings:device" : inject faults on the data going through "device", which
+ *     is any of the other transports (see isp_fault_open() for the settings)
+ *   - anything else is a serial device path.
+ * Returns NULL on error.
+ */
+struct isp_transport* isp_transport_open(char* device, unsigned int baudrate);
+void isp_transport_close(struct isp_transport* t);
+
+/* Change the host side line speed. */
+int isp_transport_set_baud(struct isp_transport* t, unsigned int baudrate);
+
+/* Wait for all written data to be sent on the line */
+int isp_transport_drain(struct isp_transport* t);
+
+/* Name of the slave side of a "pty:" transport, NULL for other transports */
+char* isp_transport_pty_name(struct isp_transport* t);
+
+
+/* In-memory loopback.
+ * Without peer, data written is read back. When a peer is set, each write is handed to
+ * the peer which may queue a reply using isp_transport_loop_push().
+ */
+typedef int (*isp_loop_peer)(struct isp_transport* t, const char* buf, unsigned int len, void* priv);
+void isp_transport_loop_set_peer(struct isp_transport* t, isp_loop_peer peer, void* priv);
+int isp_transport_loop_push(struct isp_transport* t, const char* buf, unsigned int len);
+
+
+#endif /* ISP_TRANSPORT_H */
@@ -33,13 +33,16 @@
 
 #include <string.h> /* memcpy */
 
-#include <termios.h> /* serial */
+#include <time.h> /* clock_gettime */
 #include <ctype.h>
+#include <pthread.h> /* pthread_once */
+
+#include "isp_utils.h"
+#include "isp_transport.h"
 
 
 #define FILE_CREATE_MODE (S_IRUSR | S_IWUSR | S_IRGRP)
 
-extern int trace_on;
 
 /* display data as in hexdump -C :
    00000000  7f 45 4c 46 02 01 01 00  00 00 00 00 00 00 00 00  |.ELF............|
@@ -92,291 +95,456 @@ void isp_dump(const unsigned char* buf, unsigned int buf_size)
 	printf("|\n");
 }
 
+/* CRC-32 (polynomial 0x04C11DB7, reflected), as computed by the ISP read CRC command.
+ * The table is built once, whatever the number of threads using it. */
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
 
-/* ---- Serial utility functions ---------------------------------------------------*/
+static void isp_crc32_table_init(void)
+{
+	unsigned int i = 0;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i;
+		int bit = 0;
+		for (bit = 0; bit < 8; bit++) {
+			c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+		}
+		crc32_table[i] = c;
+	}
+}
+
+uint32_t isp_crc32(const char* data, unsigned int len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	unsigned int i = 0;
+
+	pthread_once(&crc32_table_once, isp_crc32_table_init);
+	for (i = 0; i < len; i++) {
+		crc = crc32_table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return (crc ^ 0xFFFFFFFF);
+}
+
+
+/* ---- Deadline utility functions -------------------------------------------------*/
+
+void isp_deadline_set(struct timespec* deadline, unsigned int timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += (timeout_ms / 1000);
+	deadline->tv_nsec += ((timeout_ms % 1000) * 1000000);
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+int isp_deadline_remaining_ms(struct timespec* deadline)
+{
+	struct timespec now;
+	long int remaining = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	remaining = ((deadline->tv_sec - now.tv_sec) * 1000) +
+				((deadline->tv_nsec - now.tv_nsec) / 1000000);
+	if (remaining < 0) {
+		remaining = 0;
+	}
+	return remaining;
+}
 
-static int serial_fd = -1;
 
-/* Open the serial device and set it up.
- * Returns 0 on success, negativ value on error.
- * Actal setup is done according to LPC11xx user's manual.
- * Only baudrate can be changed using command line option.
+/* ---- Serial utility functions ---------------------------------------------------*/
+
+/* Compute the time allowed to transfer "nb_bytes" on the line and get the device
+ * reply started.
+ * 8n1 : 10 bits on the line for each byte. Use twice the theoretical time to be safe with
+ * USB to serial adapters which buffer data.
  */
-int isp_serial_open(int baudrate, char* serial_device)
+static unsigned int isp_serial_timeout_ms(struct isp_transport* t, unsigned int nb_bytes,
+											unsigned int latency_ms)
 {
-	struct termios tio;
+	unsigned int wire_ms = ((nb_bytes * 10 * 1000) / t->baudrate) + 1;
 
-	if (serial_device == NULL) {
-		printf("No serial device given on command line\n");
-		return -2;
+	return latency_ms + (2 * wire_ms);
+}
+
+/* Set "deadline" to "timeout_ms" milliseconds after the end of the transmission of the
+ * data already written, as write() returns once the data is buffered by the system. */
+static void isp_serial_deadline(struct isp_transport* t, struct timespec* deadline, unsigned int timeout_ms)
+{
+	isp_deadline_set(deadline, 0);
+	if ((t->tx_end.tv_sec > deadline->tv_sec) ||
+			((t->tx_end.tv_sec == deadline->tv_sec) && (t->tx_end.tv_nsec > deadline->tv_nsec))) {
+		*deadline = t->tx_end;
 	}
+	deadline->tv_sec += (timeout_ms / 1000);
+	deadline->tv_nsec += ((timeout_ms % 1000) * 1000000);
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
 
-	/* Open serial port */
-	serial_fd = open(serial_device, O_RDWR | O_NONBLOCK);
-	if (serial_fd < 0) {
-		perror("Unable to open serial_device");
-		printf("Tried to open \"%s\".\n", serial_device);
-		return -1;
+/* Account for "nb_bytes" written, which leave the line after the previous ones */
+static void isp_serial_tx_account(struct isp_transport* t, unsigned int nb_bytes)
+{
+	struct timespec now;
+	uint64_t wire_ns = (((uint64_t)nb_bytes * 10 * 1000000000ULL) / t->baudrate);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((t->tx_end.tv_sec < now.tv_sec) ||
+			((t->tx_end.tv_sec == now.tv_sec) && (t->tx_end.tv_nsec < now.tv_nsec))) {
+		t->tx_end = now;
+	}
+	t->tx_end.tv_sec += (wire_ns / 1000000000ULL);
+	t->tx_end.tv_nsec += (wire_ns % 1000000000ULL);
+	if (t->tx_end.tv_nsec >= 1000000000) {
+		t->tx_end.tv_sec++;
+		t->tx_end.tv_nsec -= 1000000000;
 	}
-	/* Setup serial port */
-	memset(&tio, 0, sizeof(tio));
-	tio.c_iflag = IXON | IXOFF;  /* See section 21.4.4 of LPC11xx user's manual (UM10398) */
-	tio.c_cflag = CS8 | CREAD | CLOCAL;  /* 8n1, see termios.h for more information */
-	tio.c_cc[VMIN] = 1;
-	tio.c_cc[VTIME] = 5;
-	cfsetospeed(&tio, baudrate);
-	cfsetispeed(&tio, baudrate);
-	tcsetattr(serial_fd, TCSANOW, &tio);
-
-	return 0;
 }
 
-void isp_serial_close(void)
+/* Wait until t->cmd_gap_us microseconds have elapsed since data was last received */
+static void isp_serial_gap(struct isp_transport* t)
 {
-	close(serial_fd);
+	struct timespec ready = t->last_rx;
+	struct timespec now;
+
+	ready.tv_nsec += ((t->cmd_gap_us % 1000000) * 1000);
+	ready.tv_sec += (t->cmd_gap_us / 1000000) + (ready.tv_nsec / 1000000000);
+	ready.tv_nsec %= 1000000000;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec < ready.tv_sec) || ((now.tv_sec == ready.tv_sec) && (now.tv_nsec < ready.tv_nsec))) {
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ready, NULL);
+	}
 }
 
 /* Simple write() wrapper, with trace if enabled */
-int isp_serial_write(const char* buf, unsigned int buf_size)
+int isp_serial_write(struct isp_transport* t, const char* buf, unsigned int buf_size)
 {
 	int nb;
 	unsigned int count = 0;
-	unsigned int loops = 0; /* Used to create a timeout */
+	struct timespec deadline;
 
-	if (trace_on) {
+	if (t->cmd_gap_us != 0) {
+		isp_serial_gap(t);
+	}
+	if (t->trace) {
 		printf("Sending %d octet(s) :\n", buf_size);
 		isp_dump((unsigned char*)buf, buf_size);
 	}
+	isp_deadline_set(&deadline, isp_serial_timeout_ms(t, buf_size, SERIAL_LATENCY_MS));
 	do {
-		nb = write(serial_fd, buf + count, buf_size - count);
+		nb = t->ops->write(t, buf + count, buf_size - count, &deadline);
 		if (nb < 0) {
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-				if (loops++ > 100) {
-					break; /* timeout at 500ms */
-				}
-				usleep( 5000 );
-				continue;
-			}
-			perror("Serial write error");
 			return -1;
+		} else if (nb == 0) {
+			break; /* timeout */
 		}
 		count += nb;
 	} while (count < buf_size);
+	isp_serial_tx_account(t, count);
+	t->tx_bytes += count;
+	t->reply_wait = 1;
 	return count;
 }
 
-static char next_read_char = 0;
-void isp_serial_empty_buffer()
+/* Account the time elapsed since the previous ISP command request to that command, and
+ * start accounting time to "cmd" (the command letter), or stop if "cmd" is 0.
+ * Data still being sent belongs to the previous command. */
+void isp_serial_command(struct isp_transport* t, char cmd)
 {
-	int nb = 0;
-	char unused = 0;
-	unsigned int loops = 0; /* Used to create a timeout */
-
-	do {
-		nb = read(serial_fd, &unused, 1);
-		if (nb < 0) {
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-				if (loops++ > 100) {
-					break; /* timeout at 500ms */
-				}
-				usleep( 5000 );
-				continue;
-			}
-			perror("Serial read error");
-			return;
-		} else if (nb == 0) {
-			printf("serial_read: end of file !!!!\n");
-			return;
-		}
-	} while ((unused != '\r') && (unused != '\n'));
+	struct timespec now;
 
-	/* This should be improved by reading ALL \r and \n */
-	if (unused == '\r') {
-		nb = read(serial_fd, &unused, 1);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((t->tx_end.tv_sec > now.tv_sec) ||
+			((t->tx_end.tv_sec == now.tv_sec) && (t->tx_end.tv_nsec > now.tv_nsec))) {
+		now = t->tx_end;
 	}
-	if (unused == '\n') {
-		return;
+	if (t->cur_cmd != 0) {
+		t->cmd_time[t->cur_cmd - 'A'] += (now.tv_sec - t->cmd_start.tv_sec) +
+											((now.tv_nsec - t->cmd_start.tv_nsec) / 1e9);
+	}
+	t->cur_cmd = 0;
+	if ((cmd >= 'A') && (cmd <= 'Z')) {
+		t->cur_cmd = cmd;
+		t->cmd_start = now;
+		t->cmd_count[cmd - 'A']++;
 	}
-	next_read_char = unused;
 }
 
-/* Try to read at least "min_read" characters from the serial line.
- * Returns -1 on error, 0 on end of file, or read count otherwise.
+
+/* Receive ring buffer.
+ * All data received from the target goes through the transport's ring buffer, which is
+ * filled using reads as big as the free space allows. Replies are then consumed from the
+ * buffer line by line or by exact byte counts, so no byte is ever lost or read twice.
  */
-int isp_serial_read(char* buf, unsigned int buf_size, unsigned int min_read)
+#define RX_RING_MASK (ISP_RX_RING_SIZE - 1)
+
+#if (ISP_RX_RING_SIZE & RX_RING_MASK)
+#error "ISP_RX_RING_SIZE must be a power of two"
+#endif
+
+/* Get more data from the transport in the ring buffer.
+ * Returns the number of bytes added, 0 on timeout, or a negative value on error.
+ */
+static int isp_rx_fill(struct isp_transport* t, struct timespec* deadline)
 {
+	unsigned int tail = ((t->rx_head + t->rx_count) & RX_RING_MASK);
+	unsigned int room = (ISP_RX_RING_SIZE - t->rx_count);
 	int nb = 0;
-	unsigned int count = 0;
-	unsigned int loops = 0; /* Used to create a timeout */
 
-	if (min_read > buf_size) {
-		printf("serial_read: buffer too small for min read value.\n");
+	if (room == 0) {
+		printf("serial_read: receive buffer full.\n");
 		return -3;
 	}
-	if (next_read_char != 0) {
-		buf[count++] = next_read_char;
-		next_read_char = 0;
+	if ((tail + room) > ISP_RX_RING_SIZE) {
+		room = ISP_RX_RING_SIZE - tail;
 	}
-
-	do {
-		nb = read(serial_fd, &buf[count], (buf_size - count));
-		if (nb < 0) {
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-				if (loops++ > 100) {
-					break; /* timeout at 500ms */
-				}
-				usleep( 5000 );
-				continue;
-			}
-			perror("Serial read error");
-			return -1;
-		} else if (nb == 0) {
-			printf("serial_read: end of file !!!!\n");
-			return 0;
+	nb = t->ops->read(t, &t->rx_buf[tail], room, deadline);
+	if (nb > 0) {
+		if (t->trace == 2) {
+			isp_dump((unsigned char*)(&t->rx_buf[tail]), nb);
 		}
-		if (trace_on == 2) {
-			isp_dump((unsigned char*)(&buf[count]), nb);
+		t->rx_count += nb;
+		t->rx_bytes += nb;
+		if (t->reply_wait) {
+			t->round_trips++;
+			t->reply_wait = 0;
 		}
-		count += nb;
-	} while (count < min_read);
+		clock_gettime(CLOCK_MONOTONIC, &t->last_rx);
+	}
+	return nb;
+}
 
-	if (trace_on) {
-		printf("Received %d octet(s) :\n", count);
-		isp_dump((unsigned char*)buf, count);
+static char isp_rx_at(struct isp_transport* t, unsigned int offset)
+{
+	return t->rx_buf[(t->rx_head + offset) & RX_RING_MASK];
+}
+
+/* Copy "len" bytes from the ring buffer, without consuming them */
+static void isp_rx_copy(struct isp_transport* t, char* buf, unsigned int len)
+{
+	unsigned int first = ISP_RX_RING_SIZE - t->rx_head;
+
+	if (first > len) {
+		first = len;
 	}
-	return count;
+	memcpy(buf, &t->rx_buf[t->rx_head], first);
+	memcpy((buf + first), t->rx_buf, (len - first));
 }
 
+static void isp_rx_consume(struct isp_transport* t, unsigned int len)
+{
+	t->rx_head = ((t->rx_head + len) & RX_RING_MASK);
+	t->rx_count -= len;
+	if (t->rx_count == 0) {
+		t->rx_head = 0; /* Keep the free space contiguous */
+	}
+}
 
-/* ---- UU_Encoding utility functions ----------------------------------------------*/
+/* Drop all received data, including data pending in the transport */
+void isp_serial_flush(struct isp_transport* t)
+{
+	struct timespec now;
 
-/* This might have been taken from a lib, but I hate lib dependencies, and installing
- *  a full window manager (or MTA or MUA for instance) for two functions is not an
- *  option */
-#define UUENCODE_ADDED_VAL 32
-#define UUENCODE_ZERO 96
-#define LINE_DATA_LENGTH_MAX 45
+	isp_deadline_set(&now, 0);
+	do {
+		isp_rx_consume(t, t->rx_count);
+	} while (isp_rx_fill(t, &now) > 0);
+	isp_rx_consume(t, t->rx_count);
+}
 
-int isp_uu_encode(char* dest, char* src, unsigned int orig_size)
+/* Read one line (terminated by "\n") from the target. The line terminators ("\r\n") are
+ * removed, empty lines are skipped, and the line is copied in "buf" as a nul terminated
+ * string (truncated if it does not fit).
+ * "latency_ms" is the time allowed to the device before the line starts.
+ * Returns the line length, 0 on timeout, or a negative value on error.
+ */
+int isp_serial_readline(struct isp_transport* t, char* buf, unsigned int buf_size, unsigned int latency_ms)
 {
-	unsigned int new_size = 0;
-	unsigned int pos = 0;
+	struct timespec deadline;
+	unsigned int scanned = 0;
 
-	while (pos < orig_size) {
-		unsigned int line_length = orig_size - pos;
-		unsigned int i = 0;
+	isp_serial_deadline(t, &deadline, isp_serial_timeout_ms(t, buf_size, latency_ms));
+	while (1) {
+		unsigned int len = 0, copy = 0;
+		int nb = 0;
 
-		/* Start with line length */
-		if (line_length > LINE_DATA_LENGTH_MAX) {
-			line_length = LINE_DATA_LENGTH_MAX;
+		/* Look for end of line in received data */
+		while ((scanned < t->rx_count) && (isp_rx_at(t, scanned) != '\n')) {
+			scanned++;
 		}
-		dest[new_size] = line_length + UUENCODE_ADDED_VAL;
-		new_size++;
-
-		/* Encode line */
-		while (i < line_length) {
-			uint32_t int_triplet = 0;
-			int j = 0;
-
-			/* Get original triplet (three bytes) */
-			for (j=0; j<3; j++) {
-				int_triplet |= ((src[pos + i + j] & 0xFF) << (8 * (2 - j)));
-				/* if not enougth data, leave it as nul */
-				if ((i + j) > line_length) {
-					break;
+		if (scanned == t->rx_count) {
+			nb = isp_rx_fill(t, &deadline);
+			if (nb <= 0) {
+				if ((nb == 0) && t->trace) {
+					printf("Timeout waiting for a line, %u octet(s) received.\n", t->rx_count);
 				}
+				return nb;
 			}
-			for (j=0; j<4; j++) {
-				/* Store triplet in four bytes */
-				dest[new_size + j] = ((int_triplet >> (6 * (3 - j))) & 0x3F);
-				/* Add offset */
-				if (dest[new_size + j]) {
-					dest[new_size + j] += UUENCODE_ADDED_VAL;
-				} else {
-					dest[new_size + j] = UUENCODE_ZERO;
-				}
-			}
-			i += 3;
-			new_size += 4;
+			continue;
 		}
-		pos += line_length;
-
-		/* Add \r\n */
-		dest[new_size++] = '\r';
-		dest[new_size++] = '\n';
+		/* Got one, remove terminators */
+		len = scanned;
+		while ((len > 0) && (isp_rx_at(t, (len - 1)) == '\r')) {
+			len--;
+		}
+		copy = ((len < buf_size) ? len : (buf_size - 1));
+		isp_rx_copy(t, buf, copy);
+		buf[copy] = '\0';
+		isp_rx_consume(t, (scanned + 1));
+		scanned = 0;
+		/* Skip remaining '\r' of previous line */
+		while ((copy > 0) && (buf[0] == '\r')) {
+			memmove(buf, (buf + 1), copy--);
+		}
+		if (copy == 0) {
+			continue;
+		}
+		if (t->trace) {
+			printf("Received line : \"%s\"\n", buf);
+		}
+		return copy;
 	}
-	return new_size;
 }
 
-int isp_uu_decode(char* dest, char* src, unsigned int orig_size)
+/* Read exactly "len" bytes from the target.
+ * Returns the number of bytes read (less than "len" on timeout), or a negative value
+ * on error.
+ */
+int isp_serial_read_exact(struct isp_transport* t, char* buf, unsigned int len)
 {
-	unsigned int new_size = 0;
-	unsigned int pos = 0;
-
-	while (pos < orig_size) {
-		unsigned int line_length = 0;
-		unsigned int i = 0;
-		int j = 0;
-
-		/* Read line length */
-		line_length = src[pos] - UUENCODE_ADDED_VAL;
-		if (src[pos] == UUENCODE_ZERO) {
-			/* Empty line ? then we are done converting
-			 * (should not happen in communication with ISP) */
-			return new_size;
+	struct timespec deadline;
+	unsigned int count = 0;
+
+	isp_serial_deadline(t, &deadline, isp_serial_timeout_ms(t, len, SERIAL_LATENCY_MS));
+	while (count < len) {
+		unsigned int chunk = (len - count);
+		int nb = 0;
+
+		if (chunk > t->rx_count) {
+			chunk = t->rx_count;
 		}
-		pos++;
-
-		/* Decode line */
-		while (i < line_length) {
-			char quartet[4];
-			uint32_t int_triplet = 0;
-			/* copy data */
-			memcpy(quartet, &src[pos], 4);
-			pos += 4;
-			/* Get the original bits */
-			for (j=0; j<4; j++) {
-				/* Remove the offset added by uuencoding */
-				quartet[j] -= UUENCODE_ADDED_VAL;
-				int_triplet |= ((quartet[j] & 0x3F) << ((3 - j) * 6));
-			}
-			/* And store them */
-			for (j=2; j>=0; j--) {
-				dest[new_size++] = ((int_triplet >> (j * 8)) & 0xFF );
-				i++;
-				if (i >= line_length) {
-					break;
-				}
-			}
+		isp_rx_copy(t, (buf + count), chunk);
+		isp_rx_consume(t, chunk);
+		count += chunk;
+		if (count == len) {
+			break;
+		}
+		nb = isp_rx_fill(t, &deadline);
+		if (nb < 0) {
+			return nb;
+		} else if (nb == 0) {
+			break; /* timeout */
 		}
+	}
+	if (t->trace) {
+		printf("Received %d octet(s) :\n", count);
+		isp_dump((unsigned char*)buf, count);
+	}
+	return count;
+}
 
-		/* Find next line */
-		while ((src[pos] < UUENCODE_ADDED_VAL) && (pos < orig_size))   {
-			pos++;
+/* Get the next "len" bytes from the target without consuming them.
+ * Returns the number of bytes copied to buf (less than "len" on timeout), or a negative
+ * value on error.
+ */
+int isp_serial_peek(struct isp_transport* t, char* buf, unsigned int len)
+{
+	struct timespec deadline;
+
+	if (len > ISP_RX_RING_SIZE) {
+		len = ISP_RX_RING_SIZE;
+	}
+	isp_serial_deadline(t, &deadline, isp_serial_timeout_ms(t, len, SERIAL_LATENCY_MS));
+	while (t->rx_count < len) {
+		int nb = isp_rx_fill(t, &deadline);
+		if (nb < 0) {
+			return nb;
+		} else if (nb == 0) {
+			len = t->rx_count;
+			break;
 		}
 	}
-	return new_size;
+	isp_rx_copy(t, buf, len);
+	return len;
 }
 
+/* Try to read at least "min_read" characters from the serial line.
+ * Returns -1 on error, 0 on end of file, or read count otherwise.
+ * The read returns as soon as "min_read" characters have been received, or when the time
+ * needed to receive them at the current baudrate (plus device latency) has elapsed.
+ */
+int isp_serial_read(struct isp_transport* t, char* buf, unsigned int buf_size, unsigned int min_read)
+{
+	struct timespec now;
+	int count = 0;
+
+	if (min_read > buf_size) {
+		printf("serial_read: buffer too small for min read value.\n");
+		return -3;
+	}
+	count = isp_serial_read_exact(t, buf, min_read);
+	if (count < (int)min_read) {
+		return ((count == -2) ? 0 : count);
+	}
+	/* Get whatever else is already there */
+	isp_deadline_set(&now, 0);
+	while ((unsigned int)count < buf_size) {
+		unsigned int chunk = (buf_size - count);
+		if (t->rx_count == 0) {
+			if (isp_rx_fill(t, &now) <= 0) {
+				break;
+			}
+		}
+		if (chunk > t->rx_count) {
+			chunk = t->rx_count;
+		}
+		isp_rx_copy(t, (buf + count), chunk);
+		isp_rx_consume(t, chunk);
+		count += chunk;
+	}
+	return count;
+}
 
 
 /* ---- File utility functions ----------------------------------------------*/
 
+/* Open file for writing, or use stdout if filename is "-" */
+int isp_file_open_out(char* filename)
+{
+	int out_fd = -1;
+
+	if (strncmp(filename, "-", strlen(filename)) == 0) {
+		return STDOUT_FILENO;
+	}
+	out_fd = open(filename, (O_WRONLY | O_CREAT | O_TRUNC), FILE_CREATE_MODE);
+	if (out_fd <= 0) {
+		perror("Unable to open or create file for writing");
+		printf("Tried to open \"%s\".\n", filename);
+		return -1;
+	}
+	return out_fd;
+}
+
+void isp_file_close_out(int out_fd)
+{
+	if (out_fd != STDOUT_FILENO) {
+		close(out_fd);
+	}
+}
+
 int isp_buff_to_file(char* data, unsigned int len, char* filename)
 {
 	int ret = 0;
 	int out_fd = -1;
 
-	/* Open file for writing if output is not stdout */
-	if (strncmp(filename, "-", strlen(filename)) == 0) {
-		out_fd = STDOUT_FILENO;
-	} else {
-		out_fd = open(filename, (O_WRONLY | O_CREAT | O_TRUNC), FILE_CREATE_MODE);
-		if (out_fd <= 0) {
-			perror("Unable to open or create file for writing");
-			printf("Tried to open \"%s\".\n", filename);
-			return -1;
-		}
+	out_fd = isp_file_open_out(filename);
+	if (out_fd < 0) {
+		return -1;
 	}
 
 	/* Write data to file */
@@ -389,9 +557,7 @@ int isp_buff_to_file(char* data, unsigned int len, char* filename)
 	}
 
 	/* Close file */
-	if (out_fd != STDOUT_FILENO) {
-		close(out_fd);
-	}
+	isp_file_close_out(out_fd);
 
 	return ret;
 }
@@ -24,6 +24,9 @@
 #ifndef ISP_UTILS_H
 #define ISP_UTILS_H
 
+#include <time.h> /* struct timespec */
+
+struct isp_transport;
 
 /* ---- CRP Protection values ---------------------------------------------------*/
 #define CRP_OFFSET  0x000002FC
@@ -35,34 +38,73 @@
 
 void isp_dump(const unsigned char* buf, unsigned int buf_size);
 
+/* CRC-32 (polynomial 0x04C11DB7, reflected), as computed by the ISP read CRC command */
+uint32_t isp_crc32(const char* data, unsigned int len);
+
+
+/* ---- Deadline utility functions -------------------------------------------------*/
+
+/* Set "deadline" to "timeout_ms" milliseconds from now (monotonic clock) */
+void isp_deadline_set(struct timespec* deadline, unsigned int timeout_ms);
+/* Returns the number of milliseconds left before deadline, 0 if deadline has passed */
+int isp_deadline_remaining_ms(struct timespec* deadline);
+
 
 /* ---- Serial utility functions ---------------------------------------------------*/
 
-/* Open the serial device and set it up.
- * Returns 0 on success, negativ value on error.
- * Actal setup is done according to LPC11xx user's manual.
- * Only baudrate can be changed using command line option.
- */
-int isp_serial_open(int baudrate, char* serial_device);
-void isp_serial_close(void);
+/* Device processing time allowed for a reply, on top of the time needed to transmit it */
+#define SERIAL_LATENCY_MS  100
 
 /* Simple write() wrapper, with trace if enabled */
-int isp_serial_write(const char* buf, unsigned int buf_size);
+int isp_serial_write(struct isp_transport* t, const char* buf, unsigned int buf_size);
+
+/* Account the time elapsed since the previous ISP command request to that command, and
+ * start accounting time to "cmd" (the command letter), or stop if "cmd" is 0.
+ * Called by the isp commands before sending each request. */
+void isp_serial_command(struct isp_transport* t, char cmd);
+
+/* Drop all received data, including data pending in the transport */
+void isp_serial_flush(struct isp_transport* t);
+
+/* Read one line (terminated by "\n") from the target. The line terminators ("\r\n") are
+ * removed, empty lines are skipped, and the line is copied in "buf" as a nul terminated
+ * string (truncated if it does not fit).
+ * "latency_ms" is the time allowed to the device before the line starts.
+ * Returns the line length, 0 on timeout, or a negative value on error.
+ */
+int isp_serial_readline(struct isp_transport* t, char* buf, unsigned int buf_size, unsigned int latency_ms);
+
+/* Read exactly "len" bytes from the target.
+ * Returns the number of bytes read (less than "len" on timeout), or a negative value
+ * on error.
+ */
+int isp_serial_read_exact(struct isp_transport* t, char* buf, unsigned int len);
+
+/* Get the next "len" bytes from the target without consuming them.
+ * Returns the number of bytes copied to buf (less than "len" on timeout), or a negative
+ * value on error.
+ */
+int isp_serial_peek(struct isp_transport* t, char* buf, unsigned int len);
 
-void isp_serial_empty_buffer();
 /* Try to read at least "min_read" characters from the serial line.
  * Returns -1 on error, 0 on end of file, or read count otherwise.
  */
-int isp_serial_read(char* buf, unsigned int buf_size, unsigned int min_read);
+int isp_serial_read(struct isp_transport* t, char* buf, unsigned int buf_size, unsigned int min_read);
 
 
 /* ---- UU_Encoding utility functions ----------------------------------------------*/
+/* See isp_uu.h for the checksum computing versions */
 int isp_uu_encode(char* dest, char* src, unsigned int orig_size);
 
 int isp_uu_decode(char* dest, char* src, unsigned int orig_size);
 
 
 /* ---- File utility functions ----------------------------------------------*/
+/* Open file for writing, or use stdout if filename is "-".
+ * Returns the file descriptor, or a negative value on error. */
+int isp_file_open_out(char* filename);
+void isp_file_close_out(int out_fd);
+
 int isp_buff_to_file(char* data, unsigned int len, char* filename);
 
 int isp_file_to_buff(char* data, unsigned int len, char* filename);
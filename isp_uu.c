@@ -0,0 +1,653 @@
+/*********************************************************************
+ *
+ *   LPC ISP - UU-Encoding kernels
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+/* UU-Encoding as used by the ISP : lines of at most 45 data bytes, starting with the
+ * line length character and ending with "\r\n", each triplet of data bytes encoded in
+ * four characters. Zero is sent as '`' instead of ' '.
+ *
+ * Several implementations (kernels) are provided, the first one of isp_uu_kernels[]
+ * supported by the CPU is selected on first use (once for all threads). All of them
+ * compute the additive checksum of the data on the fly, so the data is only read once.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h> /* strcmp, memcpy */
+#include <pthread.h> /* pthread_once */
+
+#if defined(__SSE2__)
+#define UU_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "isp_uu.h"
+
+
+#define UUENCODE_ADDED_VAL 32
+#define UUENCODE_ZERO 96
+#define LINE_DATA_LENGTH_MAX 45
+
+/* Six bits value to character */
+static const char uu_enc_table[64] =
+	"`!\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_";
+
+
+/* ---- Reference kernel -----------------------------------------------------------*/
+
+/* One triplet at a time, one bit field at a time, checksum computed separately.
+ * This is the original implementation, kept as a reference for tests and benchmarks.
+ */
+static unsigned int uu_encode_scalar(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum)
+{
+	unsigned int new_size = 0;
+	unsigned int pos = 0;
+
+	while (pos < orig_size) {
+		unsigned int line_length = orig_size - pos;
+		unsigned int i = 0;
+
+		/* Start with line length */
+		if (line_length > LINE_DATA_LENGTH_MAX) {
+			line_length = LINE_DATA_LENGTH_MAX;
+		}
+		dest[new_size] = line_length + UUENCODE_ADDED_VAL;
+		new_size++;
+
+		/* Encode line */
+		while (i < line_length) {
+			uint32_t int_triplet = 0;
+			int j = 0;
+
+			/* Get original triplet (three bytes), if not enougth data, leave it as nul */
+			for (j=0; (j < 3) && ((i + j) < line_length); j++) {
+				int_triplet |= ((src[pos + i + j] & 0xFF) << (8 * (2 - j)));
+			}
+			for (j=0; j<4; j++) {
+				/* Store triplet in four bytes */
+				dest[new_size + j] = ((int_triplet >> (6 * (3 - j))) & 0x3F);
+				/* Add offset */
+				if (dest[new_size + j]) {
+					dest[new_size + j] += UUENCODE_ADDED_VAL;
+				} else {
+					dest[new_size + j] = UUENCODE_ZERO;
+				}
+			}
+			i += 3;
+			new_size += 4;
+		}
+		pos += line_length;
+
+		/* Add \r\n */
+		dest[new_size++] = '\r';
+		dest[new_size++] = '\n';
+	}
+	if (checksum != NULL) {
+		*checksum += isp_checksum(src, orig_size);
+	}
+	return new_size;
+}
+
+static unsigned int uu_decode_scalar(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum)
+{
+	unsigned int new_size = 0;
+	unsigned int pos = 0;
+
+	while (pos < orig_size) {
+		unsigned int line_length = 0;
+		unsigned int i = 0;
+		int j = 0;
+
+		/* Read line length */
+		line_length = src[pos] - UUENCODE_ADDED_VAL;
+		if (src[pos] == UUENCODE_ZERO) {
+			/* Empty line ? then we are done converting
+			 * (should not happen in communication with ISP) */
+			break;
+		}
+		pos++;
+
+		/* Decode line */
+		while ((i < line_length) && ((pos + 4) <= orig_size)) {
+			char quartet[4];
+			uint32_t int_triplet = 0;
+			/* copy data */
+			memcpy(quartet, &src[pos], 4);
+			pos += 4;
+			/* Get the original bits */
+			for (j=0; j<4; j++) {
+				/* Remove the offset added by uuencoding */
+				quartet[j] -= UUENCODE_ADDED_VAL;
+				int_triplet |= ((quartet[j] & 0x3F) << ((3 - j) * 6));
+			}
+			/* And store them */
+			for (j=2; j>=0; j--) {
+				dest[new_size++] = ((int_triplet >> (j * 8)) & 0xFF );
+				i++;
+				if (i >= line_length) {
+					break;
+				}
+			}
+		}
+
+		/* Find next line */
+		while ((pos < orig_size) && (src[pos] < UUENCODE_ADDED_VAL)) {
+			pos++;
+		}
+	}
+	if (checksum != NULL) {
+		*checksum += isp_checksum(dest, new_size);
+	}
+	return new_size;
+}
+
+
+/* ---- Table driven kernel --------------------------------------------------------*/
+
+/* Encode "len" bytes of a line (the last triplet may be incomplete).
+ * Returns the number of characters stored. */
+static inline unsigned int uu_encode_triplets(char* dest, const unsigned char* src, unsigned int len, uint32_t* sum)
+{
+	unsigned int i = 0, out = 0;
+
+	for (i = 0; (i + 3) <= len; i += 3) {
+		uint32_t x = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+		*sum += src[i] + src[i + 1] + src[i + 2];
+		dest[out++] = uu_enc_table[x >> 18];
+		dest[out++] = uu_enc_table[(x >> 12) & 0x3F];
+		dest[out++] = uu_enc_table[(x >> 6) & 0x3F];
+		dest[out++] = uu_enc_table[x & 0x3F];
+	}
+	if (i < len) {
+		/* Incomplete triplet, padded with nul bytes */
+		uint32_t x = (src[i] << 16);
+		*sum += src[i];
+		if ((i + 1) < len) {
+			x |= (src[i + 1] << 8);
+			*sum += src[i + 1];
+		}
+		dest[out++] = uu_enc_table[x >> 18];
+		dest[out++] = uu_enc_table[(x >> 12) & 0x3F];
+		dest[out++] = uu_enc_table[(x >> 6) & 0x3F];
+		dest[out++] = uu_enc_table[x & 0x3F];
+	}
+	return out;
+}
+
+/* Decode "len" bytes of a line from the quartets in "src" */
+static inline void uu_decode_triplets(char* dest, const unsigned char* src, unsigned int len, uint32_t* sum)
+{
+	unsigned int i = 0;
+
+	for (i = 0; i < len; i += 3, src += 4) {
+		uint32_t x = (((src[0] - UUENCODE_ADDED_VAL) & 0x3F) << 18) |
+					(((src[1] - UUENCODE_ADDED_VAL) & 0x3F) << 12) |
+					(((src[2] - UUENCODE_ADDED_VAL) & 0x3F) << 6) |
+					((src[3] - UUENCODE_ADDED_VAL) & 0x3F);
+		dest[i] = (x >> 16);
+		*sum += ((x >> 16) & 0xFF);
+		if ((i + 1) < len) {
+			dest[i + 1] = (x >> 8);
+			*sum += ((x >> 8) & 0xFF);
+		}
+		if ((i + 2) < len) {
+			dest[i + 2] = x;
+			*sum += (x & 0xFF);
+		}
+	}
+}
+
+/* Size of the quartets of a line of "len" data bytes */
+#define UU_LINE_CHARS(len)  ((((len) + 2) / 3) * 4)
+
+/* Parse the length character of the line at "src[pos]". Returns the number of data bytes,
+ * or 0 when the line is empty or truncated. */
+static inline unsigned int uu_line_length(const char* src, unsigned int pos, unsigned int orig_size)
+{
+	unsigned int len = ((src[pos] - UUENCODE_ADDED_VAL) & 0x3F);
+
+	if ((pos + 1 + UU_LINE_CHARS(len)) > orig_size) {
+		return 0;
+	}
+	return len;
+}
+
+/* Skip line terminators */
+static inline unsigned int uu_next_line(const char* src, unsigned int pos, unsigned int orig_size)
+{
+	while ((pos < orig_size) && (src[pos] < UUENCODE_ADDED_VAL)) {
+		pos++;
+	}
+	return pos;
+}
+
+static unsigned int uu_encode_table_kernel(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum)
+{
+	const unsigned char* data = (const unsigned char*)src;
+	unsigned int pos = 0, out = 0;
+	uint32_t sum = 0;
+
+	while (pos < orig_size) {
+		unsigned int len = orig_size - pos;
+		if (len > LINE_DATA_LENGTH_MAX) {
+			len = LINE_DATA_LENGTH_MAX;
+		}
+		dest[out++] = len + UUENCODE_ADDED_VAL;
+		out += uu_encode_triplets(&dest[out], &data[pos], len, &sum);
+		dest[out++] = '\r';
+		dest[out++] = '\n';
+		pos += len;
+	}
+	if (checksum != NULL) {
+		*checksum += sum;
+	}
+	return out;
+}
+
+static unsigned int uu_decode_table_kernel(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum)
+{
+	unsigned int pos = 0, out = 0;
+	uint32_t sum = 0;
+
+	while (pos < orig_size) {
+		unsigned int len = uu_line_length(src, pos, orig_size);
+		if (len == 0) {
+			break;
+		}
+		uu_decode_triplets(&dest[out], (const unsigned char*)&src[pos + 1], len, &sum);
+		out += len;
+		pos = uu_next_line(src, (pos + 1 + UU_LINE_CHARS(len)), orig_size);
+	}
+	if (checksum != NULL) {
+		*checksum += sum;
+	}
+	return out;
+}
+
+
+/* ---- SSSE3 and AVX2 kernels -----------------------------------------------------*/
+#ifdef UU_X86_KERNELS
+
+/* Vectors hold one triplet per 32 bits lane, as (b0 << 16) | (b1 << 8) | b2. Triplets are
+ * gathered from the data (and the decoded ones put back in place) with a byte shuffle,
+ * the bit fields are moved to their character position with shifts and masks, and the
+ * byte sum of the lanes (the checksum) is computed with psadbw.
+ * Loads and stores are 16 bytes wide for 12 data bytes. When they would cross the end
+ * of the buffers, they go through a local copy.
+ */
+#define UU_SSSE3 __attribute__((target("ssse3")))
+#define UU_AVX2 __attribute__((target("avx2")))
+
+/* Triplets of 12 bytes to the lanes, and back */
+#define UU_GATHER  2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1
+#define UU_SCATTER  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+/* Four triplets to sixteen characters */
+static inline UU_SSSE3 __m128i uu_enc_ssse3(__m128i x)
+{
+	__m128i v, zero;
+
+	v = _mm_and_si128(_mm_srli_epi32(x, 18), _mm_set1_epi32(0x3F));
+	v = _mm_or_si128(v, _mm_and_si128(_mm_srli_epi32(x, 4), _mm_set1_epi32(0x3F00)));
+	v = _mm_or_si128(v, _mm_and_si128(_mm_slli_epi32(x, 10), _mm_set1_epi32(0x3F0000)));
+	v = _mm_or_si128(v, _mm_and_si128(_mm_slli_epi32(x, 24), _mm_set1_epi32(0x3F000000)));
+	/* Add offset, nul values become '`' */
+	zero = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+	v = _mm_add_epi8(v, _mm_set1_epi8(UUENCODE_ADDED_VAL));
+	return _mm_add_epi8(v, _mm_and_si128(zero, _mm_set1_epi8(UUENCODE_ZERO - UUENCODE_ADDED_VAL)));
+}
+
+/* Sixteen characters to four triplets */
+static inline UU_SSSE3 __m128i uu_dec_ssse3(__m128i in)
+{
+	__m128i v, x;
+
+	v = _mm_and_si128(_mm_sub_epi8(in, _mm_set1_epi8(UUENCODE_ADDED_VAL)), _mm_set1_epi8(0x3F));
+	x = _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x3F)), 18);
+	x = _mm_or_si128(x, _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x3F00)), 4));
+	x = _mm_or_si128(x, _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x3F0000)), 10));
+	return _mm_or_si128(x, _mm_srli_epi32(v, 24));
+}
+
+static inline uint32_t uu_sum_epi64(__m128i acc)
+{
+	return (uint32_t)(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc)));
+}
+
+/* Encode the "len" data bytes of a line from "src", from which "avail" bytes can be read.
+ * Returns the number of characters stored. */
+static inline UU_SSSE3 unsigned int uu_encode_line_ssse3(char* dest, const unsigned char* src,
+										unsigned int len, unsigned int avail, __m128i* acc)
+{
+	const __m128i gather = _mm_setr_epi8(UU_GATHER);
+	unsigned int i = 0, out = 0;
+
+	for (i = 0; i < len; i += 12, out += 16) {
+		unsigned int rem = len - i;
+		unsigned char tmp[16];
+		__m128i x;
+		if ((rem >= 12) && ((i + 16) <= avail)) {
+			x = _mm_loadu_si128((const __m128i*)&src[i]);
+		} else {
+			/* Last bytes, incomplete triplet padded with nul bytes */
+			memset(tmp, 0, sizeof(tmp));
+			memcpy(tmp, &src[i], ((rem < 12) ? rem : 12));
+			x = _mm_loadu_si128((const __m128i*)tmp);
+		}
+		x = _mm_shuffle_epi8(x, gather);
+		*acc = _mm_add_epi64(*acc, _mm_sad_epu8(x, _mm_setzero_si128()));
+		if (rem >= 12) {
+			_mm_storeu_si128((__m128i*)&dest[out], uu_enc_ssse3(x));
+		} else {
+			_mm_storeu_si128((__m128i*)tmp, uu_enc_ssse3(x));
+			memcpy(&dest[out], tmp, UU_LINE_CHARS(rem));
+			return out + UU_LINE_CHARS(rem);
+		}
+	}
+	return out;
+}
+
+/* Decode the "len" data bytes of a line from the quartets in "src", from which "avail"
+ * characters can be read */
+static inline UU_SSSE3 void uu_decode_line_ssse3(char* dest, const char* src, unsigned int len,
+										unsigned int avail, __m128i* acc, uint32_t* sum)
+{
+	const __m128i scatter = _mm_setr_epi8(UU_SCATTER);
+	unsigned int i = 0, in = 0;
+
+	for (i = 0; i < len; i += 12, in += 16) {
+		unsigned int rem = len - i;
+		char tmp[16];
+		__m128i x;
+		if ((in + 16) <= avail) {
+			x = _mm_loadu_si128((const __m128i*)&src[in]);
+		} else {
+			memset(tmp, '`', sizeof(tmp));
+			memcpy(tmp, &src[in], (avail - in));
+			x = _mm_loadu_si128((const __m128i*)tmp);
+		}
+		x = _mm_shuffle_epi8(uu_dec_ssse3(x), scatter);
+		if ((i + 16) <= len) {
+			*acc = _mm_add_epi64(*acc, _mm_sad_epu8(x, _mm_setzero_si128()));
+			_mm_storeu_si128((__m128i*)&dest[i], x);
+		} else {
+			/* Last bytes, the padding bytes of an incomplete triplet are dropped */
+			unsigned int j = 0;
+			if (rem > 12) {
+				rem = 12;
+			}
+			_mm_storeu_si128((__m128i*)tmp, x);
+			for (j = 0; j < rem; j++) {
+				dest[i + j] = tmp[j];
+				*sum += (unsigned char)tmp[j];
+			}
+		}
+	}
+}
+
+static UU_SSSE3 unsigned int uu_encode_ssse3_kernel(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum)
+{
+	const unsigned char* data = (const unsigned char*)src;
+	unsigned int pos = 0, out = 0;
+	__m128i acc = _mm_setzero_si128();
+
+	while (pos < orig_size) {
+		unsigned int len = orig_size - pos;
+		if (len > LINE_DATA_LENGTH_MAX) {
+			len = LINE_DATA_LENGTH_MAX;
+		}
+		dest[out++] = len + UUENCODE_ADDED_VAL;
+		out += uu_encode_line_ssse3(&dest[out], &data[pos], len, (orig_size - pos), &acc);
+		dest[out++] = '\r';
+		dest[out++] = '\n';
+		pos += len;
+	}
+	if (checksum != NULL) {
+		*checksum += uu_sum_epi64(acc);
+	}
+	return out;
+}
+
+static UU_SSSE3 unsigned int uu_decode_ssse3_kernel(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum)
+{
+	unsigned int pos = 0, out = 0;
+	__m128i acc = _mm_setzero_si128();
+	uint32_t sum = 0;
+
+	while (pos < orig_size) {
+		unsigned int len = uu_line_length(src, pos, orig_size);
+		if (len == 0) {
+			break;
+		}
+		uu_decode_line_ssse3(&dest[out], &src[pos + 1], len, (orig_size - (pos + 1)), &acc, &sum);
+		out += len;
+		pos = uu_next_line(src, (pos + 1 + UU_LINE_CHARS(len)), orig_size);
+	}
+	if (checksum != NULL) {
+		*checksum += sum + uu_sum_epi64(acc);
+	}
+	return out;
+}
+
+
+static inline UU_AVX2 __m256i uu_enc_avx2(__m256i x)
+{
+	__m256i v, zero;
+
+	v = _mm256_and_si256(_mm256_srli_epi32(x, 18), _mm256_set1_epi32(0x3F));
+	v = _mm256_or_si256(v, _mm256_and_si256(_mm256_srli_epi32(x, 4), _mm256_set1_epi32(0x3F00)));
+	v = _mm256_or_si256(v, _mm256_and_si256(_mm256_slli_epi32(x, 10), _mm256_set1_epi32(0x3F0000)));
+	v = _mm256_or_si256(v, _mm256_and_si256(_mm256_slli_epi32(x, 24), _mm256_set1_epi32(0x3F000000)));
+	zero = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+	v = _mm256_add_epi8(v, _mm256_set1_epi8(UUENCODE_ADDED_VAL));
+	return _mm256_add_epi8(v, _mm256_and_si256(zero, _mm256_set1_epi8(UUENCODE_ZERO - UUENCODE_ADDED_VAL)));
+}
+
+static inline UU_AVX2 __m256i uu_dec_avx2(__m256i in)
+{
+	__m256i v, x;
+
+	v = _mm256_and_si256(_mm256_sub_epi8(in, _mm256_set1_epi8(UUENCODE_ADDED_VAL)), _mm256_set1_epi8(0x3F));
+	x = _mm256_slli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0x3F)), 18);
+	x = _mm256_or_si256(x, _mm256_slli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0x3F00)), 4));
+	x = _mm256_or_si256(x, _mm256_srli_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0x3F0000)), 10));
+	return _mm256_or_si256(x, _mm256_srli_epi32(v, 24));
+}
+
+static UU_AVX2 unsigned int uu_encode_avx2_kernel(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum)
+{
+	const unsigned char* data = (const unsigned char*)src;
+	const __m256i gather = _mm256_setr_epi8(UU_GATHER, UU_GATHER);
+	unsigned int pos = 0, out = 0;
+	__m256i acc256 = _mm256_setzero_si256();
+	__m128i acc = _mm_setzero_si128();
+
+	while (pos < orig_size) {
+		unsigned int len = orig_size - pos;
+		unsigned int done = 0;
+		if (len > LINE_DATA_LENGTH_MAX) {
+			len = LINE_DATA_LENGTH_MAX;
+		}
+		dest[out++] = len + UUENCODE_ADDED_VAL;
+		/* Eight triplets at a time, each half of the vector loaded from 12 bytes */
+		while (((done + 24) <= len) && ((pos + done + 28) <= orig_size)) {
+			const __m128i* p = (const __m128i*)&data[pos + done];
+			__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(p)),
+												_mm_loadu_si128((const __m128i*)&data[pos + done + 12]), 1);
+			__m256i x = _mm256_shuffle_epi8(in, gather);
+			acc256 = _mm256_add_epi64(acc256, _mm256_sad_epu8(x, _mm256_setzero_si256()));
+			_mm256_storeu_si256((__m256i*)&dest[out], uu_enc_avx2(x));
+			done += 24;
+			out += 32;
+		}
+		out += uu_encode_line_ssse3(&dest[out], &data[pos + done], (len - done), (orig_size - (pos + done)), &acc);
+		dest[out++] = '\r';
+		dest[out++] = '\n';
+		pos += len;
+	}
+	if (checksum != NULL) {
+		acc = _mm_add_epi64(acc, _mm256_castsi256_si128(acc256));
+		acc = _mm_add_epi64(acc, _mm256_extracti128_si256(acc256, 1));
+		*checksum += uu_sum_epi64(acc);
+	}
+	return out;
+}
+
+static UU_AVX2 unsigned int uu_decode_avx2_kernel(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum)
+{
+	const __m256i scatter = _mm256_setr_epi8(UU_SCATTER, UU_SCATTER);
+	unsigned int pos = 0, out = 0;
+	__m256i acc256 = _mm256_setzero_si256();
+	__m128i acc = _mm_setzero_si128();
+	uint32_t sum = 0;
+
+	while (pos < orig_size) {
+		unsigned int len = uu_line_length(src, pos, orig_size);
+		const char* q = &src[pos + 1];
+		unsigned int done = 0;
+		if (len == 0) {
+			break;
+		}
+		/* Eight quartets at a time, the twelve bytes of each half are stored with 16
+		 * bytes stores, the second one overwriting the padding of the first one */
+		while ((done + 28) <= len) {
+			__m256i x = uu_dec_avx2(_mm256_loadu_si256((const __m256i*)q));
+			x = _mm256_shuffle_epi8(x, scatter);
+			acc256 = _mm256_add_epi64(acc256, _mm256_sad_epu8(x, _mm256_setzero_si256()));
+			_mm_storeu_si128((__m128i*)&dest[out + done], _mm256_castsi256_si128(x));
+			_mm_storeu_si128((__m128i*)&dest[out + done + 12], _mm256_extracti128_si256(x, 1));
+			done += 24;
+			q += 32;
+		}
+		uu_decode_line_ssse3(&dest[out + done], q, (len - done), (orig_size - (q - src)), &acc, &sum);
+		out += len;
+		pos = uu_next_line(src, (pos + 1 + UU_LINE_CHARS(len)), orig_size);
+	}
+	if (checksum != NULL) {
+		acc = _mm_add_epi64(acc, _mm256_castsi256_si128(acc256));
+		acc = _mm_add_epi64(acc, _mm256_extracti128_si256(acc256, 1));
+		*checksum += sum + uu_sum_epi64(acc);
+	}
+	return out;
+}
+
+static int uu_have_ssse3(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int uu_have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif /* UU_X86_KERNELS */
+
+
+/* ---- Kernel selection -----------------------------------------------------------*/
+
+/* Best first */
+struct isp_uu_kernel isp_uu_kernels[] = {
+#ifdef UU_X86_KERNELS
+	{ "avx2", uu_have_avx2, uu_encode_avx2_kernel, uu_decode_avx2_kernel, },
+	{ "ssse3", uu_have_ssse3, uu_encode_ssse3_kernel, uu_decode_ssse3_kernel, },
+#endif
+	{ "table", NULL, uu_encode_table_kernel, uu_decode_table_kernel, },
+	{ "scalar", NULL, uu_encode_scalar, uu_decode_scalar, },
+	{ NULL, NULL, NULL, NULL, },
+};
+
+static struct isp_uu_kernel* uu_kernel = NULL;
+static pthread_once_t uu_kernel_once = PTHREAD_ONCE_INIT;
+
+/* Default selection, unless one has been made before the first use */
+static void uu_kernel_default(void)
+{
+	if (uu_kernel == NULL) {
+		isp_uu_select(NULL);
+	}
+}
+
+int isp_uu_kernel_supported(struct isp_uu_kernel* kernel)
+{
+	return ((kernel->supported == NULL) || kernel->supported());
+}
+
+int isp_uu_select(char* name)
+{
+	int i = 0;
+
+	for (i = 0; isp_uu_kernels[i].name != NULL; i++) {
+		if (!isp_uu_kernel_supported(&isp_uu_kernels[i])) {
+			continue;
+		}
+		if ((name == NULL) || (strcmp(name, isp_uu_kernels[i].name) == 0)) {
+			uu_kernel = &isp_uu_kernels[i];
+			return 0;
+		}
+	}
+	printf("UU-Encoding kernel \"%s\" not available.\n", name);
+	return -1;
+}
+
+unsigned int isp_uu_encode_sum(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum)
+{
+	pthread_once(&uu_kernel_once, uu_kernel_default);
+	return uu_kernel->encode(dest, src, orig_size, checksum);
+}
+
+unsigned int isp_uu_decode_sum(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum)
+{
+	pthread_once(&uu_kernel_once, uu_kernel_default);
+	return uu_kernel->decode(dest, src, orig_size, checksum);
+}
+
+int isp_uu_encode(char* dest, char* src, unsigned int orig_size)
+{
+	return isp_uu_encode_sum(dest, src, orig_size, NULL);
+}
+
+int isp_uu_decode(char* dest, char* src, unsigned int orig_size)
+{
+	return isp_uu_decode_sum(dest, src, orig_size, NULL);
+}
+
+uint32_t isp_checksum(const char* data, unsigned int size)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	uint32_t checksum = 0;
+	unsigned int i = 0;
+
+#ifdef UU_X86_KERNELS
+	__m128i acc = _mm_setzero_si128();
+	for (i = 0; (i + 16) <= size; i += 16) {
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)&p[i]), _mm_setzero_si128()));
+	}
+	checksum = uu_sum_epi64(acc);
+#endif
+	for (; i < size; i++) {
+		checksum += p[i];
+	}
+	return checksum;
+}
+
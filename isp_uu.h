@@ -0,0 +1,64 @@
+/*********************************************************************
+ *
+ *   LPC ISP - UU-Encoding kernels
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+#ifndef ISP_UU_H
+#define ISP_UU_H
+
+#include <stdint.h>
+
+/* uuencode "orig_size" bytes from "src" to "dest", as ISP lines of 45 bytes at most,
+ * each terminated by "\r\n". The sum of the data bytes is added to "*checksum" if not
+ * NULL. Returns the encoded size. "dest" must hold ((orig_size + 44) / 45) * 63 bytes.
+ */
+unsigned int isp_uu_encode_sum(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum);
+
+/* Decode the uuencoded lines in "src" to "dest". The sum of the decoded bytes is added
+ * to "*checksum" if not NULL. Returns the decoded size.
+ */
+unsigned int isp_uu_decode_sum(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum);
+
+/* Additive checksum used by the ISP for uuencoded data blocks */
+uint32_t isp_checksum(const char* data, unsigned int size);
+
+
+/* Encoding and decoding implementations, the first one supported by the CPU is used
+ * unless one is selected with isp_uu_select() */
+typedef unsigned int (*isp_uu_fn)(char* dest, const char* src, unsigned int orig_size, uint32_t* checksum);
+
+struct isp_uu_kernel {
+	char* name;
+	int (*supported)(void); /* NULL when always supported */
+	isp_uu_fn encode;
+	isp_uu_fn decode;
+};
+
+/* Available kernels, fastest first, ended by an entry with a NULL name */
+extern struct isp_uu_kernel isp_uu_kernels[];
+
+int isp_uu_kernel_supported(struct isp_uu_kernel* kernel);
+
+/* Use the kernel named "name", or the first supported one when "name" is NULL.
+ * Must not be called while other threads are encoding or decoding.
+ * Returns 0 on success, or -1 if this kernel is not supported. */
+int isp_uu_select(char* name);
+
+#endif /* ISP_UU_H */
@@ -37,8 +37,6 @@
 #include "isp_commands.h"
 #include "isp_utils.h"
 
-extern int trace_on;
-
 
 #define RAM_MAX_SIZE (8 * 1024) /* 8 KB */
 
@@ -51,13 +49,13 @@ extern int trace_on;
  * aruments : address count file uuencoded
  * read 'count' bytes from 'address', store then in 'file', and maybe decode uuencoded data.
  */
-int isp_cmd_read_memory(int arg_count, char** args)
+int isp_cmd_read_memory(struct isp_transport* t, int arg_count, char** args)
 {
 	/* Arguments */
 	unsigned long int addr = 0, count = 0;
 	char* out_file_name = NULL;
 	/* Reply handling */
-	char* data;
+	int out_fd = -1;
 	int ret = 0, len = 0;
 	unsigned int uuencoded = 1;
 
@@ -68,7 +66,7 @@ int isp_cmd_read_memory(int arg_count, char** args)
 	}
 	addr = strtoul(args[0], NULL, 0);
 	count = strtoul(args[1], NULL, 0);
-	if (trace_on) {
+	if (t->trace) {
 		printf("read-memory command called for 0x%08lx (%lu) bytes at address 0x%08lx.\n",
 				count, count, addr);
 	}
@@ -81,24 +79,19 @@ int isp_cmd_read_memory(int arg_count, char** args)
 		uuencoded = strtoul(args[3], NULL, 0);
 	}
 
-	/* Allocate buffer */
-	data = malloc(count);
-	if (data == NULL) {
-		printf("Unable to allocate read buffer, asked %lu.\n", count);
+	out_fd = isp_file_open_out(out_file_name);
+	if (out_fd < 0) {
 		return -10;
 	}
 
-	/* Read data */
-	len = isp_read_memory(data, addr, count, uuencoded);
+	/* Read data, written to the file block by block */
+	len = isp_read_memory_stream(t, addr, count, uuencoded, isp_read_sink_fd, &out_fd);
 	if (len != (int)count) {
 		printf("Read returned %d bytes instead of %lu.\n", len, count);
+		ret = -1;
 	}
 
-	/* Write data to file */
-	ret = isp_buff_to_file(data, len, out_file_name);
-
-	/* Free memory */
-	free(data);
+	isp_file_close_out(out_fd);
 
 	return ret;
 }
@@ -108,7 +101,7 @@ int isp_cmd_read_memory(int arg_count, char** args)
  * aruments : address file do_not_perform_uuencode
  * send 'file' to 'address' in ram with or without uuencoding data
  */
-int isp_cmd_write_to_ram(int arg_count, char** args)
+int isp_cmd_write_to_ram(struct isp_transport* t, int arg_count, char** args)
 {
 	/* Arguments */
 	unsigned long int addr = 0;
@@ -124,7 +117,7 @@ int isp_cmd_write_to_ram(int arg_count, char** args)
 		return -15;
 	}
 	addr = strtoul(args[0], NULL, 0);
-	if (trace_on) {
+	if (t->trace) {
 		printf("write-to-ram command called, destination address in ram is 0x%08lx.\n", addr);
 	}
 	if (addr & 0x03) {
@@ -142,7 +135,7 @@ int isp_cmd_write_to_ram(int arg_count, char** args)
 		return -13;
 	}
 
-	if (trace_on) {
+	if (t->trace) {
 		printf("Read %d octet(s) from input file\n", bytes_read);
 	}
 
@@ -152,12 +145,12 @@ int isp_cmd_write_to_ram(int arg_count, char** args)
 	}
 
 	/* And send to ram */
-	ret = isp_send_buf_to_ram(file_buff, addr, bytes_read, uuencode);
+	ret = isp_send_buf_to_ram(t, file_buff, addr, bytes_read, uuencode);
 
 	return ret;
 }
 
-int isp_cmd_address_wrapper(int arg_count, char** args, char* name, char cmd)
+int isp_cmd_address_wrapper(struct isp_transport* t, int arg_count, char** args, char* name, char cmd)
 {
 	int ret = 0, len = 0;
 	/* Arguments */
@@ -172,7 +165,7 @@ int isp_cmd_address_wrapper(int arg_count, char** args, char* name, char cmd)
 	addr1 = strtoul(args[0], NULL, 0);
 	addr2 = strtoul(args[1], NULL, 0);
 	length = strtoul(args[2], NULL, 0);
-	if (trace_on) {
+	if (t->trace) {
 		printf("%s command called for %lu bytes between addresses %lu and %lu.\n",
 				name, length, addr1, addr2);
 	}
@@ -202,27 +195,26 @@ int isp_cmd_address_wrapper(int arg_count, char** args, char* name, char cmd)
 			return -6;
 	}
 
-	ret = isp_send_cmd_address(cmd, addr1, addr2, length, name);
+	ret = isp_send_cmd_address(t, cmd, addr1, addr2, length, name);
 	return ret;
 }
 
-int isp_cmd_compare(int arg_count, char** args)
+int isp_cmd_compare(struct isp_transport* t, int arg_count, char** args)
 {
 	char buf[REP_BUFSIZE];
 	int ret = 0, len = 0;
 	unsigned long int offset = 0;
 
-	ret = isp_cmd_address_wrapper(arg_count, args, "compare", 'M');
+	ret = isp_cmd_address_wrapper(t, arg_count, args, "compare", 'M');
 	switch (ret) {
 		case CMD_SUCCESS:
 			printf("Source and destination data are equal.\n");
 			break;
 		case COMPARE_ERROR:
 			/* read remaining data */
-			usleep( 2000 );
-			len = isp_serial_read(buf, REP_BUFSIZE, 3);
+			len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
 			if (len <= 0) {
-				printf("Error reading blank-check result.\n");
+				printf("Error reading compare result.\n");
 				return -3;
 			}
 			offset = strtoul(buf, NULL, 10);
@@ -236,11 +228,11 @@ int isp_cmd_compare(int arg_count, char** args)
 	return 0;
 }
 
-int isp_cmd_copy_ram_to_flash(int arg_count, char** args)
+int isp_cmd_copy_ram_to_flash(struct isp_transport* t, int arg_count, char** args)
 {
 	int ret = 0;
 
-	ret = isp_cmd_address_wrapper(arg_count, args, "copy-ram-to-flash", 'C');
+	ret = isp_cmd_address_wrapper(t, arg_count, args, "copy-ram-to-flash", 'C');
 
 	if (ret != 0) {
 		printf("Error when trying to copy data from ram to flash.\n");
@@ -251,7 +243,7 @@ int isp_cmd_copy_ram_to_flash(int arg_count, char** args)
 	return 0;
 }
 
-int isp_cmd_go(int arg_count, char** args)
+int isp_cmd_go(struct isp_transport* t, int arg_count, char** args)
 {
 	int ret = 0;
 	/* Arguments */
@@ -265,7 +257,7 @@ int isp_cmd_go(int arg_count, char** args)
 	}
 	addr = strtoul(args[0], NULL, 0);
 	mode = args[1];
-	if (trace_on) {
+	if (t->trace) {
 		printf("go command called with address 0x%08lx and mode %s.\n", addr, mode);
 	}
 	if (addr < 0x200) {
@@ -281,12 +273,41 @@ int isp_cmd_go(int arg_count, char** args)
 		return -5;
 	}
 
-	ret = isp_send_cmd_go(addr, mode[0]);
+	ret = isp_send_cmd_go(t, addr, mode[0]);
 
 	return ret;
 }
 
-int isp_cmd_sectors_skel(int arg_count, char** args, char* name, char cmd)
+int isp_cmd_set_baud_rate(struct isp_transport* t, int arg_count, char** args)
+{
+	int ret = 0;
+	/* Arguments */
+	unsigned long int baudrate = 0, stop_bits = 1;
+
+	/* Check set-baud-rate arguments */
+	if ((arg_count < 1) || (arg_count > 2)) {
+		printf("set-baud-rate command needs baudrate and optionnal stop bits (1 or 2).\n");
+		return -7;
+	}
+	baudrate = strtoul(args[0], NULL, 0);
+	if (arg_count > 1) {
+		stop_bits = strtoul(args[1], NULL, 0);
+	}
+	if (t->trace) {
+		printf("set-baud-rate command called for %lu bauds and %lu stop bit(s).\n", baudrate, stop_bits);
+	}
+
+	ret = isp_send_cmd_set_baud_rate(t, baudrate, stop_bits);
+	if (ret != 0) {
+		printf("Error when trying to change baudrate.\n");
+		return ret;
+	}
+	printf("Target now using %lu bauds, use \"-b %lu\" for next commands.\n", baudrate, baudrate);
+
+	return 0;
+}
+
+int isp_cmd_sectors_skel(struct isp_transport* t, int arg_count, char** args, char* name, char cmd)
 {
 	int ret = 0;
 	/* Arguments */
@@ -299,23 +320,22 @@ int isp_cmd_sectors_skel(int arg_count, char** args, char* name, char cmd)
 	}
 	first_sector = strtoul(args[0], NULL, 0);
 	last_sector = strtoul(args[1], NULL, 0);
-	if (trace_on) {
+	if (t->trace) {
 		printf("%s command called for sectors %lu to %lu.\n", name, first_sector, last_sector);
 	}
 
-	ret = isp_send_cmd_sectors(name, cmd, first_sector, last_sector, 0);
+	ret = isp_send_cmd_sectors(t, name, cmd, first_sector, last_sector, 0);
 
 	return ret;
 }
 
-int isp_cmd_blank_check(int arg_count, char** args)
+int isp_cmd_blank_check(struct isp_transport* t, int arg_count, char** args)
 {
-	char* tmp = NULL;
 	unsigned long int offset = 0, content = 0;
 	char buf[REP_BUFSIZE];
 	int ret = 0, len = 0;
 
-	ret = isp_cmd_sectors_skel(arg_count, args, "blank-check", 'I');
+	ret = isp_cmd_sectors_skel(t, arg_count, args, "blank-check", 'I');
 	if (ret < 0) {
 		return ret;
 	}
@@ -326,14 +346,19 @@ int isp_cmd_blank_check(int arg_count, char** args)
 			break;
 		case SECTOR_NOT_BLANK:
 			/* read remaining data */
-			usleep( 2000 );
-			len = isp_serial_read(buf, REP_BUFSIZE, 3);
+			/* Offset and content on two lines */
+			len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+			if (len <= 0) {
+				printf("Error reading blank-check result.\n");
+				return -3;
+			}
+			offset = strtoul(buf, NULL, 10);
+			len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
 			if (len <= 0) {
 				printf("Error reading blank-check result.\n");
 				return -3;
 			}
-			offset = strtoul(buf, &tmp, 10);
-			content = strtoul(tmp, NULL, 10);
+			content = strtoul(buf, NULL, 10);
 			printf("First non blank word is at offset 0x%08lx and contains 0x%08lx\n", offset, content);
 			break;
 		case INVALID_SECTOR :
@@ -347,9 +372,9 @@ int isp_cmd_blank_check(int arg_count, char** args)
 	return 0;
 }
 
-int isp_cmd_prepare_for_write(int arg_count, char** args)
+int isp_cmd_prepare_for_write(struct isp_transport* t, int arg_count, char** args)
 {
-	int ret = isp_cmd_sectors_skel(arg_count, args, "prepare-for-write", 'P');
+	int ret = isp_cmd_sectors_skel(t, arg_count, args, "prepare-for-write", 'P');
 
 	if (ret != 0) {
 		printf("Error when trying to prepare sectors for write operation.\n");
@@ -360,9 +385,9 @@ int isp_cmd_prepare_for_write(int arg_count, char** args)
 	return 0;
 }
 
-int isp_cmd_erase(int arg_count, char** args)
+int isp_cmd_erase(struct isp_transport* t, int arg_count, char** args)
 {
-	int ret = isp_cmd_sectors_skel(arg_count, args, "erase", 'E');
+	int ret = isp_cmd_sectors_skel(t, arg_count, args, "erase", 'E');
 
 	if (ret != 0) {
 		printf("Error when trying to erase sectors.\n");
@@ -41,6 +41,7 @@
 #include <string.h> /* strncmp, strlen */
 
 #include "isp_utils.h"
+#include "isp_transport.h"
 #include "isp_commands.h"
 
 #define PROG_NAME "LPC ISP"
@@ -59,11 +60,12 @@ void help(char *prog_name)
 	fprintf(stderr, "-----------------------------------------------------------------------\n");
 	fprintf(stderr, "Usage: %s [options] device [-s | --synchronize]\n" \
 		"       %s [options] device command [command arguments]\n" \
-		"  Default baudrate is B115200\n" \
+		"  Default baudrate is 115200\n" \
 		"  <device> is the (host) serial line used to program the device\n" \
+		"  \t (or tcp:host:port for a serial server, pty:path for a pseudo-terminal)\n" \
 		"  <command> is one of:\n" \
 		"  \t unlock, write-to-ram, read-memory, prepare-for-write, copy-ram-to-flash, go, erase,\n" \
-		"  \t blank-check, read-part-id, read-boot-version, compare and read-uid.\n" \
+		"  \t blank-check, read-part-id, read-boot-version, compare, read-uid and set-baud-rate.\n" \
 		"  command specific arguments are as follow:\n" \
 		"  \t unlock \n" \
 		"  \t write-to-ram address file uuencode : send 'file' to 'address' in ram with or without uuencoding\n" \
@@ -78,15 +80,16 @@ void help(char *prog_name)
 		"  \t read-boot-version \n" \
 		"  \t compare address1 address2 count : compare count bytes between address1 and address2\n" \
 		"  \t read-uid \n" \
+		"  \t set-baud-rate baudrate [stop_bits] : switch target (and host) to 'baudrate'\n" \
 		"  Notes:\n" \
 		"   - Access to the ISP mode is done by calling this utility once with the synchronize\n" \
 		"     option and no command. This starts a session. No command can be used before starting\n" \
 		"     a session, and no other synchronize request must be done once the session is started\n" \
 		"     unless the target is reseted, which closes the session.\n" \
 		"   - Echo is turned OFF when starting a session and the command is not available.\n" \
-		"   - The set-baud-rate command is not available. The SAME baudrate MUST be used for the\n" \
-		"     whole session. It must be specified on each successive call if the default baudrate\n" \
-		"     is not used.\n" \
+		"   - The SAME baudrate MUST be used for the whole session, unless changed using the\n" \
+		"     set-baud-rate command. It must be specified on each successive call if the default\n" \
+		"     baudrate is not used.\n" \
 		"   - User must issue an 'unlock' command before any of 'copy-ram-to-flash', 'erase',\n" \
 		"     and 'go' commands.\n" \
 		"  Available options:\n" \
@@ -98,11 +101,11 @@ void help(char *prog_name)
 	fprintf(stderr, "-----------------------------------------------------------------------\n");
 }
 
-#define SERIAL_BAUD  B115200
+#define SERIAL_BAUD  115200
 
-int trace_on = 0;
+static int trace_on = 0;
 
-int isp_handle_command(char* cmd, int arg_count, char** args);
+int isp_handle_command(struct isp_transport* t, char* cmd, int arg_count, char** args);
 
 int main(int argc, char** argv)
 {
@@ -110,6 +113,7 @@ int main(int argc, char** argv)
 	int crystal_freq = 10000;
 	int synchronize = 0;
 	char* isp_serial_device = NULL;
+	struct isp_transport* t = NULL;
 
 	/* For "command" handling */
 	char* command = NULL;
@@ -140,7 +144,7 @@ int main(int argc, char** argv)
 			/* b, baudrate */
 			case 'b':
 				baudrate = atoi(optarg);
-				/* FIXME: validate baudrate */
+				/* Validated by isp_transport_open() */
 				break;
 
 			/* t, trace */
@@ -181,10 +185,12 @@ int main(int argc, char** argv)
 		help(argv[0]);
 		return 0;
 	}
-	if (isp_serial_open(baudrate, isp_serial_device) != 0) {
+	t = isp_transport_open(isp_serial_device, baudrate);
+	if (t == NULL) {
 		printf("Serial open failed, unable to initiate serial communication with target.\n");
 		return -1;
 	}
+	t->trace = trace_on;
 
 	if (synchronize) {
 		if (optind < argc) {
@@ -193,8 +199,8 @@ int main(int argc, char** argv)
 			printf("NOT SYNCHRONIZED !\n");
 			return -1;
 		}
-		isp_connect(crystal_freq, 0);
-		isp_serial_close();
+		isp_connect(t, crystal_freq, 0);
+		isp_transport_close(t);
 		return 0;
 	}
 
@@ -206,7 +212,7 @@ int main(int argc, char** argv)
 		}
 	} else {
 		printf("No command given. use -h or --help for help on available commands.\n");
-		isp_serial_close();
+		isp_transport_close(t);
 		return -1;
 	}
 	/* And then remaining ones (if any) are command arguments */
@@ -227,7 +233,7 @@ int main(int argc, char** argv)
 
 	if (command != NULL)  {
 		int err = 0;
-		err = isp_handle_command(command, nb_cmd_args, cmd_args);
+		err = isp_handle_command(t, command, nb_cmd_args, cmd_args);
 		if (err >= 0) {
 			if (trace_on) {
 				printf("Command \"%s\" handled OK.\n", command);
@@ -241,40 +247,49 @@ int main(int argc, char** argv)
 	if (cmd_args != NULL) {
 		free(cmd_args);
 	}
-	isp_serial_close();
+	isp_transport_close(t);
 	return 0;
 }
 
 struct isp_command {
 	int cmd_num;
 	char* name;
-	int nb_args;
-	int (*handler)(int arg_count, char** args);
+	int min_args;
+	int max_args; /* Greater than min_args when the last arguments are optional */
+	int (*handler)(struct isp_transport* t, int arg_count, char** args);
 };
 
 
 static struct isp_command isp_cmds_list[] = {
-	{0, "unlock", 0, NULL},
-	{1, "write-to-ram", 3, isp_cmd_write_to_ram},
-	{2, "read-memory", 3, isp_cmd_read_memory},
-	{3, "prepare-for-write", 2, isp_cmd_prepare_for_write},
-	{4, "copy-ram-to-flash", 3, isp_cmd_copy_ram_to_flash},
-	{5, "go", 2, isp_cmd_go},
-	{6, "erase", 2, isp_cmd_erase},
-	{7, "blank-check", 2, isp_cmd_blank_check},
-	{8, "read-part-id", 0, NULL},
-	{9, "read-boot-version", 0, NULL},
-	{10, "compare", 3, isp_cmd_compare},
-	{11, "read-uid", 0, NULL},
-	{-1, NULL, 0, NULL}
+	{0, "unlock", 0, 0, NULL},
+	{1, "write-to-ram", 3, 3, isp_cmd_write_to_ram},
+	{2, "read-memory", 3, 3, isp_cmd_read_memory},
+	{3, "prepare-for-write", 2, 2, isp_cmd_prepare_for_write},
+	{4, "copy-ram-to-flash", 3, 3, isp_cmd_copy_ram_to_flash},
+	{5, "go", 2, 2, isp_cmd_go},
+	{6, "erase", 2, 2, isp_cmd_erase},
+	{7, "blank-check", 2, 2, isp_cmd_blank_check},
+	{8, "read-part-id", 0, 0, NULL},
+	{9, "read-boot-version", 0, 0, NULL},
+	{10, "compare", 3, 3, isp_cmd_compare},
+	{11, "read-uid", 0, 0, NULL},
+	{12, "set-baud-rate", 1, 2, isp_cmd_set_baud_rate},
+	{-1, NULL, 0, 0, NULL}
 };
 
 void isp_warn_args(int cmd_num, int arg_count, char** args)
 {
 	int i = 0;
-	printf("command \"%s\" needs %d args, got %d.\n",
-			isp_cmds_list[cmd_num].name,
-			isp_cmds_list[cmd_num].nb_args, arg_count);
+	if (isp_cmds_list[cmd_num].min_args == isp_cmds_list[cmd_num].max_args) {
+		printf("command \"%s\" needs %d args, got %d.\n",
+				isp_cmds_list[cmd_num].name,
+				isp_cmds_list[cmd_num].max_args, arg_count);
+	} else {
+		printf("command \"%s\" needs %d to %d args, got %d.\n",
+				isp_cmds_list[cmd_num].name,
+				isp_cmds_list[cmd_num].min_args,
+				isp_cmds_list[cmd_num].max_args, arg_count);
+	}
 	for (i=0; i<arg_count; i++) {
 		printf("\targ[%d] : \"%s\"\n", i, args[i]);
 	}
@@ -283,7 +298,7 @@ void isp_warn_args(int cmd_num, int arg_count, char** args)
 /* Handle one command
  * Return positive or NULL value when command handling is OK, or negative value otherwise.
  */
-int isp_handle_command(char* cmd, int arg_count, char** args)
+int isp_handle_command(struct isp_transport* t, char* cmd, int arg_count, char** args)
 {
 	int cmd_found = -1;
 	int ret = 0;
@@ -305,25 +320,26 @@ int isp_handle_command(char* cmd, int arg_count, char** args)
 		printf("Unknown command \"%s\", use -h or --help for a list.\n", cmd);
 		return -2;
 	}
-	if (arg_count != isp_cmds_list[cmd_found].nb_args) {
+	if ((arg_count < isp_cmds_list[cmd_found].min_args) ||
+			(arg_count > isp_cmds_list[cmd_found].max_args)) {
 		isp_warn_args(cmd_found, arg_count, args);
 	}
 
 	switch (isp_cmds_list[cmd_found].cmd_num) {
 		case 0: /* unlock */
-			ret = isp_cmd_unlock(0);
+			ret = isp_cmd_unlock(t, 0);
 			break;
 		case 8: /* read-part-id */
-			ret = isp_cmd_part_id(0);
+			ret = isp_cmd_part_id(t, 0);
 			break;
 		case 9: /* read-boot-version */
-			ret = isp_cmd_boot_version();
+			ret = isp_cmd_boot_version(t);
 			break;
 		case 11: /* read-uid */
-			ret = isp_cmd_read_uid();
+			ret = isp_cmd_read_uid(t);
 			break;
 		default:
-			ret = isp_cmds_list[cmd_found].handler(arg_count, args);
+			ret = isp_cmds_list[cmd_found].handler(t, arg_count, args);
 	}
 
 	return ret;
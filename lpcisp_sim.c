@@ -0,0 +1,999 @@
+/*********************************************************************
+ *
+ *   LPC ISP target simulator
+ *
+ * Emulates the ISP bootloader of a LPC micro-controller on a pseudo-terminal, so that
+ * the ISP tools can be tested and benchmarked without hardware.
+ * The flash and RAM model is built from a parts description file entry, and the time
+ * needed to transmit data at the configured baudrate and the device processing times
+ * (command latency, flash erase and write) are modeled.
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+
+#include <stdlib.h> /* malloc, free, strtoul */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h> /* clock_gettime, clock_nanosleep */
+
+#include <string.h> /* strncmp, strlen, memcpy */
+
+#include "isp_utils.h"
+#include "isp_uu.h"
+#include "isp_transport.h"
+#include "isp_commands.h"
+#include "parts.h"
+
+#define PROG_NAME "LPC ISP target simulator"
+#define VERSION   "1.07"
+
+
+void help(char *prog_name)
+{
+	fprintf(stderr, "---------------- "PROG_NAME" --------------------------------\n");
+	fprintf(stderr, "Usage: %s [options] part_id\n" \
+		"  Simulate the ISP bootloader of the part 'part_id' on a new pseudo-terminal, whose\n" \
+		"  path is printed on startup. Runs until interrupted.\n" \
+		"  Default parts description files are /etc/lpctools_parts.def or ./lpctools_parts.def\n" \
+		"  Available options:\n" \
+		"  \t -p | --parts=file : Parts description file (see defaults)\n" \
+		"  \t -d | --device=dev : Use 'dev' instead of a new pseudo-terminal (see lpcprog -d)\n" \
+		"  \t -b | --baudrate=N : Line speed used to model transmission times (default 115200)\n" \
+		"  \t -W | --no-wire-time : Do not model transmission times\n" \
+		"  \t -l | --latency=N : Device processing time for each command, in microseconds (default 50)\n" \
+		"  \t -e | --erase-time=N : Erase time for each sector, in milliseconds (default 100)\n" \
+		"  \t -w | --write-time=N : Flash write time for 256 bytes, in microseconds (default 1000)\n" \
+		"  \t -i | --init=file : Initial flash content\n" \
+		"  \t -o | --output=file : Save the flash content to 'file' on exit\n" \
+		"  \t -u | --uid=N : First word of the device UID, incremented each time the target is started\n" \
+		"  \t -t | --trace : turn on trace output of serial communication\n" \
+		"  \t -h | --help : display this help\n" \
+		"  \t -v | --version : display version information\n", prog_name);
+	fprintf(stderr, "-----------------------------------------------------------------------\n");
+}
+
+static int trace_on = 0;
+
+char* parts_file_name = NULL;
+#define DEFAULT_PART_FILE_NAME_ETC  "/etc/lpctools_parts.def"
+#define DEFAULT_PART_FILE_NAME_CURRENT  "./lpctools_parts.def"
+
+
+/* Protocol, see section 21.5 of LPC11xx user's manual (UM10398) */
+#define UNLOCK_CODE  23130
+#define SIM_ESC  0x1B /* Abort, see isp_send_abort() */
+#define LINE_DATA_LENGTH  45
+#define LINES_PER_BLOCK  20
+#define MAX_DATA_BLOCK_SIZE  (LINES_PER_BLOCK * LINE_DATA_LENGTH)
+#define ENCODED_BLOCK_SIZE  (LINES_PER_BLOCK * 63)
+#define BOOT_VERSION_MAJOR  1
+#define BOOT_VERSION_MINOR  7
+
+/* Input buffer, big enough for a full uuencoded data block */
+#define SIM_IN_SIZE  4096
+#define SIM_LINE_SIZE  128
+/* Replies are sent in chunks so that data gets to the host at the modeled rate */
+#define SIM_WIRE_CHUNK  64
+/* Stop flag check period when waiting for input */
+#define SIM_POLL_MS  200
+
+/* Results of the input and command functions, on top of the ISP return codes */
+#define SIM_ABORTED  -2 /* Escape character received */
+#define SIM_STOPPED  -3 /* Interrupted, or link error */
+#define SIM_STARTED  -4 /* Go command, the target left ISP mode */
+
+struct sim_target {
+	struct isp_transport* t;
+	struct part_desc* part;
+	char* flash;
+	char* ram;
+	char* prepared; /* One flag per sector */
+	int echo;
+	int unlocked;
+	uint32_t uid[4];
+	/* Input buffer */
+	char in[SIM_IN_SIZE];
+	unsigned int in_len;
+	/* Timing model */
+	int wire_time;
+	unsigned int latency_us;
+	unsigned int erase_ms; /* Per sector */
+	unsigned int write_us; /* Per 256 bytes */
+	struct timespec rx_free; /* End of the last modeled transmission, for each direction */
+	struct timespec tx_free;
+	/* Statistics */
+	unsigned int nb_commands;
+	unsigned long int rx_bytes;
+	unsigned long int tx_bytes;
+};
+
+static volatile sig_atomic_t sim_stop = 0;
+
+static void sim_signal(int sig)
+{
+	(void)sig;
+	sim_stop = 1;
+}
+
+
+/* ---- Timing model ---------------------------------------------------------------*/
+
+static void sim_time_add_ns(struct timespec* ts, uint64_t ns)
+{
+	ts->tv_sec += (ns / 1000000000ULL);
+	ts->tv_nsec += (ns % 1000000000ULL);
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Device processing time */
+static void sim_busy_us(uint64_t us)
+{
+	struct timespec end;
+
+	if (us == 0) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	sim_time_add_ns(&end, (us * 1000));
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL);
+}
+
+/* Account for "nb_bytes" on one direction of the line, and wait until they are
+ * transmitted. The line is busy from now or from the end of the previous transmission,
+ * for 10 bits per byte (8n1).
+ */
+static void sim_wire(struct sim_target* sim, struct timespec* line_free, unsigned int nb_bytes)
+{
+	struct timespec now;
+
+	if (!sim->wire_time) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((line_free->tv_sec < now.tv_sec) ||
+			((line_free->tv_sec == now.tv_sec) && (line_free->tv_nsec < now.tv_nsec))) {
+		*line_free = now;
+	}
+	sim_time_add_ns(line_free, (((uint64_t)nb_bytes * 10 * 1000000000ULL) / sim->t->baudrate));
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, line_free, NULL);
+}
+
+
+/* ---- Serial line ----------------------------------------------------------------*/
+
+static int sim_send(struct sim_target* sim, const char* buf, unsigned int len)
+{
+	unsigned int done = 0;
+
+	while (done < len) {
+		unsigned int size = (len - done);
+		if (size > SIM_WIRE_CHUNK) {
+			size = SIM_WIRE_CHUNK;
+		}
+		sim_wire(sim, &sim->tx_free, size);
+		if (isp_serial_write(sim->t, (buf + done), size) != (int)size) {
+			printf("Unable to send reply.\n");
+			return SIM_STOPPED;
+		}
+		done += size;
+	}
+	sim->tx_bytes += len;
+	return 0;
+}
+
+static int sim_reply(struct sim_target* sim, const char* format, ...)
+{
+	char buf[SIM_LINE_SIZE];
+	va_list args;
+	int len = 0;
+
+	va_start(args, format);
+	len = vsnprintf(buf, SIM_LINE_SIZE, format, args);
+	va_end(args);
+	return sim_send(sim, buf, len);
+}
+
+/* Get more input, waiting for it as long as the simulator is not stopped.
+ * Returns the number of bytes added, or SIM_STOPPED.
+ */
+static int sim_fill(struct sim_target* sim)
+{
+	struct timespec deadline;
+	int nb = 0;
+
+	if (sim->in_len == SIM_IN_SIZE) {
+		/* No end of line in a full buffer, drop it */
+		sim->in_len = 0;
+	}
+	do {
+		isp_deadline_set(&deadline, SIM_POLL_MS);
+		nb = sim->t->ops->read(sim->t, &sim->in[sim->in_len], (SIM_IN_SIZE - sim->in_len), &deadline);
+	} while ((nb == 0) && !sim_stop);
+	if ((nb <= 0) || sim_stop) {
+		return SIM_STOPPED;
+	}
+	if (trace_on) {
+		printf("Received %d octet(s) :\n", nb);
+		isp_dump((unsigned char*)&sim->in[sim->in_len], nb);
+	}
+	sim->in_len += nb;
+	sim->rx_bytes += nb;
+	return nb;
+}
+
+static void sim_consume(struct sim_target* sim, unsigned int len)
+{
+	memmove(sim->in, &sim->in[len], (sim->in_len - len));
+	sim->in_len -= len;
+}
+
+/* Read one line from the host, echoed if echo is on. The line terminators are removed,
+ * and the line truncated to "size" (terminating nul included).
+ * Returns the line length, SIM_ABORTED if an escape character was received first, or
+ * SIM_STOPPED.
+ */
+static int sim_readline(struct sim_target* sim, char* buf, unsigned int size)
+{
+	unsigned int i = 0;
+	unsigned int len = 0;
+
+	while (1) {
+		for (i = 0; i < sim->in_len; i++) {
+			if (sim->in[i] == SIM_ESC) {
+				sim_consume(sim, (i + 1));
+				return SIM_ABORTED;
+			}
+			if (sim->in[i] == '\n') {
+				break;
+			}
+		}
+		if (i < sim->in_len) {
+			break;
+		}
+		if (sim_fill(sim) < 0) {
+			return SIM_STOPPED;
+		}
+	}
+	sim_wire(sim, &sim->rx_free, (i + 1));
+	if (sim->echo && (sim_send(sim, sim->in, (i + 1)) != 0)) {
+		return SIM_STOPPED;
+	}
+	len = i;
+	while ((len > 0) && (sim->in[len - 1] == '\r')) {
+		len--;
+	}
+	if (len >= size) {
+		len = size - 1;
+	}
+	memcpy(buf, sim->in, len);
+	buf[len] = '\0';
+	sim_consume(sim, (i + 1));
+	return len;
+}
+
+/* Read "len" bytes of binary data */
+static int sim_read_data(struct sim_target* sim, char* buf, unsigned int len)
+{
+	unsigned int done = 0;
+
+	while (done < len) {
+		unsigned int size = (len - done);
+		if (sim->in_len == 0) {
+			if (sim_fill(sim) < 0) {
+				return SIM_STOPPED;
+			}
+		}
+		if (size > sim->in_len) {
+			size = sim->in_len;
+		}
+		sim_wire(sim, &sim->rx_free, size);
+		if (sim->echo && (sim_send(sim, sim->in, size) != 0)) {
+			return SIM_STOPPED;
+		}
+		memcpy((buf + done), sim->in, size);
+		sim_consume(sim, size);
+		done += size;
+	}
+	return done;
+}
+
+
+/* ---- Memory model ---------------------------------------------------------------*/
+
+/* Host address of "len" bytes of target memory at "addr", NULL if not mapped */
+static char* sim_mem(struct sim_target* sim, uint32_t addr, uint32_t len, int allow_flash)
+{
+	struct part_desc* part = sim->part;
+
+	if ((addr >= part->ram_base) && (len <= part->ram_size) &&
+			((addr - part->ram_base) <= (part->ram_size - len))) {
+		return &sim->ram[addr - part->ram_base];
+	}
+	if (allow_flash && (addr >= part->flash_base) && (len <= part->flash_size) &&
+			((addr - part->flash_base) <= (part->flash_size - len))) {
+		return &sim->flash[addr - part->flash_base];
+	}
+	return NULL;
+}
+
+static int sim_check_sectors(struct sim_target* sim, uint32_t first, uint32_t last)
+{
+	if ((first > last) || (last >= sim->part->flash_nb_sectors)) {
+		return INVALID_SECTOR;
+	}
+	return CMD_SUCCESS;
+}
+
+
+/* ---- Commands -------------------------------------------------------------------*/
+
+/* Write to RAM, uuencoded data is received by blocks of 20 lines followed by their
+ * checksum. */
+static int sim_write_to_ram(struct sim_target* sim, char* dest, uint32_t count)
+{
+	char line[SIM_LINE_SIZE];
+	char block[MAX_DATA_BLOCK_SIZE + SIM_LINE_SIZE]; /* Lines may hold more than announced */
+	uint32_t done = 0;
+	int len = 0;
+
+	if (sim->part->uuencode == 0) {
+		len = sim_read_data(sim, dest, count);
+		return ((len < 0) ? len : 0);
+	}
+	while (done < count) {
+		unsigned int nb_lines = 0, line_num = 0, size = 0;
+		uint32_t checksum = 0;
+
+		nb_lines = (((count - done) + (LINE_DATA_LENGTH - 1)) / LINE_DATA_LENGTH);
+		if (nb_lines > LINES_PER_BLOCK) {
+			nb_lines = LINES_PER_BLOCK;
+		}
+		for (line_num = 0; line_num < nb_lines; line_num++) {
+			len = sim_readline(sim, line, SIM_LINE_SIZE);
+			if (len < 0) {
+				return len;
+			}
+			if (size < MAX_DATA_BLOCK_SIZE) {
+				size += isp_uu_decode_sum(&block[size], line, len, &checksum);
+			}
+		}
+		len = sim_readline(sim, line, SIM_LINE_SIZE);
+		if (len < 0) {
+			return len;
+		}
+		if ((size > (count - done)) || (strtoul(line, NULL, 10) != checksum)) {
+			if (trace_on) {
+				printf("Checksum error on data block at offset %u.\n", done);
+			}
+			len = sim_reply(sim, "RESEND\r\n");
+		} else {
+			memcpy((dest + done), block, size);
+			done += size;
+			len = sim_reply(sim, "OK\r\n");
+		}
+		if (len != 0) {
+			return len;
+		}
+	}
+	return 0;
+}
+
+/* Read memory, uuencoded data is sent by blocks of 20 lines followed by their checksum,
+ * each block being acknowledged by the host. */
+static int sim_read_memory(struct sim_target* sim, char* src, uint32_t count)
+{
+	char line[SIM_LINE_SIZE];
+	char encoded[ENCODED_BLOCK_SIZE];
+	uint32_t done = 0;
+	int len = 0;
+
+	if (sim->part->uuencode == 0) {
+		return sim_send(sim, src, count);
+	}
+	while (done < count) {
+		unsigned int size = (count - done), enc_size = 0;
+		uint32_t checksum = 0;
+
+		if (size > MAX_DATA_BLOCK_SIZE) {
+			size = MAX_DATA_BLOCK_SIZE;
+		}
+		enc_size = isp_uu_encode_sum(encoded, (src + done), size, &checksum);
+		if ((sim_send(sim, encoded, enc_size) != 0) || (sim_reply(sim, "%u\r\n", checksum) != 0)) {
+			return SIM_STOPPED;
+		}
+		do {
+			len = sim_readline(sim, line, SIM_LINE_SIZE);
+		} while (len == 0);
+		if (len < 0) {
+			return len;
+		}
+		if (strcmp(line, "OK") == 0) {
+			done += size;
+		} else if (strcmp(line, "RESEND") != 0) {
+			printf("Unexpected data block acknowledge : \"%s\".\n", line);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+static int sim_blank_check(struct sim_target* sim, uint32_t first, uint32_t last)
+{
+	struct part_desc* part = sim->part;
+	uint32_t start = part_sector_start(part, first);
+	uint32_t end = part_sector_start(part, last) + part_sector_size(part, last);
+	uint32_t offset = 0;
+
+	for (offset = start; offset < end; offset += 4) {
+		uint32_t word = 0;
+		memcpy(&word, &sim->flash[offset], 4);
+		if (word != 0xFFFFFFFF) {
+			/* Offset is relative to the start of the first sector checked */
+			return sim_reply(sim, "%d\r\n%u\r\n%u\r\n", SECTOR_NOT_BLANK, (offset - start), word);
+		}
+	}
+	return sim_reply(sim, "%d\r\n", CMD_SUCCESS);
+}
+
+static int sim_copy_ram_to_flash(struct sim_target* sim, uint32_t dst, uint32_t src, uint32_t count)
+{
+	struct part_desc* part = sim->part;
+	uint32_t copy_sizes = (part->copy_sizes ? part->copy_sizes : PART_DEFAULT_COPY_SIZES);
+	char* ram = NULL;
+	uint32_t i = 0;
+	int first = 0, last = 0, sector = 0;
+
+	if (!sim->unlocked) {
+		return CMD_LOCKED;
+	}
+	if (dst & 0xFF) {
+		return DST_ADDR_ERROR;
+	}
+	if ((dst < part->flash_base) || ((dst - part->flash_base) >= part->flash_size)) {
+		return DST_ADDR_NOT_MAPPED;
+	}
+	if (src & 0x03) {
+		return SRC_ADDR_ERROR;
+	}
+	ram = sim_mem(sim, src, count, 0);
+	if (ram == NULL) {
+		return SRC_ADDR_NOT_MAPPED;
+	}
+	if ((count == 0) || (count & (count - 1)) || !(copy_sizes & count) ||
+			(count > (part->flash_size - (dst - part->flash_base)))) {
+		return COUNT_ERROR;
+	}
+	first = part_offset_to_sector(part, (dst - part->flash_base));
+	last = part_offset_to_sector(part, (dst - part->flash_base + count - 1));
+	for (sector = first; sector <= last; sector++) {
+		if (!sim->prepared[sector]) {
+			return SECTOR_NOT_PREPARED_FOR_WRITE_OPERATION;
+		}
+	}
+	/* Bits can only be cleared without an erase */
+	for (i = 0; i < count; i++) {
+		sim->flash[(dst - part->flash_base) + i] &= ram[i];
+	}
+	sim_busy_us(((uint64_t)sim->write_us * count) / 256);
+	/* Sectors are protected again after each write or erase */
+	memset(sim->prepared, 0, part->flash_nb_sectors);
+	return CMD_SUCCESS;
+}
+
+static int sim_erase(struct sim_target* sim, uint32_t first, uint32_t last)
+{
+	struct part_desc* part = sim->part;
+	uint32_t sector = 0;
+
+	if (!sim->unlocked) {
+		return CMD_LOCKED;
+	}
+	if (sim_check_sectors(sim, first, last) != CMD_SUCCESS) {
+		return INVALID_SECTOR;
+	}
+	for (sector = first; sector <= last; sector++) {
+		if (!sim->prepared[sector]) {
+			return SECTOR_NOT_PREPARED_FOR_WRITE_OPERATION;
+		}
+	}
+	for (sector = first; sector <= last; sector++) {
+		memset(&sim->flash[part_sector_start(part, sector)], 0xFF, part_sector_size(part, sector));
+	}
+	sim_busy_us((uint64_t)sim->erase_ms * 1000 * (last - first + 1));
+	memset(sim->prepared, 0, part->flash_nb_sectors);
+	return CMD_SUCCESS;
+}
+
+/* Handle one command line.
+ * Returns 0 when done, or one of the SIM_* results.
+ */
+static int sim_command(struct sim_target* sim, char* line)
+{
+	struct part_desc* part = sim->part;
+	uint32_t args[3] = { 0, 0, 0, };
+	char* mode = NULL;
+	char* ptr = line + 1;
+	char* end = NULL;
+	char* mem = NULL;
+	char* mem2 = NULL;
+	int nb_args = 0;
+	int ret = CMD_SUCCESS;
+
+	/* Numeric arguments, and the mode of the go command */
+	while ((*ptr != '\0') && (nb_args < 3)) {
+		while (*ptr == ' ') {
+			ptr++;
+		}
+		if (*ptr == '\0') {
+			break;
+		}
+		args[nb_args] = strtoul(ptr, &end, 10);
+		if (end == ptr) {
+			mode = ptr;
+			break;
+		}
+		nb_args++;
+		ptr = end;
+	}
+	sim->nb_commands++;
+	sim_busy_us(sim->latency_us);
+
+	switch (line[0]) {
+		case 'U': /* Unlock */
+			if (nb_args != 1) {
+				ret = PARAM_ERROR;
+			} else if (args[0] != UNLOCK_CODE) {
+				ret = INVALID_CODE;
+			} else {
+				sim->unlocked = 1;
+			}
+			break;
+
+		case 'B': /* Set baud rate */
+			if (nb_args != 2) {
+				ret = PARAM_ERROR;
+			} else if (args[0] == 0) {
+				ret = INVALID_BAUD_RATE;
+			} else if ((args[1] != 1) && (args[1] != 2)) {
+				ret = INVALID_STOP_BIT;
+			} else {
+				/* Reply at the current speed */
+				if (sim_reply(sim, "%d\r\n", CMD_SUCCESS) != 0) {
+					return SIM_STOPPED;
+				}
+				isp_transport_set_baud(sim->t, args[0]);
+				if (trace_on) {
+					printf("Baudrate set to %u.\n", args[0]);
+				}
+				return 0;
+			}
+			break;
+
+		case 'A': /* Echo */
+			if ((nb_args != 1) || (args[0] > 1)) {
+				ret = PARAM_ERROR;
+			} else {
+				/* This command is echoed with the previous setting */
+				sim->echo = args[0];
+			}
+			break;
+
+		case 'W': /* Write to RAM */
+			if (nb_args != 2) {
+				ret = PARAM_ERROR;
+			} else if (args[0] & 0x03) {
+				ret = ADDR_ERROR;
+			} else if (args[1] & 0x03) {
+				ret = COUNT_ERROR;
+			} else if ((mem = sim_mem(sim, args[0], args[1], 0)) == NULL) {
+				ret = ADDR_NOT_MAPPED;
+			} else {
+				if (sim_reply(sim, "%d\r\n", CMD_SUCCESS) != 0) {
+					return SIM_STOPPED;
+				}
+				return sim_write_to_ram(sim, mem, args[1]);
+			}
+			break;
+
+		case 'R': /* Read memory */
+			if (nb_args != 2) {
+				ret = PARAM_ERROR;
+			} else if (args[0] & 0x03) {
+				ret = ADDR_ERROR;
+			} else if (args[1] & 0x03) {
+				ret = COUNT_ERROR;
+			} else if ((mem = sim_mem(sim, args[0], args[1], 1)) == NULL) {
+				ret = ADDR_NOT_MAPPED;
+			} else {
+				if (sim_reply(sim, "%d\r\n", CMD_SUCCESS) != 0) {
+					return SIM_STOPPED;
+				}
+				return sim_read_memory(sim, mem, args[1]);
+			}
+			break;
+
+		case 'P': /* Prepare sectors for write operation */
+			if (nb_args != 2) {
+				ret = PARAM_ERROR;
+			} else {
+				ret = sim_check_sectors(sim, args[0], args[1]);
+				if (ret == CMD_SUCCESS) {
+					memset(&sim->prepared[args[0]], 1, (args[1] - args[0] + 1));
+				}
+			}
+			break;
+
+		case 'C': /* Copy RAM to flash */
+			if (nb_args != 3) {
+				ret = PARAM_ERROR;
+			} else {
+				ret = sim_copy_ram_to_flash(sim, args[0], args[1], args[2]);
+			}
+			break;
+
+		case 'E': /* Erase sectors */
+			if (nb_args != 2) {
+				ret = PARAM_ERROR;
+			} else {
+				ret = sim_erase(sim, args[0], args[1]);
+			}
+			break;
+
+		case 'I': /* Blank check sectors */
+			if (nb_args != 2) {
+				ret = PARAM_ERROR;
+			} else {
+				ret = sim_check_sectors(sim, args[0], args[1]);
+				if (ret == CMD_SUCCESS) {
+					return sim_blank_check(sim, args[0], args[1]);
+				}
+			}
+			break;
+
+		case 'J': /* Read part ID */
+			return sim_reply(sim, "%d\r\n%u\r\n", CMD_SUCCESS, (unsigned int)part->part_id);
+
+		case 'K': /* Read boot code version, minor first */
+			return sim_reply(sim, "%d\r\n%u\r\n%u\r\n", CMD_SUCCESS, BOOT_VERSION_MINOR, BOOT_VERSION_MAJOR);
+
+		case 'N': /* Read UID */
+			return sim_reply(sim, "%d\r\n%u\r\n%u\r\n%u\r\n%u\r\n", CMD_SUCCESS,
+								sim->uid[0], sim->uid[1], sim->uid[2], sim->uid[3]);
+
+		case 'M': /* Compare */
+			if (nb_args != 3) {
+				ret = PARAM_ERROR;
+			} else if ((args[0] & 0x03) || (args[1] & 0x03)) {
+				ret = ADDR_ERROR;
+			} else if (args[2] & 0x03) {
+				ret = COUNT_ERROR;
+			} else if (((mem = sim_mem(sim, args[0], args[2], 1)) == NULL) ||
+						((mem2 = sim_mem(sim, args[1], args[2], 1)) == NULL)) {
+				ret = ADDR_NOT_MAPPED;
+			} else {
+				uint32_t offset = 0;
+				for (offset = 0; offset < args[2]; offset += 4) {
+					if (memcmp(&mem[offset], &mem2[offset], 4) != 0) {
+						return sim_reply(sim, "%d\r\n%u\r\n", COMPARE_ERROR, offset);
+					}
+				}
+			}
+			break;
+
+		case 'S': /* Read CRC checksum, optional */
+			if (!(part->isp_cmds & PART_CMD_CRC)) {
+				ret = INVALID_COMMAND;
+			} else if (nb_args != 2) {
+				ret = PARAM_ERROR;
+			} else if ((args[0] & 0x03) || (args[1] & 0x03)) {
+				ret = ADDR_ERROR;
+			} else if ((mem = sim_mem(sim, args[0], args[1], 1)) == NULL) {
+				ret = ADDR_NOT_MAPPED;
+			} else {
+				return sim_reply(sim, "%d\r\n%u\r\n", CMD_SUCCESS, isp_crc32(mem, args[1]));
+			}
+			break;
+
+		case 'G': /* Go */
+			if (!sim->unlocked) {
+				ret = CMD_LOCKED;
+			} else if ((nb_args != 1) || (mode == NULL) || ((*mode != 'T') && (*mode != 'A'))) {
+				ret = PARAM_ERROR;
+			} else if (sim_mem(sim, args[0], 4, 1) == NULL) {
+				ret = ADDR_NOT_MAPPED;
+			} else {
+				if (sim_reply(sim, "%d\r\n", CMD_SUCCESS) != 0) {
+					return SIM_STOPPED;
+				}
+				printf("Program started at 0x%08x (%s mode).\n", args[0], ((*mode == 'T') ? "thumb" : "arm"));
+				return SIM_STARTED;
+			}
+			break;
+
+		default:
+			ret = INVALID_COMMAND;
+			break;
+	}
+
+	return sim_reply(sim, "%d\r\n", ret);
+}
+
+
+/* ---- Session --------------------------------------------------------------------*/
+
+/* Wait for the autobaud character and the synchronisation handshake.
+ * Returns 0 once synchronized, or SIM_STOPPED.
+ */
+static int sim_synchronize(struct sim_target* sim)
+{
+	char line[SIM_LINE_SIZE];
+	int len = 0;
+
+	sim->echo = 1;
+	sim->unlocked = 0;
+	memset(sim->prepared, 0, sim->part->flash_nb_sectors);
+	while (1) {
+		char* sync = NULL;
+
+		/* Autobaud : anything before the '?' is lost */
+		while ((sync = memchr(sim->in, '?', sim->in_len)) == NULL) {
+			sim->in_len = 0;
+			if (sim_fill(sim) < 0) {
+				return SIM_STOPPED;
+			}
+		}
+		sim_consume(sim, (sync - sim->in + 1));
+		sim_wire(sim, &sim->rx_free, 1);
+		if (sim_reply(sim, "Synchronized\r\n") != 0) {
+			return SIM_STOPPED;
+		}
+		len = sim_readline(sim, line, SIM_LINE_SIZE);
+		if (len == SIM_STOPPED) {
+			return SIM_STOPPED;
+		}
+		if ((len < 0) || (strcmp(line, "Synchronized") != 0)) {
+			continue;
+		}
+		if (sim_reply(sim, "OK\r\n") != 0) {
+			return SIM_STOPPED;
+		}
+		/* Crystal frequency, anything is accepted */
+		len = sim_readline(sim, line, SIM_LINE_SIZE);
+		if (len == SIM_STOPPED) {
+			return SIM_STOPPED;
+		}
+		if (len < 0) {
+			continue;
+		}
+		if (sim_reply(sim, "OK\r\n") != 0) {
+			return SIM_STOPPED;
+		}
+		if (trace_on) {
+			printf("Synchronized.\n");
+		}
+		return 0;
+	}
+}
+
+static int sim_session(struct sim_target* sim)
+{
+	char line[SIM_LINE_SIZE];
+	int ret = 0;
+
+	while (1) {
+		ret = sim_synchronize(sim);
+		while (ret == 0) {
+			ret = sim_readline(sim, line, SIM_LINE_SIZE);
+			if (ret == SIM_ABORTED) {
+				ret = 0;
+				continue;
+			}
+			if (ret <= 0) {
+				continue;
+			}
+			ret = sim_command(sim, line);
+			if (ret == SIM_ABORTED) {
+				ret = 0;
+			}
+		}
+		if (ret != SIM_STARTED) {
+			return ret;
+		}
+		/* Next reset into ISP mode, seen as a new device */
+		sim->uid[0]++;
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	struct sim_target sim;
+	struct sigaction action;
+	struct parts_db* parts_db = NULL;
+	struct part_desc* part = NULL;
+	char* device = "pty:";
+	char* init_file = NULL;
+	char* output_file = NULL;
+	unsigned int baudrate = 115200;
+	uint64_t part_id = 0;
+	int ret = 0;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.wire_time = 1;
+	sim.latency_us = 50;
+	sim.erase_ms = 100;
+	sim.write_us = 1000;
+	sim.uid[0] = 0x0b0b134f;
+	sim.uid[1] = 0x53531b87;
+	sim.uid[2] = 0x4d3ccb42;
+	sim.uid[3] = 0xf5000000;
+
+	/* parameter parsing */
+	while(1) {
+		int option_index = 0;
+		int c = 0;
+
+		struct option long_options[] = {
+			{"parts", required_argument, 0, 'p'},
+			{"device", required_argument, 0, 'd'},
+			{"baudrate", required_argument, 0, 'b'},
+			{"no-wire-time", no_argument, 0, 'W'},
+			{"latency", required_argument, 0, 'l'},
+			{"erase-time", required_argument, 0, 'e'},
+			{"write-time", required_argument, 0, 'w'},
+			{"init", required_argument, 0, 'i'},
+			{"output", required_argument, 0, 'o'},
+			{"uid", required_argument, 0, 'u'},
+			{"trace", no_argument, 0, 't'},
+			{"help", no_argument, 0, 'h'},
+			{"version", no_argument, 0, 'v'},
+			{0, 0, 0, 0}
+		};
+
+		c = getopt_long(argc, argv, "p:d:b:Wl:e:w:i:o:u:thv", long_options, &option_index);
+
+		/* no more options to parse */
+		if (c == -1) break;
+
+		switch (c) {
+			case 'p':
+				parts_file_name = strdup(optarg);
+				break;
+			case 'd':
+				device = strdup(optarg);
+				break;
+			case 'b':
+				baudrate = strtoul(optarg, NULL, 0);
+				break;
+			case 'W':
+				sim.wire_time = 0;
+				break;
+			case 'l':
+				sim.latency_us = strtoul(optarg, NULL, 0);
+				break;
+			case 'e':
+				sim.erase_ms = strtoul(optarg, NULL, 0);
+				break;
+			case 'w':
+				sim.write_us = strtoul(optarg, NULL, 0);
+				break;
+			case 'i':
+				init_file = strdup(optarg);
+				break;
+			case 'o':
+				output_file = strdup(optarg);
+				break;
+			case 'u':
+				sim.uid[0] = strtoul(optarg, NULL, 0);
+				break;
+			case 't':
+				trace_on = 1;
+				break;
+			case 'v':
+				printf("%s Version %s\n", PROG_NAME, VERSION);
+				return 0;
+			case 'h':
+			default:
+				help(argv[0]);
+				return 0;
+		}
+	}
+	if (optind != (argc - 1)) {
+		help(argv[0]);
+		return -1;
+	}
+	part_id = strtoull(argv[optind], NULL, 0);
+
+	/* Same parts lookup as lpcprog */
+	if (parts_file_name == NULL) {
+		if (access(DEFAULT_PART_FILE_NAME_CURRENT, R_OK) == 0) {
+			parts_file_name = DEFAULT_PART_FILE_NAME_CURRENT;
+		} else if (access(DEFAULT_PART_FILE_NAME_ETC, R_OK) == 0) {
+			parts_file_name = DEFAULT_PART_FILE_NAME_ETC;
+		}
+	}
+	if (parts_file_name != NULL) {
+		parts_db = parts_file_open(parts_file_name);
+	}
+	if (parts_db != NULL) {
+		part = find_part_in_file(parts_db, part_id, parts_file_name);
+	}
+	if (part == NULL) {
+		part = find_part_internal_tab(part_id);
+	}
+	if (part == NULL) {
+		printf("Unknown part number : 0x%08llx.\n", (unsigned long long)part_id);
+		return -1;
+	}
+	sim.part = part;
+
+	/* Memory model, flash is erased unless an initial content is given */
+	sim.flash = malloc(part->flash_size);
+	sim.ram = calloc(1, part->ram_size);
+	sim.prepared = calloc(1, part->flash_nb_sectors);
+	if ((sim.flash == NULL) || (sim.ram == NULL) || (sim.prepared == NULL)) {
+		printf("Unable to allocate memory model.\n");
+		return -1;
+	}
+	memset(sim.flash, 0xFF, part->flash_size);
+	if ((init_file != NULL) && (isp_file_to_buff(sim.flash, part->flash_size, init_file) < 0)) {
+		printf("Unable to load initial flash content from \"%s\".\n", init_file);
+		return -1;
+	}
+
+	/* Output is read by scripts */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	sim.t = isp_transport_open(device, baudrate);
+	if (sim.t == NULL) {
+		printf("Unable to open \"%s\".\n", device);
+		return -1;
+	}
+	sim.t->trace = trace_on;
+	sim.t->part = part;
+	printf("Simulating %s (0x%08x) at %u bauds%s.\n", part->name, (unsigned int)part->part_id,
+				baudrate, (sim.wire_time ? "" : ", transmission times not modeled"));
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = sim_signal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	ret = sim_session(&sim);
+
+	printf("%u command(s), %lu byte(s) received, %lu byte(s) sent.\n", sim.nb_commands, sim.rx_bytes, sim.tx_bytes);
+	if ((output_file != NULL) && (isp_buff_to_file(sim.flash, part->flash_size, output_file) < 0)) {
+		printf("Unable to save flash content to \"%s\".\n", output_file);
+		ret = -1;
+	}
+	isp_transport_close(sim.t);
+	free(sim.flash);
+	free(sim.ram);
+	free(sim.prepared);
+	parts_db_free(parts_db);
+	return ((ret == SIM_STOPPED) ? 0 : ret);
+}
@@ -35,6 +35,11 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h> /* Gang mode */
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/file.h> /* flock */
+#include <time.h>
 
 #include <termios.h> /* for serial config */
 #include <ctype.h>
@@ -42,6 +47,7 @@
 #include <string.h> /* strncmp, strlen, strdup */
 
 #include "isp_utils.h"
+#include "isp_transport.h"
 #include "isp_commands.h"
 #include "prog_commands.h"
 #include "parts.h"
@@ -55,7 +61,7 @@ void help(char *prog_name)
 	fprintf(stderr, "---------------- "PROG_NAME" --------------------------------\n");
 	fprintf(stderr, "Usage: %s -d <dev_name> -c <command> [options] [dump/prog file name]\n" \
 		"  Default parts description files are /etc/lpctools_parts.def or ./lpctools_parts.def\n" \
-		"  Default baudrate is B115200\n" \
+		"  Default baudrate is 115200\n" \
 		"  Default oscilator frequency used is 10000 KHz\n" \
 		"  <command> is one of:\n" \
 		"  \t dump, flash, id, blank, go\n" \
@@ -68,40 +74,71 @@ void help(char *prog_name)
 		"  \t -p | --parts=file : Parts description file (see defaults)\n" \
 		"  \t -c | --command=cmd : \n" \
 		"  \t -d | --device=dev_path : Host serial line used to program the device\n" \
+		"  \t     (or tcp:host:port for a serial server, pty:path for a pseudo-terminal)\n" \
+		"  \t     Give it more than once to handle many targets at once (gang mode)\n" \
 		"  \t -b | --baudrate=N : Use this baudrate (Same baudrate must be used across whole session)\n" \
+		"  \t -B | --transfer-baudrate=N : Switch target to this baudrate once synchronized, and back\n" \
+		"  \t     to the session baudrate before exit (non standard host baudrates are supported)\n" \
+		"  \t -a | --auto-baudrate : Find the fastest reliable transfer baudrate (up to -B value if given)\n" \
+		"  \t -S | --speed-file=file : Remember auto-baudrate results per device in 'file'\n" \
+		"  \t -g | --cmd-gap=N : Wait at least N microseconds after a reply before sending data\n" \
+		"  \t     (only for devices which need it)\n" \
 		"  \t -t | --trace : turn on trace output of serial communication\n" \
 		"  \t -f | --freq=N : Oscilator frequency of target device\n" \
 		"  \t -n | --no-user-code : do not compute a valid user code for exception vector 7\n" \
+		"  \t -D | --delta[=read|compare] : flash only the sectors which differ from the image,\n" \
+		"  \t     found by reading them back (default) or with the ISP compare command\n" \
+		"  \t -G | --start : start the program once the command is done\n" \
+		"  \t -L | --loop : station mode, handle targets one after the other until interrupted\n" \
+		"  \t -l | --log=file : station mode log, one line per target with its UID\n" \
 		"  \t -h | --help : display this help\n" \
 		"  \t -v | --version : display version information\n", prog_name);
 	fprintf(stderr, "-----------------------------------------------------------------------\n");
 }
 
-#define SERIAL_BAUD  B115200
+#define SERIAL_BAUD  115200
 
-int trace_on = 0;
+static int trace_on = 0;
 int quiet = 0;
 static int calc_user_code = 1; /* User code is computed by default */
+static int flash_mode = FLASH_FULL;
+static int auto_baudrate = 0;
+static char* speed_file_name = NULL;
+static int baudrate = SERIAL_BAUD;
+static int transfer_baudrate = 0;
+static int crystal_freq = 10000;
+static unsigned int cmd_gap_us = 0;
+static struct flash_image image; /* Loaded once for all targets */
+static int start_after = 0;
+static int station_mode = 0;
+static char* station_log_name = NULL;
+
+/* For "command" handling */
+static char* command = NULL;
+static char** cmd_args = NULL;
+static int nb_cmd_args = 0;
+
+/* Serial devices, more than one for gang mode */
+static char** devices = NULL;
+static int nb_devices = 0;
 
 char* parts_file_name = NULL;
+static struct parts_db* parts_db = NULL; /* Read once, shared by all targets */
 #define DEFAULT_PART_FILE_NAME_ETC  "/etc/lpctools_parts.def"
 #define DEFAULT_PART_FILE_NAME_CURRENT  "./lpctools_parts.def"
 
-static int prog_connect_and_id(int freq);
-static int prog_handle_command(char* cmd, int dev_id, int arg_count, char** args);
+static int prog_session(char* isp_serial_device);
+static int prog_station(char* isp_serial_device);
+static int prog_target(struct isp_transport* t, char* isp_serial_device, int dev_id);
+static int prog_gang(void);
+static int prog_connect_and_id(struct isp_transport* t, int freq);
+static int prog_handle_command(struct isp_transport* t, char* cmd, struct part_desc* part, int arg_count, char** args);
+static int speed_file_lookup(char* file_name, char* device);
+static int speed_file_store(char* file_name, char* device, unsigned int baudrate);
 
 int main(int argc, char** argv)
 {
-	int baudrate = SERIAL_BAUD;
-	int crystal_freq = 10000;
-	char* isp_serial_device = NULL;
-	int dev_id = 0;
-
-	/* For "command" handling */
-	char* command = NULL;
-	char** cmd_args = NULL;
-	int nb_cmd_args = 0;
-
+	int ret = 0;
 
 	/* parameter parsing */
 	while(1) {
@@ -113,15 +150,23 @@ int main(int argc, char** argv)
 			{"command", required_argument, 0, 'c'},
 			{"device", required_argument, 0, 'd'},
 			{"baudrate", required_argument, 0, 'b'},
+			{"transfer-baudrate", required_argument, 0, 'B'},
+			{"auto-baudrate", no_argument, 0, 'a'},
+			{"speed-file", required_argument, 0, 'S'},
+			{"cmd-gap", required_argument, 0, 'g'},
 			{"trace", no_argument, 0, 't'},
 			{"freq", required_argument, 0, 'f'},
 			{"no-user-code", no_argument, 0, 'n'},
+			{"delta", optional_argument, 0, 'D'},
+			{"start", no_argument, 0, 'G'},
+			{"loop", no_argument, 0, 'L'},
+			{"log", required_argument, 0, 'l'},
 			{"help", no_argument, 0, 'h'},
 			{"version", no_argument, 0, 'v'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "p:c:d:b:tf:nhv", long_options, &option_index);
+		c = getopt_long(argc, argv, "p:c:d:b:B:aS:g:tf:nD::GLl:hv", long_options, &option_index);
 
 		/* no more options to parse */
 		if (c == -1) break;
@@ -139,13 +184,38 @@ int main(int argc, char** argv)
 
 			/* d, device */
 			case 'd':
-				isp_serial_device = strdup(optarg);
+				devices = realloc(devices, ((nb_devices + 1) * sizeof(char*)));
+				if (devices == NULL) {
+					printf("Unable to allocate devices list.\n");
+					return -1;
+				}
+				devices[nb_devices++] = strdup(optarg);
 				break;
 
 			/* b, baudrate */
 			case 'b':
 				baudrate = atoi(optarg);
-				/* FIXME: validate baudrate */
+				/* Validated by isp_transport_open() */
+				break;
+
+			/* B, transfer-baudrate */
+			case 'B':
+				transfer_baudrate = atoi(optarg);
+				break;
+
+			/* a, auto-baudrate */
+			case 'a':
+				auto_baudrate = 1;
+				break;
+
+			/* S, speed-file */
+			case 'S':
+				speed_file_name = strdup(optarg);
+				break;
+
+			/* g, cmd-gap */
+			case 'g':
+				cmd_gap_us = strtoul(optarg, NULL, 0);
 				break;
 
 			/* t, trace */
@@ -163,6 +233,32 @@ int main(int argc, char** argv)
 				calc_user_code = 0;
 				break;
 
+			/* D, delta */
+			case 'D':
+				flash_mode = FLASH_DELTA_READ;
+				if ((optarg != NULL) && (strcmp(optarg, "compare") == 0)) {
+					flash_mode = FLASH_DELTA_COMPARE;
+				} else if ((optarg != NULL) && (strcmp(optarg, "read") != 0)) {
+					printf("Unknown delta method \"%s\", use read or compare.\n", optarg);
+					return -1;
+				}
+				break;
+
+			/* G, start */
+			case 'G':
+				start_after = 1;
+				break;
+
+			/* L, loop */
+			case 'L':
+				station_mode = 1;
+				break;
+
+			/* l, log */
+			case 'l':
+				station_log_name = strdup(optarg);
+				break;
+
 			/* v, version */
 			case 'v':
 				printf("%s Version %s\n", PROG_NAME, VERSION);
@@ -193,25 +289,20 @@ int main(int argc, char** argv)
 			parts_file = fopen(parts_file_name, "r");
 		}
 		if (parts_file == NULL) {
-			printf("Unable to open default parts file to read LPC descriptions !\n");
-			printf("Tried : '%s' and '%s'\n", DEFAULT_PART_FILE_NAME_ETC, DEFAULT_PART_FILE_NAME_CURRENT);
-			return -1;
+			/* Use the internal parts table */
+			parts_file_name = NULL;
+		} else {
+			fclose(parts_file);
 		}
-		fclose(parts_file);
 	}
 
-	/* Open serial device */
-	if (isp_serial_device == NULL) {
+	if (nb_devices == 0) {
 		printf("No serial device given, exiting\n");
 		help(argv[0]);
 		return 0;
-	} else if (isp_serial_open(baudrate, isp_serial_device) != 0) {
-		printf("Serial open failed, unable to initiate serial communication with target.\n");
-		return -1;
 	}
 
 	if (trace_on) {
-		printf("Serial device : %s\n", isp_serial_device);
 		printf("Command : %s\n", command);
 	}
 
@@ -231,31 +322,392 @@ int main(int argc, char** argv)
 		}
 	}
 
+	/* Load the parts description file and the image once, before talking to the targets.
+	 * The internal parts table is used if the file can not be read. */
+	if (parts_file_name != NULL) {
+		parts_db = parts_file_open(parts_file_name);
+	}
+	if ((strncmp(command, "flash", 5) == 0) && (nb_cmd_args == 1)) {
+		if (flash_image_load(&image, cmd_args[0]) != 0) {
+			printf("Unable to load image from \"%s\".\n", cmd_args[0]);
+			return -1;
+		}
+	}
+
+	if (nb_devices > 1) {
+		ret = prog_gang();
+	} else if (station_mode) {
+		ret = prog_station(devices[0]);
+	} else {
+		ret = prog_session(devices[0]);
+	}
+
+	flash_image_free(&image);
+	parts_db_free(parts_db);
+	if (cmd_args != NULL) {
+		free(cmd_args);
+	}
+	return ((ret < 0) ? -1 : 0);
+}
+
+/* Handle the command on one target */
+static int prog_session(char* isp_serial_device)
+{
+	struct isp_transport* t = NULL;
+	int dev_id = 0;
+	int err = 0;
+
+	/* Open serial device */
+	t = isp_transport_open(isp_serial_device, baudrate);
+	if (t == NULL) {
+		printf("Serial open failed, unable to initiate serial communication with target.\n");
+		return -1;
+	}
+	t->trace = trace_on;
+
+	if (trace_on) {
+		printf("Serial device : %s\n", isp_serial_device);
+	}
+
 	/* First : sync with device */
-	dev_id = prog_connect_and_id(crystal_freq);
+	dev_id = prog_connect_and_id(t, crystal_freq);
 	if (dev_id < 0) {
 		printf("Unable to connect to target, consider hard reset of target or link\n");
+		err = -1;
+		goto out;
+	}
+	err = prog_target(t, isp_serial_device, dev_id);
+
+out:
+	isp_transport_close(t);
+	return err;
+}
+
+/* Handle the command on a connected target, whose part ID is "dev_id".
+ * The target is left at the session baudrate, or started if requested.
+ */
+static int prog_target(struct isp_transport* t, char* isp_serial_device, int dev_id)
+{
+	int transfer_rate = transfer_baudrate;
+	struct part_desc* part = NULL;
+	int err = 0;
+
+	/* Link settings and statistics are per target */
+	t->cmd_gap_us = cmd_gap_us;
+	t->min_baudrate = 0;
+	t->downgrades = 0;
+	t->resends = 0;
+	t->link_history = 0;
+
+	if (parts_db != NULL) {
+		part = find_part_in_file(parts_db, dev_id, parts_file_name);
+	}
+	if (part == NULL) {
+		part = find_part_internal_tab(dev_id);
+		if (part != NULL) {
+			printf("Part ID 0x%08x found in internal parts table\n", (unsigned int)part->part_id);
+		}
+	}
+	t->part = part;
+	if (part == NULL) {
+		printf("Unknown part number : 0x%08x.\n", dev_id);
 		return -1;
 	}
 
-	if (command != NULL)  {
-		int err = 0;
-		err = prog_handle_command(command, dev_id, nb_cmd_args, cmd_args);
-		if (err >= 0) {
-			if (trace_on) {
-				printf("Command \"%s\" handled OK.\n", command);
+	/* Use the part limits when not given on the command line */
+	if ((part->max_baudrate != 0) && ((transfer_rate == 0) || (transfer_rate > (int)part->max_baudrate))) {
+		if (transfer_rate != 0) {
+			printf("Transfer baudrate limited to %u bauds for this part.\n", part->max_baudrate);
+			transfer_rate = part->max_baudrate;
+		} else if (auto_baudrate) {
+			transfer_rate = part->max_baudrate;
+		}
+	}
+	if ((cmd_gap_us == 0) && (part->cmd_gap_us != 0)) {
+		t->cmd_gap_us = part->cmd_gap_us;
+	}
+
+	/* Find transfer baudrate, from previous runs or by testing the link */
+	if (auto_baudrate) {
+		int rate = 0;
+		if (speed_file_name != NULL) {
+			rate = speed_file_lookup(speed_file_name, isp_serial_device);
+		}
+		if (rate > 0) {
+			transfer_rate = rate;
+		} else {
+			rate = negotiate_baudrate(t, part, transfer_rate);
+			if (rate < 0) {
+				printf("Unable to connect to target, consider hard reset of target or link\n");
+				return -1;
+			}
+			transfer_rate = rate;
+			if (speed_file_name != NULL) {
+				speed_file_store(speed_file_name, isp_serial_device, rate);
+			}
+		}
+	}
+	/* Switch to transfer baudrate, staying at session baudrate if this fails */
+	if ((transfer_rate != 0) && (transfer_rate != (int)t->baudrate)) {
+		if (isp_send_cmd_set_baud_rate(t, transfer_rate, 1) != 0) {
+			printf("Unable to switch to %d bauds, staying at %d bauds.\n", transfer_rate, baudrate);
+		}
+	}
+	/* Slow down instead of failing when the link is not good enough, the session
+	 * baudrate is known to work */
+	if ((int)t->baudrate > baudrate) {
+		t->min_baudrate = baudrate;
+	}
+
+	err = prog_handle_command(t, command, part, nb_cmd_args, cmd_args);
+	if (err >= 0) {
+		if (trace_on) {
+			printf("Command \"%s\" handled OK.\n", command);
+		}
+	} else {
+		printf("Error handling command \"%s\" : %d\n", command, err);
+	}
+
+	/* Remember the link speed had to be lowered */
+	if (auto_baudrate && (speed_file_name != NULL) && (t->downgrades != 0)) {
+		speed_file_store(speed_file_name, isp_serial_device, t->baudrate);
+	}
+
+	/* Back to session baudrate, unless the target left ISP mode */
+	if (((int)t->baudrate != baudrate) && (strncmp(command, "go", 2) != 0)) {
+		isp_send_cmd_set_baud_rate(t, baudrate, 1);
+	}
+
+	/* Start the program if requested, and if not already done */
+	if ((err >= 0) && start_after && (strncmp(command, "go", 2) != 0)) {
+		err = start_prog(t, part);
+		if (err != 0) {
+			printf("Unable to start the program.\n");
+		}
+	}
+
+	return err;
+}
+
+
+/* Station mode.
+ * The serial line stays open and targets are handled one after the other : wait for
+ * a target in ISP mode, handle the command, log the result with the target UID, and
+ * wait for the target to be removed (or started) before waiting for the next one.
+ * Runs until interrupted (SIGINT or SIGTERM).
+ */
+#define STATION_POLL_MS  250
+
+/* Read by all the stations in gang mode, from their own thread */
+static atomic_int station_stop = 0;
+
+static void station_signal(int sig)
+{
+	int err = errno;
+
+	(void)sig;
+	station_stop = 1;
+	errno = err;
+}
+
+static void station_log(FILE* log, char* device, uint32_t* uid, int dev_id, int err, double duration)
+{
+	char date[32];
+	char uid_str[48];
+	time_t now = time(NULL);
+	struct tm now_tm;
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &now_tm));
+	if (uid != NULL) {
+		snprintf(uid_str, sizeof(uid_str), "%08x-%08x-%08x-%08x", uid[0], uid[1], uid[2], uid[3]);
+	} else {
+		snprintf(uid_str, sizeof(uid_str), "unknown");
+	}
+	printf("Target %s : %s (%.1fs)\n", uid_str, ((err < 0) ? "FAILED" : "OK"), duration);
+	if (log != NULL) {
+		fprintf(log, "%s %s %s 0x%08x %s %s %d %.1f\n", uid_str, date, device, dev_id, command,
+					((err < 0) ? "FAILED" : "OK"), err, duration);
+		fflush(log);
+	}
+}
+
+static int prog_station(char* isp_serial_device)
+{
+	struct isp_transport* t = NULL;
+	struct sigaction action;
+	FILE* log = NULL;
+	unsigned int nb_ok = 0, nb_failed = 0;
+	int ret = 0;
+
+	if (station_log_name != NULL) {
+		log = fopen(station_log_name, "a");
+		if (log == NULL) {
+			perror("Unable to open station log file");
+			return -1;
+		}
+	}
+	t = isp_transport_open(isp_serial_device, baudrate);
+	if (t == NULL) {
+		printf("Serial open failed, unable to initiate serial communication with target.\n");
+		if (log != NULL) {
+			fclose(log);
+		}
+		return -1;
+	}
+	t->trace = trace_on;
+
+	/* Stop between two targets. No SA_RESTART so that waits get interrupted. */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = station_signal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	while (!station_stop) {
+		struct timespec start, end;
+		uint32_t uid[4];
+		int has_uid = 0;
+		int dev_id = 0, err = 0;
+
+		/* Get back to the session baudrate if the previous target was lost at the
+		 * transfer baudrate */
+		if ((int)t->baudrate != baudrate) {
+			isp_transport_set_baud(t, baudrate);
+		}
+
+		/* Wait for a target in ISP mode. Stop if the serial line itself is lost. */
+		printf("Waiting for target ...\n");
+		do {
+			ret = isp_connect(t, crystal_freq, 1);
+			if ((ret < 0) && (ret > -4)) {
+				usleep(STATION_POLL_MS * 1000);
 			}
+		} while (!station_stop && (ret < 0) && (ret > -4));
+		if (station_stop) {
+			break;
+		}
+		if (ret < 0) {
+			printf("Serial line lost, stopping.\n");
+			nb_failed++;
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		dev_id = isp_cmd_part_id(t, 1);
+		if (dev_id < 0) {
+			printf("Unable to read target part ID.\n");
+			err = -1;
+		} else {
+			has_uid = (isp_read_uid(t, uid, 1) == 0);
+			err = prog_target(t, isp_serial_device, dev_id);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		station_log(log, isp_serial_device, (has_uid ? uid : NULL), dev_id, err,
+					((end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9)));
+		if (err < 0) {
+			nb_failed++;
 		} else {
-			printf("Error handling command \"%s\" : %d\n", command, err);
+			nb_ok++;
+		}
+
+		/* Started targets do not answer anymore, others stay in ISP mode until removed */
+		if ((err >= 0) && (start_after || (strncmp(command, "go", 2) == 0))) {
+			continue;
+		}
+		printf("Remove target.\n");
+		while (!station_stop) {
+			usleep(STATION_POLL_MS * 1000);
+			if (isp_cmd_part_id(t, 1) < 0) {
+				break;
+			}
 		}
 	}
 
+	printf("Station stopped : %u target(s) OK, %u failed.\n", nb_ok, nb_failed);
+	isp_transport_close(t);
+	if (log != NULL) {
+		fclose(log);
+	}
+	return ((nb_failed != 0) ? -1 : 0);
+}
 
-	if (cmd_args != NULL) {
-		free(cmd_args);
+
+/* Gang mode.
+ * Each target is handled by its own thread, with its own session. The image and the
+ * parts description file are loaded once, and shared by all the targets.
+ */
+struct gang_target {
+	char* device;
+	pthread_t thread;
+	int started;
+	int ret;
+	struct timespec start;
+	struct timespec end;
+};
+
+static void* gang_thread(void* arg)
+{
+	struct gang_target* target = arg;
+
+	if (station_mode) {
+		target->ret = prog_station(target->device);
+	} else {
+		target->ret = prog_session(target->device);
 	}
-	isp_serial_close();
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &target->end);
+	return NULL;
+}
+
+static int prog_gang(void)
+{
+	struct gang_target* targets = NULL;
+	int failed = 0;
+	int i = 0;
+
+	targets = calloc(nb_devices, sizeof(struct gang_target));
+	if (targets == NULL) {
+		printf("Unable to allocate gang mode targets.\n");
+		return -1;
+	}
+	/* Keep the lines from different targets apart */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	for (i = 0; i < nb_devices; i++) {
+		targets[i].device = devices[i];
+		clock_gettime(CLOCK_MONOTONIC, &targets[i].start);
+		if (pthread_create(&targets[i].thread, NULL, gang_thread, &targets[i]) != 0) {
+			printf("Unable to start gang mode thread for %s.\n", devices[i]);
+			continue;
+		}
+		targets[i].started = 1;
+	}
+	for (i = 0; i < nb_devices; i++) {
+		if (targets[i].started) {
+			pthread_join(targets[i].thread, NULL);
+		}
+	}
+
+	/* Summary */
+	printf("Gang summary :\n");
+	for (i = 0; i < nb_devices; i++) {
+		struct gang_target* target = &targets[i];
+		double duration = (target->end.tv_sec - target->start.tv_sec) +
+							((target->end.tv_nsec - target->start.tv_nsec) / 1e9);
+		if (!target->started) {
+			failed++;
+			printf("  %s : FAILED (not started)\n", target->device);
+		} else if (target->ret < 0) {
+			failed++;
+			printf("  %s : FAILED (%.1fs)\n", target->device, duration);
+		} else {
+			printf("  %s : OK (%.1fs)\n", target->device, duration);
+		}
+	}
+	printf("%d of %d targets OK.\n", (nb_devices - failed), nb_devices);
+
+	free(targets);
+	return ((failed != 0) ? -1 : 0);
 }
 
 struct prog_command {
@@ -276,40 +728,33 @@ static struct prog_command prog_cmds_list[] = {
  * Try to connect to the target and identify the device.
  * First try sync, and if it fails, try to read id twice. if both fail, then we are not connected
  */
-static int prog_connect_and_id(int freq)
+static int prog_connect_and_id(struct isp_transport* t, int freq)
 {
 	int sync_ret = 0;
 
 	/* Try to connect */
-	sync_ret = isp_connect(freq, 1);
+	sync_ret = isp_connect(t, freq, 1);
 	/* Synchro failed or already synchronised ? */
 	if (sync_ret < 0) {
 		/* If already synchronized, then sync command and the next command fail.
 		   Sync failed, maybe we are already sync'ed, then send one command for nothing */
-		isp_cmd_part_id(1);
+		isp_cmd_part_id(t, 1);
 	}
 
-	return isp_cmd_part_id(1);
+	return isp_cmd_part_id(t, 1);
 }
 
-static int prog_handle_command(char* cmd, int dev_id, int arg_count, char** args)
+static int prog_handle_command(struct isp_transport* t, char* cmd, struct part_desc* part, int arg_count, char** args)
 {
 	int cmd_found = -1;
 	int ret = 0;
 	int index = 0;
-	struct part_desc* part = NULL;
 
 	if (cmd == NULL) {
 		printf("prog_handle_command called with no command !\n");
 		return -1;
 	}
 
-	part = find_part_in_file(dev_id, parts_file_name);
-	if (part == NULL) {
-		printf("Unknown part number : 0x%08x.\n", dev_id);
-		return -2;
-	}
-
 	while ((cmd_found == -1) && (prog_cmds_list[index].name != NULL)) {
 		if (strncmp(prog_cmds_list[index].name, cmd, strlen(prog_cmds_list[index].name)) == 0) {
 			cmd_found = index;
@@ -328,7 +773,7 @@ static int prog_handle_command(char* cmd, int dev_id, int arg_count, char** args
 				printf("command dump needs one arg (filename), got %d.\n", arg_count);
 				return -4;
 			}
-			ret = dump_to_file(part, args[0]);
+			ret = dump_to_file(t, part, args[0]);
 			break;
 
 		case 1: /* flash, need one arg : filename */
@@ -336,22 +781,109 @@ static int prog_handle_command(char* cmd, int dev_id, int arg_count, char** args
 				printf("command flash needs one arg (filename), got %d.\n", arg_count);
 				return -4;
 			}
-			ret = flash_target(part, args[0], calc_user_code);
+			ret = flash_target(t, part, &image, calc_user_code, flash_mode);
 			break;
 
 		case 2: /* id : no args */
-			ret = get_ids();
+			ret = get_ids(t);
 			break;
 
 		case 3: /* blank : no args */
-			ret = erase_flash(part);
+			ret = erase_flash(t, part);
 			break;
 
 		case 4: /* go : no args */
-			ret = start_prog(part);
+			ret = start_prog(t, part);
 			break;
 	}
 
 	return ret;
 }
 
+
+/* Speed file : one "device baudrate" line per serial device */
+#define SPEED_LINE_SIZE  512
+
+static int speed_file_lookup(char* file_name, char* device)
+{
+	FILE* speed_file = NULL;
+	char line[SPEED_LINE_SIZE];
+	int rate = 0;
+
+	speed_file = fopen(file_name, "r");
+	if (speed_file == NULL) {
+		return 0;
+	}
+	while (fgets(line, SPEED_LINE_SIZE, speed_file) != NULL) {
+		char* sep = strrchr(line, ' ');
+		if ((sep == NULL) || ((sep - line) != (int)strlen(device))) {
+			continue;
+		}
+		if (strncmp(line, device, (sep - line)) == 0) {
+			rate = atoi(sep + 1);
+		}
+	}
+	fclose(speed_file);
+	if (trace_on && (rate > 0)) {
+		printf("Using %d bauds for %s from %s\n", rate, device, file_name);
+	}
+	return rate;
+}
+
+static int speed_file_store(char* file_name, char* device, unsigned int baudrate)
+{
+	FILE* speed_file = NULL;
+	FILE* new_file = NULL;
+	char line[SPEED_LINE_SIZE];
+	char new_name[SPEED_LINE_SIZE];
+
+	int lock_fd = -1;
+	int ret = 0;
+
+	/* Targets handled in gang mode may update the file at the same time */
+	snprintf(new_name, SPEED_LINE_SIZE, "%s.lock", file_name);
+	lock_fd = open(new_name, (O_WRONLY | O_CREAT), 0644);
+	if ((lock_fd < 0) || (flock(lock_fd, LOCK_EX) != 0)) {
+		perror("Unable to lock speed file");
+		if (lock_fd >= 0) {
+			close(lock_fd);
+		}
+		return -1;
+	}
+
+	snprintf(new_name, SPEED_LINE_SIZE, "%s.new", file_name);
+	new_file = fopen(new_name, "w");
+	if (new_file == NULL) {
+		perror("Unable to update speed file");
+		ret = -1;
+		goto out;
+	}
+	/* Copy the other devices entries */
+	speed_file = fopen(file_name, "r");
+	if (speed_file != NULL) {
+		while (fgets(line, SPEED_LINE_SIZE, speed_file) != NULL) {
+			char* sep = strrchr(line, ' ');
+			if ((sep != NULL) && ((sep - line) == (int)strlen(device)) &&
+					(strncmp(line, device, (sep - line)) == 0)) {
+				continue;
+			}
+			fputs(line, new_file);
+		}
+		fclose(speed_file);
+	}
+	fprintf(new_file, "%s %u\n", device, baudrate);
+	if (fclose(new_file) != 0) {
+		perror("Unable to write speed file");
+		ret = -2;
+		goto out;
+	}
+	if (rename(new_name, file_name) != 0) {
+		perror("Unable to replace speed file");
+		ret = -3;
+		goto out;
+	}
+
+out:
+	close(lock_fd);
+	return ret;
+}
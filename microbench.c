@@ -0,0 +1,353 @@
+/*********************************************************************
+ *
+ *   LPC ISP - Micro benchmarks
+ *
+ * Time the CPU bound parts of the ISP tools on the host : the uuencode kernels, and
+ * the host side hot paths on ISP sized payloads (45 bytes lines, 900 bytes blocks and
+ * 512KB images), with percentiles of the time per call.
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+#include <stdlib.h> /* malloc, free, rand, qsort */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h> /* memcmp */
+#include <time.h> /* clock_gettime */
+#include <unistd.h> /* dup, dup2, close */
+#include <fcntl.h>
+
+#include "isp_uu.h"
+#include "isp_utils.h"
+#include "isp_transport.h"
+#include "isp_commands.h"
+
+#define PROG_NAME "LPC ISP micro benchmarks"
+
+/* ISP data block, and big buffer to see memory bandwidth effects */
+#define BLOCK_SIZE  900
+#define BIG_SIZE  (4 * 1024 * 1024)
+/* Worst case encoded size : 63 characters for 45 bytes */
+#define ENCODED_SIZE(size)  ((((size) + 44) / 45) * 63)
+
+/* Bytes processed for each measure */
+#define BYTES_PER_RUN  (16 * 1024 * 1024)
+#define RUNS  7
+
+/* Host hot paths : calls are batched so that each sample lasts at least SAMPLE_MIN_S,
+ * and sampling stops after CASE_MAX_S for slow cases */
+#define LINE_SIZE  45
+#define IMAGE_SIZE  (512 * 1024)
+#define WARMUP_SAMPLES  5
+#define MIN_SAMPLES  11
+#define MAX_SAMPLES  201
+#define SAMPLE_MIN_S  50e-6
+#define CASE_MAX_S  1.0
+
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/* Run "fn" on "size" bytes until BYTES_PER_RUN bytes are processed, RUNS times after a
+ * warm-up run, and return the median throughput in MB/s. */
+static double measure(isp_uu_fn fn, char* dest, char* src, unsigned int size)
+{
+	double rates[RUNS];
+	unsigned int loops = (BYTES_PER_RUN / size) + 1;
+	int run = 0, i = 0, j = 0;
+
+	for (run = -1; run < RUNS; run++) {
+		uint32_t sum = 0;
+		double start = now_s();
+		unsigned int l = 0;
+		for (l = 0; l < loops; l++) {
+			fn(dest, src, size, &sum);
+		}
+		if (run >= 0) {
+			rates[run] = ((double)loops * size) / ((now_s() - start) * 1e6);
+		}
+	}
+	/* Sort for median */
+	for (i = 0; i < RUNS; i++) {
+		for (j = i + 1; j < RUNS; j++) {
+			if (rates[j] < rates[i]) {
+				double tmp = rates[i];
+				rates[i] = rates[j];
+				rates[j] = tmp;
+			}
+		}
+	}
+	return rates[RUNS / 2];
+}
+
+/* Check a kernel against the reference one on all sizes up to a few lines */
+static int check_kernel(struct isp_uu_kernel* kernel, struct isp_uu_kernel* ref, char* data)
+{
+	static char enc_ref[ENCODED_SIZE(BLOCK_SIZE)], enc[ENCODED_SIZE(BLOCK_SIZE)];
+	static char dec[BLOCK_SIZE];
+	unsigned int size = 0;
+
+	for (size = 1; size <= BLOCK_SIZE; size++) {
+		uint32_t sum_ref = 0, sum = 0, sum_dec = 0;
+		unsigned int len_ref = ref->encode(enc_ref, data, size, &sum_ref);
+		unsigned int len = kernel->encode(enc, data, size, &sum);
+		if ((len != len_ref) || (memcmp(enc, enc_ref, len) != 0) || (sum != sum_ref)) {
+			printf("%s: encoding error for %u bytes\n", kernel->name, size);
+			return -1;
+		}
+		len = kernel->decode(dec, enc_ref, len_ref, &sum_dec);
+		if ((len != size) || (memcmp(dec, data, size) != 0) || (sum_dec != sum_ref)) {
+			printf("%s: decoding error for %u bytes\n", kernel->name, size);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* ---- Host hot paths ---------------------------------------------------------------*/
+
+static char* hot_data = NULL;
+static char* hot_encoded = NULL;
+static char* hot_work = NULL;
+static struct isp_transport* hot_loop = NULL;
+static volatile uint32_t hot_sink; /* Results are stored so that calls are not optimized out */
+
+/* Exact uuencoded size, ISP lines being ended by "\r\n" */
+static unsigned int uu_size(unsigned int size)
+{
+	unsigned int rest = (size % LINE_SIZE);
+	unsigned int len = ((size / LINE_SIZE) * 63);
+
+	if (rest != 0) {
+		len += 1 + (((rest + 2) / 3) * 4) + 2;
+	}
+	return len;
+}
+
+static void hot_uu_encode(unsigned int size)
+{
+	isp_uu_encode(hot_work, hot_data, size);
+}
+
+static void hot_uu_decode(unsigned int size)
+{
+	isp_uu_decode(hot_work, hot_encoded, uu_size(size));
+}
+
+static void hot_checksum(unsigned int size)
+{
+	hot_sink = isp_checksum(hot_data, size);
+}
+
+static void hot_dump(unsigned int size)
+{
+	isp_dump((unsigned char*)hot_data, size);
+}
+
+static void hot_ret_code(unsigned int size)
+{
+	static char reply[] = "0\r\n";
+	(void)size;
+	hot_sink = isp_ret_code(hot_loop, reply, NULL, 1);
+}
+
+/* Return code line as received : through the transport ring buffer, then parsed */
+static void hot_reply_line(unsigned int size)
+{
+	static char reply[] = "0\r\n";
+	char buf[16];
+
+	isp_transport_loop_push(hot_loop, reply, size);
+	isp_serial_readline(hot_loop, buf, sizeof(buf), 0);
+	hot_sink = isp_ret_code(hot_loop, buf, NULL, 1);
+}
+
+struct hot_case {
+	char* name;
+	unsigned int size;
+	void (*run)(unsigned int size);
+	int quiet; /* Output sent to /dev/null while measuring */
+};
+
+static struct hot_case hot_cases[] = {
+	{ "uu encode", LINE_SIZE, hot_uu_encode, 0 },
+	{ "uu encode", BLOCK_SIZE, hot_uu_encode, 0 },
+	{ "uu encode", IMAGE_SIZE, hot_uu_encode, 0 },
+	{ "uu decode", LINE_SIZE, hot_uu_decode, 0 },
+	{ "uu decode", BLOCK_SIZE, hot_uu_decode, 0 },
+	{ "uu decode", IMAGE_SIZE, hot_uu_decode, 0 },
+	{ "checksum", LINE_SIZE, hot_checksum, 0 },
+	{ "checksum", BLOCK_SIZE, hot_checksum, 0 },
+	{ "checksum", IMAGE_SIZE, hot_checksum, 0 },
+	{ "isp_dump", LINE_SIZE, hot_dump, 1 },
+	{ "isp_dump", BLOCK_SIZE, hot_dump, 1 },
+	{ "isp_dump", IMAGE_SIZE, hot_dump, 1 },
+	{ "ret code", 1, hot_ret_code, 0 },
+	{ "reply line", 3, hot_reply_line, 0 },
+	{ NULL, 0, NULL, 0 },
+};
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return ((x > y) - (x < y));
+}
+
+static double hot_sample(struct hot_case* c, unsigned int batch)
+{
+	double start = now_s();
+	unsigned int i = 0;
+
+	for (i = 0; i < batch; i++) {
+		c->run(c->size);
+	}
+	return (now_s() - start);
+}
+
+/* Time per call, in micro-seconds, at percentile "p" of the sorted samples */
+static double percentile(double* samples, unsigned int nb, unsigned int p)
+{
+	return samples[((nb - 1) * p + 50) / 100] * 1e6;
+}
+
+static void hot_measure(struct hot_case* c)
+{
+	double samples[MAX_SAMPLES];
+	double time = 0;
+	unsigned int batch = 1, nb = 0, i = 0;
+	int saved_stdout = -1, fd = -1;
+
+	if (c->quiet) {
+		fflush(stdout);
+		saved_stdout = dup(STDOUT_FILENO);
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+	/* Find the batch size, this is part of the warm-up */
+	while ((time = hot_sample(c, batch)) < SAMPLE_MIN_S) {
+		batch *= 2;
+	}
+	for (i = 0; i < WARMUP_SAMPLES; i++) {
+		hot_sample(c, batch);
+	}
+	nb = (unsigned int)(CASE_MAX_S / time);
+	if (nb < MIN_SAMPLES) {
+		nb = MIN_SAMPLES;
+	} else if (nb > MAX_SAMPLES) {
+		nb = MAX_SAMPLES;
+	}
+	for (i = 0; i < nb; i++) {
+		samples[i] = hot_sample(c, batch) / batch;
+	}
+	if (c->quiet) {
+		fflush(stdout);
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(saved_stdout);
+	}
+
+	qsort(samples, nb, sizeof(double), cmp_double);
+	printf("%-10s %7u %10.3f %10.3f %10.3f %10.3f %9.1f %5u x %u\n", c->name, c->size,
+			(samples[0] * 1e6), percentile(samples, nb, 50), percentile(samples, nb, 90),
+			percentile(samples, nb, 99), (c->size / percentile(samples, nb, 50)), nb, batch);
+}
+
+static int hot_paths(char* data)
+{
+	int i = 0;
+
+	hot_data = data;
+	hot_encoded = malloc(uu_size(IMAGE_SIZE));
+	hot_work = malloc(uu_size(IMAGE_SIZE));
+	hot_loop = isp_transport_open("loop:", 115200);
+	if ((hot_encoded == NULL) || (hot_work == NULL) || (hot_loop == NULL)) {
+		printf("Unable to allocate hot paths benchmark buffers.\n");
+		return -1;
+	}
+	isp_uu_encode(hot_encoded, hot_data, IMAGE_SIZE);
+
+	printf("\n%-10s %7s %10s %10s %10s %10s %9s %s\n", "hot path", "bytes", "min (us)",
+			"p50 (us)", "p90 (us)", "p99 (us)", "p50 MB/s", "samples x calls");
+	for (i = 0; hot_cases[i].name != NULL; i++) {
+		hot_measure(&hot_cases[i]);
+	}
+	printf("Times are per call, each sample timing a batch of calls, after warm-up.\n");
+
+	isp_transport_close(hot_loop);
+	free(hot_encoded);
+	free(hot_work);
+	return 0;
+}
+
+int main(void)
+{
+	struct isp_uu_kernel* ref = NULL;
+	char* data = malloc(BIG_SIZE);
+	char* encoded = malloc(ENCODED_SIZE(BIG_SIZE));
+	char* decoded = malloc(BIG_SIZE);
+	unsigned int encoded_size = 0;
+	int i = 0, ret = 0;
+
+	if ((data == NULL) || (encoded == NULL) || (decoded == NULL)) {
+		printf("Unable to allocate benchmark buffers.\n");
+		return -1;
+	}
+	srand(1);
+	for (i = 0; i < BIG_SIZE; i++) {
+		data[i] = rand();
+	}
+	for (i = 0; isp_uu_kernels[i].name != NULL; i++) {
+		ref = &isp_uu_kernels[i]; /* Last one is the reference */
+	}
+	encoded_size = ref->encode(encoded, data, BIG_SIZE, NULL);
+
+	printf("---------------- "PROG_NAME" --------------------\n");
+	printf("%-8s %14s %14s %14s %14s\n", "uu", "enc 900B", "dec 900B", "enc 4MB", "dec 4MB");
+	for (i = 0; isp_uu_kernels[i].name != NULL; i++) {
+		struct isp_uu_kernel* k = &isp_uu_kernels[i];
+		unsigned int block_enc = ENCODED_SIZE(BLOCK_SIZE);
+
+		if (!isp_uu_kernel_supported(k)) {
+			printf("%-8s not supported by this CPU\n", k->name);
+			continue;
+		}
+		if (check_kernel(k, ref, data) != 0) {
+			ret = -1;
+			continue;
+		}
+		printf("%-8s %9.1f MB/s %9.1f MB/s %9.1f MB/s %9.1f MB/s\n", k->name,
+				measure(k->encode, encoded, data, BLOCK_SIZE),
+				measure(k->decode, decoded, encoded, block_enc),
+				measure(k->encode, encoded, data, BIG_SIZE),
+				measure(k->decode, decoded, encoded, encoded_size));
+	}
+	printf("Throughput is given for the input of each operation.\n");
+
+	if (hot_paths(data) != 0) {
+		ret = -1;
+	}
+
+	free(data);
+	free(encoded);
+	free(decoded);
+	return ret;
+}
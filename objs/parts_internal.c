@@ -0,0 +1,164 @@
+/* Internal parts table, generated from lpctools_parts.def by parts_gen. Do not edit. */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "parts.h"
+
+static uint32_t sector_sizes_6[] = {
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x8000, 0x8000
+};
+
+static struct part_desc internal_parts[] = {
+	{
+		.part_id = 0x00008100,
+		.name = "LPC810M021FN8",
+		.sector_sizes = NULL,
+		.flash_base = 0x00000000,
+		.flash_size = 0x1000,
+		.flash_nb_sectors = 4,
+		.reset_vector_offset = 0x4,
+		.ram_base = 0x10000000,
+		.ram_size = 0x400,
+		.ram_buff_offset = 0x300,
+		.ram_buff_size = 0x100,
+		.uuencode = 0,
+		.max_baudrate = 115200,
+		.ram_window = 0x0,
+		.cmd_gap_us = 0,
+		.copy_sizes = 0x7c0,
+		.isp_cmds = 0x0,
+	},
+	{
+		.part_id = 0x00008122,
+		.name = "LPC812M101JDH20",
+		.sector_sizes = NULL,
+		.flash_base = 0x00000000,
+		.flash_size = 0x4000,
+		.flash_nb_sectors = 16,
+		.reset_vector_offset = 0x4,
+		.ram_base = 0x10000000,
+		.ram_size = 0x1000,
+		.ram_buff_offset = 0x800,
+		.ram_buff_size = 0x400,
+		.uuencode = 0,
+		.max_baudrate = 115200,
+		.ram_window = 0x0,
+		.cmd_gap_us = 0,
+		.copy_sizes = 0x7c0,
+		.isp_cmds = 0x0,
+	},
+	{
+		.part_id = 0x2540102b,
+		.name = "LPC1114FHN33/302",
+		.sector_sizes = NULL,
+		.flash_base = 0x00000000,
+		.flash_size = 0x8000,
+		.flash_nb_sectors = 8,
+		.reset_vector_offset = 0x4,
+		.ram_base = 0x10000000,
+		.ram_size = 0x2000,
+		.ram_buff_offset = 0x800,
+		.ram_buff_size = 0x400,
+		.uuencode = 1,
+		.max_baudrate = 115200,
+		.ram_window = 0x1400,
+		.cmd_gap_us = 0,
+		.copy_sizes = 0x1700,
+		.isp_cmds = 0x0,
+	},
+	{
+		.part_id = 0x4d80002b,
+		.name = "LPC11A04UK",
+		.sector_sizes = NULL,
+		.flash_base = 0x00000000,
+		.flash_size = 0x8000,
+		.flash_nb_sectors = 8,
+		.reset_vector_offset = 0x4,
+		.ram_base = 0x10000000,
+		.ram_size = 0x2000,
+		.ram_buff_offset = 0x800,
+		.ram_buff_size = 0x400,
+		.uuencode = 1,
+		.max_baudrate = 115200,
+		.ram_window = 0x1400,
+		.cmd_gap_us = 0,
+		.copy_sizes = 0x1700,
+		.isp_cmds = 0x0,
+	},
+	{
+		.part_id = 0x3640c02b,
+		.name = "LPC1224FBD48/101",
+		.sector_sizes = NULL,
+		.flash_base = 0x00000000,
+		.flash_size = 0x8000,
+		.flash_nb_sectors = 8,
+		.reset_vector_offset = 0x4,
+		.ram_base = 0x10000000,
+		.ram_size = 0x1000,
+		.ram_buff_offset = 0x800,
+		.ram_buff_size = 0x400,
+		.uuencode = 1,
+		.max_baudrate = 115200,
+		.ram_window = 0x0,
+		.cmd_gap_us = 0,
+		.copy_sizes = 0x1700,
+		.isp_cmds = 0x0,
+	},
+	{
+		.part_id = 0x3642c02b,
+		.name = "LPC1224FBD48/121",
+		.sector_sizes = NULL,
+		.flash_base = 0x00000000,
+		.flash_size = 0x8000,
+		.flash_nb_sectors = 8,
+		.reset_vector_offset = 0x4,
+		.ram_base = 0x10000000,
+		.ram_size = 0x1000,
+		.ram_buff_offset = 0x800,
+		.ram_buff_size = 0x400,
+		.uuencode = 1,
+		.max_baudrate = 115200,
+		.ram_window = 0x0,
+		.cmd_gap_us = 0,
+		.copy_sizes = 0x1700,
+		.isp_cmds = 0x0,
+	},
+	{
+		.part_id = 0x26011922,
+		.name = "LPC1764FBD100",
+		.sector_sizes = sector_sizes_6,
+		.flash_base = 0x00000000,
+		.flash_size = 0x20000,
+		.flash_nb_sectors = 18,
+		.reset_vector_offset = 0x4,
+		.ram_base = 0x10000000,
+		.ram_size = 0x4000,
+		.ram_buff_offset = 0x800,
+		.ram_buff_size = 0x1000,
+		.uuencode = 1,
+		.max_baudrate = 230400,
+		.ram_window = 0x3000,
+		.cmd_gap_us = 0,
+		.copy_sizes = 0x1700,
+		.isp_cmds = 0x0,
+	},
+};
+
+static unsigned int internal_index[] = {
+	2, 3, 5, 7, 0, 0, 0, 0, 0, 0, 4, 0, 0, 0, 6, 1
+};
+
+static struct parts_db internal_db = {
+	.parts = internal_parts,
+	.nb_parts = 7,
+	.index = internal_index,
+	.index_bits = 4,
+};
+
+struct part_desc* find_part_internal_tab(uint64_t dev_id)
+{
+	return parts_db_find(&internal_db, dev_id);
+}
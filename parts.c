@@ -21,96 +21,548 @@
  *********************************************************************/
 
 #include <stdint.h> /* uint64_t and uint32_t */
-#include <stdlib.h> /* NULL */
+#include <stdlib.h> /* NULL, getenv, realpath */
 #include <stddef.h> /* For offsetof */
 #include <stdio.h>  /* perror(), fopen(), fclose() */
+#include <string.h> /* strncmp, strcmp, strdup */
 #include <errno.h>
+#include <sys/mman.h> /* munmap */
+#include <sys/stat.h> /* stat, mkdir */
+#include <pthread.h>
 
 #include "parts.h"
+#include "parts_cache.h"
 
 #define CONF_READ_BUF_SIZE 250
 
-/* When looking for parts description in a file ee do allocate (malloc) two memory
- *   chunks which we will never free.
- * The user should free part_desc->name and part_desc when they are no more useful
+/* Parse a sector map : runs of "count*size" separated by '+', for example
+ *   "16*0x1000+2*0x8000" for 16 sectors of 4KB followed by 2 sectors of 32KB.
+ * The map must describe exactly part->flash_nb_sectors sectors and part->flash_size bytes.
+ * "endp" is set to the first character after the map.
  */
-struct part_desc* find_part_in_file(uint64_t dev_id, char* parts_file_name)
+static int parse_sector_map(struct part_desc* part, char* map, char** endp, unsigned int line)
 {
-	FILE* parts_file = NULL;
-	unsigned int i = 0;
-	unsigned int line = 0; /* Store current line number when reading file */
-	struct part_desc* part = malloc(sizeof(struct part_desc));
+	uint32_t* sizes = NULL;
+	uint32_t total = 0;
+	unsigned int nb = 0;
 
-	parts_file = fopen(parts_file_name, "r");
-	if (parts_file == NULL) {
-		perror("Unable to open file to read LPC descriptions !");
-		return NULL;
+	sizes = malloc(part->flash_nb_sectors * sizeof(uint32_t));
+	if (sizes == NULL) {
+		printf("Unable to allocate sector map.\n");
+		return -1;
+	}
+	while (1) {
+		unsigned long int count = 1, size = 0;
+		size = strtoul(map, endp, 0);
+		if (**endp == '*') {
+			count = size;
+			size = strtoul((*endp + 1), endp, 0);
+		}
+		if ((count == 0) || (size == 0) || ((nb + count) > part->flash_nb_sectors)) {
+			printf("Malformed parts description file at line %d, invalid sector map.\n", line);
+			goto out_err;
+		}
+		while (count-- > 0) {
+			sizes[nb++] = size;
+			total += size;
+		}
+		if (**endp != '+') {
+			break;
+		}
+		map = *endp + 1;
+	}
+	if ((nb != part->flash_nb_sectors) || (total != part->flash_size)) {
+		printf("Malformed parts description file at line %d, sector map has %d sectors for %d bytes,"
+				" should be %d sectors for %d bytes.\n", line, nb, total, part->flash_nb_sectors, part->flash_size);
+		goto out_err;
+	}
+	part->sector_sizes = sizes;
+	return 0;
+
+out_err:
+	free(sizes);
+	return -1;
+}
+
+/* Parse a list of values separated by '+' into a bit mask.
+ * With "names", values are names and bit n is set for names[n], otherwise values are
+ * powers of two and bit n is set for 2^n.
+ */
+static int parse_bit_list(char* value, char** endp, const char** names, uint32_t* mask, unsigned int line)
+{
+	*mask = 0;
+	while (1) {
+		unsigned int n = 0;
+		if (names != NULL) {
+			unsigned int len = 0;
+			while ((value[len] != '+') && (value[len] != ',') && (value[len] != '\0') &&
+					(value[len] != '\n') && (value[len] != '\r') && (value[len] != ' ') && (value[len] != '\t')) {
+				len++;
+			}
+			for (n = 0; names[n] != NULL; n++) {
+				if ((strlen(names[n]) == len) && (strncmp(value, names[n], len) == 0)) {
+					break;
+				}
+			}
+			if (names[n] == NULL) {
+				printf("Malformed parts description file at line %d, unknown value \"%.*s\".\n", line, len, value);
+				return -1;
+			}
+			*endp = value + len;
+		} else {
+			unsigned long int size = strtoul(value, endp, 0);
+			while ((n < 31) && ((1UL << n) < size)) {
+				n++;
+			}
+			if ((size == 0) || ((1UL << n) != size)) {
+				printf("Malformed parts description file at line %d, %lu is not a power of two.\n", line, size);
+				return -1;
+			}
+		}
+		*mask |= (1 << n);
+		if (**endp != '+') {
+			break;
+		}
+		value = *endp + 1;
 	}
+	return 0;
+}
+
+static const char* isp_cmd_names[] = { "crc", NULL, };
 
+/* Parse the optionnal "key=value" fields found after the values of a part description */
+static int parse_part_options(struct part_desc* part, char* endp, unsigned int line)
+{
 	while (1) {
-		char buf[CONF_READ_BUF_SIZE];
-		char* endp = NULL;
-		uint32_t* part_values = NULL;
-		unsigned int nval = 0;
+		char* key = NULL;
+		unsigned int key_len = 0;
 
-		if (fgets(buf, CONF_READ_BUF_SIZE, parts_file) == NULL) {
-			printf("Part not found before end of parts description file.\n");
-			goto out_err_1;
+		/* Skip separators */
+		while ((*endp == ',') || (*endp == ' ') || (*endp == '\t')) {
+			endp++;
 		}
-		line++; /* Store current line number to help parts description file correction */
-		if (buf[0] == '#' || buf[0] == '\n') {
-			/* skip comments */
-			continue;
-		}
-		part->part_id = strtoul(buf, &endp, 0);
-		if (part->part_id != dev_id) {
-			continue;
-		}
-		printf("Part ID 0x%08x found on line %d\n", (unsigned int)part->part_id, line);
-		/* We found the right part ID, get all the data */
-		part->name = malloc(PART_NAME_LENGTH);
-		/* Part names must start with "LPC" */
-		while ((*endp != '\0') && (*endp != 'L')) {
+		if ((*endp == '\0') || (*endp == '\n') || (*endp == '\r') || (*endp == '#')) {
+			break;
+		}
+		key = endp;
+		while ((*endp != '=') && (*endp != '\0') && (*endp != '\n') && (*endp != ',')) {
 			endp++;
 		}
-		/* Copy part name */
-		for (i = 0; i < PART_NAME_LENGTH; i++) {
-			if (endp[i] == '\0') {
-				/* Hey, we need the part description after the name */
-				printf("Malformed parts description file at line %d, nothing after part name.\n", line);
-				goto out_err_2;
+		key_len = endp - key;
+		if (*endp != '=') {
+			printf("Malformed parts description file at line %d, expecting \"key=value\".\n", line);
+			return -1;
+		}
+		endp++;
+		if ((key_len == 7) && (strncmp(key, "sectors", 7) == 0)) {
+			if (parse_sector_map(part, endp, &endp, line) != 0) {
+				return -1;
 			}
-	 		if (endp[i] == ',') {
-				break;
+		} else if ((key_len == 8) && (strncmp(key, "max_baud", 8) == 0)) {
+			part->max_baudrate = strtoul(endp, &endp, 0);
+		} else if ((key_len == 10) && (strncmp(key, "ram_window", 10) == 0)) {
+			part->ram_window = strtoul(endp, &endp, 0);
+		} else if ((key_len == 7) && (strncmp(key, "cmd_gap", 7) == 0)) {
+			part->cmd_gap_us = strtoul(endp, &endp, 0);
+		} else if ((key_len == 10) && (strncmp(key, "copy_sizes", 10) == 0)) {
+			if (parse_bit_list(endp, &endp, NULL, &(part->copy_sizes), line) != 0) {
+				return -1;
 			}
-			part->name[i] = endp[i];
-		}
-		if ((i == PART_NAME_LENGTH) && (endp[i] != ',')) {
-			printf("Malformed parts description file at line %d, part name too long.\n", line);
-				goto out_err_2;
-		}
-		endp += i;
-		/* Get all the values */
-		nval = ((sizeof(struct part_desc) - offsetof(struct part_desc, flash_base)) / sizeof(uint32_t));
-		part_values = &(part->flash_base); /* Use a table to read the data, we do not care of what the data is */
-		for (i = 0; i < nval; i++) {
-			errno = 0;
-			part_values[i] = strtoul((endp + 1), &endp, 0);
-			if ((part_values[i] == 0) && (errno == EINVAL)) {
-				printf("Malformed parts description file at line %d, error reading value %d\n", line, i);
-				goto out_err_2;
+		} else if ((key_len == 8) && (strncmp(key, "commands", 8) == 0)) {
+			if (parse_bit_list(endp, &endp, isp_cmd_names, &(part->isp_cmds), line) != 0) {
+				return -1;
+			}
+		} else {
+			printf("Unknown key \"%.*s\" at line %d of parts description file, ignored.\n", key_len, key, line);
+			while ((*endp != ',') && (*endp != '\0') && (*endp != '\n')) {
+				endp++;
 			}
 		}
-		/* Done, retrun the part ! */
-		return part;
 	}
+	return 0;
+}
 
+/* Parse one line of a parts description file into "part".
+ * Returns 0 if a part has been read, 1 for comment and empty lines, and -1 for
+ * malformed lines.
+ */
+int part_parse_line(char* buf, struct part_desc* part, unsigned int line)
+{
+	char* endp = NULL;
+	uint32_t* part_values = NULL;
+	unsigned int nval = 0;
+	unsigned int i = 0;
+
+	if (buf[0] == '#' || buf[0] == '\n' || buf[0] == '\r' || buf[0] == '\0') {
+		/* skip comments */
+		return 1;
+	}
+	part->part_id = strtoul(buf, &endp, 0);
+	part->sector_sizes = NULL;
+	part->name = malloc(PART_NAME_LENGTH + 1);
+	if (part->name == NULL) {
+		printf("Unable to allocate part name.\n");
+		return -1;
+	}
+	/* Part names must start with "LPC" */
+	while ((*endp != '\0') && (*endp != 'L')) {
+		endp++;
+	}
+	/* Copy part name */
+	for (i = 0; i < PART_NAME_LENGTH; i++) {
+		if (endp[i] == '\0') {
+			/* Hey, we need the part description after the name */
+			printf("Malformed parts description file at line %d, nothing after part name.\n", line);
+			goto out_err;
+		}
+ 		if (endp[i] == ',') {
+			break;
+		}
+		part->name[i] = endp[i];
+	}
+	if ((i == PART_NAME_LENGTH) && (endp[i] != ',')) {
+		printf("Malformed parts description file at line %d, part name too long.\n", line);
+			goto out_err;
+	}
+	part->name[i] = '\0';
+	endp += i;
+	/* Get all the values */
+	nval = PART_NB_COLUMNS;
+	part_values = &(part->flash_base); /* Use a table to read the data, we do not care of what the data is */
+	for (i = 0; i < nval; i++) {
+		errno = 0;
+		part_values[i] = strtoul((endp + 1), &endp, 0);
+		if ((part_values[i] == 0) && (errno == EINVAL)) {
+			printf("Malformed parts description file at line %d, error reading value %d\n", line, i);
+			goto out_err;
+		}
+	}
+	/* And the optionnal ones */
+	for (i = nval; i < PART_NB_VALUES; i++) {
+		part_values[i] = 0;
+	}
+	if (parse_part_options(part, endp, line) != 0) {
+		goto out_err;
+	}
+	return 0;
 
-out_err_2:
+out_err:
+	free(part->sector_sizes);
+	part->sector_sizes = NULL;
 	free(part->name);
-out_err_1:
-	free(part);
+	part->name = NULL;
+	return -1;
+}
+
+
+/* Parts database hash index.
+ * The index holds the position of each part in the parts table plus one, 0 marking
+ * empty slots. Collisions are resolved by looking at the next slots.
+ */
+static unsigned int part_hash(uint64_t dev_id, unsigned int index_bits)
+{
+	uint32_t h = (uint32_t)(dev_id ^ (dev_id >> 32)) * 2654435761U;
+	return (h >> (32 - index_bits));
+}
+
+/* Build the hash index of a database whose parts table is filled.
+ * When a part ID is found more than once, the first description is used.
+ */
+int parts_db_index(struct parts_db* db)
+{
+	unsigned int size = 0;
+	unsigned int i = 0;
+
+	/* Keep the index at most half full */
+	db->index_bits = 4;
+	while ((1U << db->index_bits) < (2 * db->nb_parts)) {
+		db->index_bits++;
+	}
+	size = (1U << db->index_bits);
+	db->index = calloc(size, sizeof(unsigned int));
+	if (db->index == NULL) {
+		printf("Unable to allocate parts index.\n");
+		return -1;
+	}
+	for (i = 0; i < db->nb_parts; i++) {
+		unsigned int slot = part_hash(db->parts[i].part_id, db->index_bits);
+		while (db->index[slot] != 0) {
+			if (db->parts[db->index[slot] - 1].part_id == db->parts[i].part_id) {
+				break;
+			}
+			slot = (slot + 1) & (size - 1);
+		}
+		if (db->index[slot] == 0) {
+			db->index[slot] = i + 1;
+		}
+	}
+	return 0;
+}
+
+struct part_desc* parts_db_find(struct parts_db* db, uint64_t dev_id)
+{
+	unsigned int mask = (1U << db->index_bits) - 1;
+	unsigned int slot = 0;
+
+	if (db->cache != NULL) {
+		return parts_cache_find(db, dev_id);
+	}
+	if (db->index == NULL) {
+		return NULL;
+	}
+	slot = part_hash(dev_id, db->index_bits);
+	while (db->index[slot] != 0) {
+		struct part_desc* part = &(db->parts[db->index[slot] - 1]);
+		if (part->part_id == dev_id) {
+			return part;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+/* Read a whole parts description file into a database.
+ * Malformed lines are reported and skipped.
+ */
+struct parts_db* parts_db_load(char* parts_file_name)
+{
+	FILE* parts_file = NULL;
+	struct parts_db* db = NULL;
+	unsigned int line = 0; /* Store current line number when reading file */
+	unsigned int size = 0;
+	char buf[CONF_READ_BUF_SIZE];
+
+	parts_file = fopen(parts_file_name, "r");
+	if (parts_file == NULL) {
+		perror("Unable to open file to read LPC descriptions !");
+		return NULL;
+	}
+	db = calloc(1, sizeof(struct parts_db));
+	if (db == NULL) {
+		printf("Unable to allocate parts database.\n");
+		goto out_err;
+	}
+
+	while (fgets(buf, CONF_READ_BUF_SIZE, parts_file) != NULL) {
+		line++; /* Store current line number to help parts description file correction */
+		if (db->nb_parts == size) {
+			struct part_desc* parts = NULL;
+			size = (size == 0) ? 32 : (size * 2);
+			parts = realloc(db->parts, (size * sizeof(struct part_desc)));
+			if (parts == NULL) {
+				printf("Unable to allocate parts database.\n");
+				goto out_err;
+			}
+			db->parts = parts;
+		}
+		if (part_parse_line(buf, &(db->parts[db->nb_parts]), line) == 0) {
+			db->nb_parts++;
+		}
+	}
+	if (parts_db_index(db) != 0) {
+		goto out_err;
+	}
+	fclose(parts_file);
+	return db;
+
+out_err:
+	parts_db_free(db);
 	fclose(parts_file);
 	return NULL;
 }
 
+void parts_db_free(struct parts_db* db)
+{
+	unsigned int i = 0;
+
+	if (db == NULL) {
+		return;
+	}
+	if (db->cache != NULL) {
+		/* Names and sector maps are in the mapped cache */
+		munmap(db->cache, db->cache_size);
+		pthread_mutex_destroy(&db->lock);
+	} else {
+		for (i = 0; i < db->nb_parts; i++) {
+			free(db->parts[i].name);
+			free(db->parts[i].sector_sizes);
+		}
+	}
+	free(db->parts);
+	free(db->index);
+	free(db);
+}
+
+
+/* Name of the per-user cache of a parts description file, used when the cache can not
+ * be written next to the file : $XDG_CACHE_HOME/lpctools/ (or $HOME/.cache/lpctools/)
+ * followed by the absolute path of the file, with '/' replaced by '%'.
+ * The directories are created if "create" is set. Returns NULL if there is none.
+ */
+static char* parts_user_cache_name(char* parts_file_name, int create)
+{
+	char* base = getenv("XDG_CACHE_HOME");
+	char* home = getenv("HOME");
+	char* path = NULL;
+	char* name = NULL;
+	size_t len = 0;
+	unsigned int i = 0;
+
+	if ((base == NULL) || (base[0] != '/')) {
+		if ((home == NULL) || (home[0] != '/')) {
+			return NULL;
+		}
+		base = NULL;
+	}
+	path = realpath(parts_file_name, NULL);
+	if (path == NULL) {
+		return NULL;
+	}
+	len = ((base != NULL) ? strlen(base) : (strlen(home) + strlen("/.cache"))) +
+			strlen("/lpctools/") + strlen(path) + sizeof(PARTS_CACHE_SUFFIX);
+	name = malloc(len);
+	if (name == NULL) {
+		free(path);
+		return NULL;
+	}
+	if (base != NULL) {
+		strcpy(name, base);
+	} else {
+		snprintf(name, len, "%s/.cache", home);
+	}
+	if (create) {
+		mkdir(name, 0700);
+	}
+	strcat(name, "/lpctools");
+	if (create) {
+		mkdir(name, 0700);
+	}
+	strcat(name, "/");
+	for (i = 0; path[i] != '\0'; i++) {
+		if (path[i] == '/') {
+			path[i] = '%';
+		}
+	}
+	strcat(name, path);
+	strcat(name, PARTS_CACHE_SUFFIX);
+	free(path);
+	return name;
+}
+
+/* Use the binary cache of the parts description file if up to date, or read the file
+ * and update the cache. The cache is stored next to the file, or in the user cache
+ * directory when the directory of the file is not writable.
+ */
+struct parts_db* parts_file_open(char* parts_file_name)
+{
+	struct parts_db* db = NULL;
+	struct stat source;
+	char* cache_file_name = NULL;
+	char* user_cache_name = NULL;
+
+	if (stat(parts_file_name, &source) != 0) {
+		perror("Unable to open file to read LPC descriptions !");
+		return NULL;
+	}
+	cache_file_name = malloc(strlen(parts_file_name) + sizeof(PARTS_CACHE_SUFFIX));
+	if (cache_file_name == NULL) {
+		return parts_db_load(parts_file_name);
+	}
+	strcpy(cache_file_name, parts_file_name);
+	strcat(cache_file_name, PARTS_CACHE_SUFFIX);
+
+	db = parts_cache_open(cache_file_name, &source);
+	if (db == NULL) {
+		user_cache_name = parts_user_cache_name(parts_file_name, 0);
+		if (user_cache_name != NULL) {
+			db = parts_cache_open(user_cache_name, &source);
+		}
+	}
+	if (db == NULL) {
+		db = parts_db_load(parts_file_name);
+		/* Not being able to write the cache is not an error, but says why the file is
+		 * parsed on each run */
+		if ((db != NULL) && (parts_cache_write(db, cache_file_name, &source) != 0)) {
+			int err = errno;
+			free(user_cache_name);
+			user_cache_name = parts_user_cache_name(parts_file_name, 1);
+			if (user_cache_name == NULL) {
+				printf("Unable to write the parts description cache %s (%s).\n",
+						cache_file_name, strerror(err));
+			} else if (parts_cache_write(db, user_cache_name, &source) != 0) {
+				printf("Unable to write the parts description cache %s (%s) or %s (%s).\n",
+						cache_file_name, strerror(err), user_cache_name, strerror(errno));
+			}
+		}
+	}
+	free(user_cache_name);
+	free(cache_file_name);
+	return db;
+}
+
+struct part_desc* find_part_in_file(struct parts_db* db, uint64_t dev_id, char* parts_file_name)
+{
+	struct part_desc* part = NULL;
+
+	part = parts_db_find(db, dev_id);
+	if (part == NULL) {
+		printf("Part not found in parts description file.\n");
+		return NULL;
+	}
+	printf("Part ID 0x%08x found in %s\n", (unsigned int)part->part_id, parts_file_name);
+	return part;
+}
+
+
+/* Sector geometry.
+ * Offsets are relative to part->flash_base.
+ */
+uint32_t part_sector_start(struct part_desc* part, unsigned int sector)
+{
+	uint32_t start = 0;
+	unsigned int i = 0;
+
+	if (part->sector_sizes == NULL) {
+		return (sector * (part->flash_size / part->flash_nb_sectors));
+	}
+	for (i = 0; (i < sector) && (i < part->flash_nb_sectors); i++) {
+		start += part->sector_sizes[i];
+	}
+	return start;
+}
+
+uint32_t part_sector_size(struct part_desc* part, unsigned int sector)
+{
+	if (part->sector_sizes == NULL) {
+		return (part->flash_size / part->flash_nb_sectors);
+	}
+	return part->sector_sizes[sector];
+}
+
+int part_offset_to_sector(struct part_desc* part, uint32_t offset)
+{
+	uint32_t start = 0;
+	unsigned int i = 0;
+
+	if (offset >= part->flash_size) {
+		return -1;
+	}
+	if (part->sector_sizes == NULL) {
+		return (offset / (part->flash_size / part->flash_nb_sectors));
+	}
+	for (i = 0; i < part->flash_nb_sectors; i++) {
+		start += part->sector_sizes[i];
+		if (offset < start) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+uint32_t part_ram_buff_size(struct part_desc* part)
+{
+	if (part->ram_window > part->ram_buff_size) {
+		return part->ram_window;
+	}
+	return part->ram_buff_size;
+}
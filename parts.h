@@ -24,6 +24,8 @@
 #define FIND_PART_H
 
 #include <stdint.h> /* uint64_t and uint32_t */
+#include <stddef.h> /* size_t, offsetof */
+#include <pthread.h> /* pthread_mutex_t */
 
 #define PART_NAME_LENGTH  25
 
@@ -31,8 +33,9 @@
 /* ALL data below name MUST be of type uint32_t */
 struct part_desc {
 	uint64_t part_id;
+	/* Size of each sector, NULL when all sectors have the same size */
+	uint32_t* sector_sizes;
 	char* name;
-	uint32_t pad;
 	/* Flash */
 	uint32_t flash_base;
 	uint32_t flash_size;
@@ -44,17 +47,69 @@ struct part_desc {
 	uint32_t ram_buff_offset; /* Used to transfer data for flashing */
 	uint32_t ram_buff_size;
 	uint32_t uuencode;
+	/* Optionnal values, from "key=value" fields, 0 when not given */
+	uint32_t max_baudrate; /* Highest reliable baudrate */
+	uint32_t ram_window; /* RAM usable for transfers from ram_buff_offset, if more than ram_buff_size */
+	uint32_t cmd_gap_us; /* Delay between a reply and the next command */
+	uint32_t copy_sizes; /* Supported copy-ram-to-flash sizes, bit n set for 2^n bytes */
+	uint32_t isp_cmds; /* Supported optionnal ISP commands (PART_CMD_*) */
 };
 
-/* When looking for parts description in a file ee do allocate (malloc) two memory
- *   chunks which we will never free.
- * The user should free part_desc->name and part_desc when they are no more useful
+/* Optionnal ISP commands */
+#define PART_CMD_CRC  (1 << 0) /* Read CRC checksum ('S') */
+
+/* Copy sizes used when the part description does not give them */
+#define PART_DEFAULT_COPY_SIZES  ((1 << 12) | (1 << 10) | (1 << 9) | (1 << 8) | (1 << 6))
+
+/* Number of values given as columns in parts description files, from flash_base to uuencode */
+#define PART_NB_COLUMNS  (((offsetof(struct part_desc, uuencode) - offsetof(struct part_desc, flash_base)) / sizeof(uint32_t)) + 1)
+/* Number of uint32_t values, from flash_base to isp_cmds, the last member of struct part_desc */
+#define PART_NB_VALUES  (((offsetof(struct part_desc, isp_cmds) - offsetof(struct part_desc, flash_base)) / sizeof(uint32_t)) + 1)
+
+/* Parts database, with a hash index on part IDs, or using a mapped binary cache.
+ * For mapped caches, "parts" are filled on first lookup, under "lock". */
+struct parts_db {
+	struct part_desc* parts;
+	unsigned int nb_parts;
+	unsigned int* index;
+	unsigned int index_bits;
+	void* cache;
+	size_t cache_size;
+	pthread_mutex_t lock; /* Only used with a mapped cache */
+};
+
+/* Parse one line of a parts description file into "part".
+ * Returns 0 if a part has been read, 1 for comment and empty lines, and -1 for
+ * malformed lines. */
+int part_parse_line(char* buf, struct part_desc* part, unsigned int line);
+
+/* Read a whole parts description file, or build the index of a filled table */
+struct parts_db* parts_db_load(char* parts_file_name);
+int parts_db_index(struct parts_db* db);
+void parts_db_free(struct parts_db* db);
+struct part_desc* parts_db_find(struct parts_db* db, uint64_t dev_id);
+
+/* Open a parts description file.
+ * A binary cache of the file is used when up to date, and written when it is not.
+ * The database belongs to the caller, and parts found in it stay valid until it is
+ * freed using parts_db_free(). It can be shared by threads, lookups are thread safe.
  */
-struct part_desc* find_part_in_file(uint64_t dev_id, char* conf_file_name);
+struct parts_db* parts_file_open(char* conf_file_name);
+/* Find a part in a parts description file opened with parts_file_open().
+ * The returned part belongs to the parts database and must not be freed. */
+struct part_desc* find_part_in_file(struct parts_db* db, uint64_t dev_id, char* conf_file_name);
 
-/* Find a part in the internal parts table */
-/* FIXME : To be inplemented ? */
+/* Find a part in the internal parts table, built from lpctools_parts.def */
 struct part_desc* find_part_internal_tab(uint64_t dev_id);
 
+/* Sector geometry, offsets are relative to part->flash_base */
+uint32_t part_sector_start(struct part_desc* part, unsigned int sector);
+uint32_t part_sector_size(struct part_desc* part, unsigned int sector);
+/* Returns the sector holding "offset", or -1 if out of flash */
+int part_offset_to_sector(struct part_desc* part, uint32_t offset);
+
+/* RAM usable for transfers, from part->ram_buff_offset */
+uint32_t part_ram_buff_size(struct part_desc* part);
+
 #endif /* FIND_PART_H */
 
@@ -0,0 +1,283 @@
+/*********************************************************************
+ *
+ *   LPC Parts description binary cache
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+#include <stdint.h> /* uint64_t and uint32_t */
+#include <stdlib.h> /* calloc, qsort */
+#include <stdio.h>
+#include <string.h> /* memcmp, memcpy, strlen */
+#include <unistd.h> /* close, unlink */
+#include <fcntl.h> /* open */
+#include <errno.h>
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "parts.h"
+#include "parts_cache.h"
+
+
+struct part_desc* parts_cache_find(struct parts_db* db, uint64_t dev_id)
+{
+	struct parts_cache_header* header = db->cache;
+	struct parts_cache_record* records = (struct parts_cache_record*)(header + 1);
+	char* cache = db->cache;
+	unsigned int low = 0, high = db->nb_parts;
+	struct parts_cache_record* rec = NULL;
+	struct part_desc* part = NULL;
+
+	while (low < high) {
+		unsigned int mid = low + ((high - low) / 2);
+		if (records[mid].part_id < dev_id) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if ((low == db->nb_parts) || (records[low].part_id != dev_id)) {
+		return NULL;
+	}
+	rec = &records[low];
+	part = &(db->parts[low]);
+	pthread_mutex_lock(&db->lock);
+	if (part->name != NULL) {
+		goto out;
+	}
+
+	/* First lookup of this part, fill the part description from the record */
+	if (rec->name_offset >= header->strings_size) {
+		printf("Corrupted parts cache, invalid name for part 0x%08x.\n", (unsigned int)dev_id);
+		part = NULL;
+		goto out;
+	}
+	part->part_id = rec->part_id;
+	memcpy(&(part->flash_base), rec->values, sizeof(rec->values));
+	part->sector_sizes = NULL;
+	if (rec->sectors_index != PARTS_CACHE_NO_SECTORS) {
+		if (((rec->sectors_index + (uint64_t)part->flash_nb_sectors) * sizeof(uint32_t)) > header->sectors_size) {
+			printf("Corrupted parts cache, invalid sector map for part 0x%08x.\n", (unsigned int)dev_id);
+			part = NULL;
+			goto out;
+		}
+		part->sector_sizes = (uint32_t*)(cache + header->sectors_offset) + rec->sectors_index;
+	}
+	part->name = (cache + header->strings_offset + rec->name_offset);
+
+out:
+	pthread_mutex_unlock(&db->lock);
+	return part;
+}
+
+struct parts_db* parts_cache_open(char* cache_file_name, struct stat* source)
+{
+	struct parts_cache_header* header = NULL;
+	struct parts_db* db = NULL;
+	struct stat st;
+	char* cache = NULL;
+	int fd = -1;
+
+	fd = open(cache_file_name, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(struct parts_cache_header))) {
+		close(fd);
+		return NULL;
+	}
+	cache = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache == MAP_FAILED) {
+		return NULL;
+	}
+
+	/* Check that the cache is valid, and was built from the current source file */
+	header = (struct parts_cache_header*)cache;
+	if ((memcmp(header->magic, PARTS_CACHE_MAGIC, sizeof(header->magic)) != 0) ||
+			(header->version != PARTS_CACHE_VERSION) ||
+			(header->endian != PARTS_CACHE_ENDIAN) ||
+			(header->record_size != sizeof(struct parts_cache_record)) ||
+			(header->source_mtime != (uint64_t)source->st_mtime) ||
+			(header->source_mtime_nsec != (uint64_t)source->st_mtim.tv_nsec) ||
+			(header->source_size != (uint64_t)source->st_size)) {
+		goto out_invalid;
+	}
+	if (((sizeof(struct parts_cache_header) + ((uint64_t)header->nb_parts * header->record_size)) > (uint64_t)st.st_size) ||
+			(((uint64_t)header->sectors_offset + header->sectors_size) > (uint64_t)st.st_size) ||
+			(((uint64_t)header->strings_offset + header->strings_size) > (uint64_t)st.st_size) ||
+			((header->sectors_offset % sizeof(uint32_t)) != 0) ||
+			(header->strings_size == 0) || (cache[header->strings_offset + header->strings_size - 1] != '\0')) {
+		goto out_invalid;
+	}
+
+	db = calloc(1, sizeof(struct parts_db));
+	if (db == NULL) {
+		goto out_invalid;
+	}
+	/* Part descriptions are filled on first lookup */
+	db->parts = calloc((header->nb_parts + 1), sizeof(struct part_desc));
+	if (db->parts == NULL) {
+		free(db);
+		goto out_invalid;
+	}
+	db->nb_parts = header->nb_parts;
+	db->cache = cache;
+	db->cache_size = st.st_size;
+	pthread_mutex_init(&db->lock, NULL);
+	return db;
+
+out_invalid:
+	munmap(cache, st.st_size);
+	return NULL;
+}
+
+
+/* Sort parts by ID, keeping the file order for identical IDs */
+struct cache_sort {
+	uint64_t part_id;
+	unsigned int idx;
+};
+
+static int cache_sort_cmp(const void* a, const void* b)
+{
+	const struct cache_sort* sa = a;
+	const struct cache_sort* sb = b;
+
+	if (sa->part_id != sb->part_id) {
+		return (sa->part_id < sb->part_id) ? -1 : 1;
+	}
+	return (sa->idx < sb->idx) ? -1 : ((sa->idx > sb->idx) ? 1 : 0);
+}
+
+int parts_cache_write(struct parts_db* db, char* cache_file_name, struct stat* source)
+{
+	struct parts_cache_header header;
+	struct cache_sort* order = NULL;
+	char* tmp_name = NULL;
+	FILE* out = NULL;
+	uint32_t name_offset = 0, sectors_index = 0;
+	unsigned int nb = 0, i = 0;
+	int ret = -1, err = 0;
+
+	order = malloc((db->nb_parts + 1) * sizeof(struct cache_sort));
+	tmp_name = malloc(strlen(cache_file_name) + 5);
+	if ((order == NULL) || (tmp_name == NULL)) {
+		goto out;
+	}
+	for (i = 0; i < db->nb_parts; i++) {
+		order[i].part_id = db->parts[i].part_id;
+		order[i].idx = i;
+	}
+	qsort(order, db->nb_parts, sizeof(struct cache_sort), cache_sort_cmp);
+	/* Remove duplicates, the first description is used */
+	for (i = 0; i < db->nb_parts; i++) {
+		if ((nb == 0) || (order[nb - 1].part_id != order[i].part_id)) {
+			order[nb++] = order[i];
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PARTS_CACHE_MAGIC, sizeof(header.magic));
+	header.version = PARTS_CACHE_VERSION;
+	header.endian = PARTS_CACHE_ENDIAN;
+	header.record_size = sizeof(struct parts_cache_record);
+	header.nb_parts = nb;
+	header.source_mtime = source->st_mtime;
+	header.source_mtime_nsec = source->st_mtim.tv_nsec;
+	header.source_size = source->st_size;
+	header.sectors_offset = sizeof(header) + (nb * sizeof(struct parts_cache_record));
+	for (i = 0; i < nb; i++) {
+		struct part_desc* part = &(db->parts[order[i].idx]);
+		if (part->sector_sizes != NULL) {
+			header.sectors_size += part->flash_nb_sectors * sizeof(uint32_t);
+		}
+		header.strings_size += strlen(part->name) + 1;
+	}
+	header.strings_offset = header.sectors_offset + header.sectors_size;
+	header.strings_size += 1; /* Never empty */
+
+	/* Write to a temporary file, renamed once complete */
+	strcpy(tmp_name, cache_file_name);
+	strcat(tmp_name, ".new");
+	out = fopen(tmp_name, "wb");
+	if (out == NULL) {
+		goto out;
+	}
+	if (fwrite(&header, sizeof(header), 1, out) != 1) {
+		goto out_err;
+	}
+	for (i = 0; i < nb; i++) {
+		struct part_desc* part = &(db->parts[order[i].idx]);
+		struct parts_cache_record rec;
+		memset(&rec, 0, sizeof(rec));
+		rec.part_id = part->part_id;
+		rec.name_offset = name_offset;
+		name_offset += strlen(part->name) + 1;
+		rec.sectors_index = PARTS_CACHE_NO_SECTORS;
+		if (part->sector_sizes != NULL) {
+			rec.sectors_index = sectors_index;
+			sectors_index += part->flash_nb_sectors;
+		}
+		memcpy(rec.values, &(part->flash_base), sizeof(rec.values));
+		if (fwrite(&rec, sizeof(rec), 1, out) != 1) {
+			goto out_err;
+		}
+	}
+	for (i = 0; i < nb; i++) {
+		struct part_desc* part = &(db->parts[order[i].idx]);
+		if (part->sector_sizes == NULL) {
+			continue;
+		}
+		if (fwrite(part->sector_sizes, sizeof(uint32_t), part->flash_nb_sectors, out) != part->flash_nb_sectors) {
+			goto out_err;
+		}
+	}
+	for (i = 0; i < nb; i++) {
+		struct part_desc* part = &(db->parts[order[i].idx]);
+		if (fwrite(part->name, (strlen(part->name) + 1), 1, out) != 1) {
+			goto out_err;
+		}
+	}
+	if (fputc('\0', out) == EOF) {
+		goto out_err;
+	}
+	if (fclose(out) != 0) {
+		out = NULL;
+		goto out_err;
+	}
+	out = NULL;
+	if (rename(tmp_name, cache_file_name) != 0) {
+		goto out_err;
+	}
+	ret = 0;
+	goto out;
+
+out_err:
+	err = errno;
+	if (out != NULL) {
+		fclose(out);
+	}
+	unlink(tmp_name);
+	errno = err;
+out:
+	free(tmp_name);
+	free(order);
+	return ret;
+}
@@ -0,0 +1,76 @@
+/*********************************************************************
+ *
+ *   LPC Parts description binary cache
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+#ifndef PARTS_CACHE_H
+#define PARTS_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "parts.h"
+
+/* Binary cache of a parts description file.
+ * The cache holds fixed size records sorted by part ID, followed by the sector maps and
+ * a string table for part names. It is mmap'ed and searched in place.
+ */
+#define PARTS_CACHE_SUFFIX  ".cache"
+#define PARTS_CACHE_MAGIC  "LPCPARTS"
+#define PARTS_CACHE_VERSION  2
+#define PARTS_CACHE_ENDIAN  0x01020304
+#define PARTS_CACHE_NO_SECTORS  0xFFFFFFFF
+
+struct parts_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint32_t record_size;
+	uint32_t nb_parts;
+	/* Offsets from start of file, and sizes in bytes */
+	uint32_t sectors_offset;
+	uint32_t sectors_size;
+	uint32_t strings_offset;
+	uint32_t strings_size;
+	/* Source file, the cache is rebuilt when it changes */
+	uint64_t source_mtime;
+	uint64_t source_mtime_nsec; /* Edits within the same second */
+	uint64_t source_size;
+};
+
+struct parts_cache_record {
+	uint64_t part_id;
+	uint32_t name_offset; /* In string table */
+	uint32_t sectors_index; /* In sector maps, PARTS_CACHE_NO_SECTORS if none */
+	/* Values from flash_base to the end of struct part_desc */
+	uint32_t values[PART_NB_VALUES];
+};
+
+/* Map the cache file, if it is valid and up to date with the source file whose stat
+ * data is given. Returns NULL if the cache must be rebuilt. */
+struct parts_db* parts_cache_open(char* cache_file_name, struct stat* source);
+
+/* Write the cache of a parts database. Returns 0 on success. */
+int parts_cache_write(struct parts_db* db, char* cache_file_name, struct stat* source);
+
+/* Binary search in a mapped cache */
+struct part_desc* parts_cache_find(struct parts_db* db, uint64_t dev_id);
+
+#endif /* PARTS_CACHE_H */
@@ -0,0 +1,123 @@
+/*********************************************************************
+ *
+ *   LPC Parts table generator
+ *
+ * Build time tool, compiled for the host : turns a parts description file into
+ * the C source of the internal parts table, with its hash index.
+ *
+ *
+ *  Copyright (C) 2012 Nathael Pajani <nathael.pajani@nathael.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "parts.h"
+
+
+int main(int argc, char** argv)
+{
+	struct parts_db* db = NULL;
+	FILE* out = NULL;
+	unsigned int i = 0, j = 0;
+
+	if (argc != 3) {
+		printf("Usage: %s parts_description_file output_file\n", argv[0]);
+		return 1;
+	}
+	db = parts_db_load(argv[1]);
+	if (db == NULL) {
+		return 1;
+	}
+	out = fopen(argv[2], "w");
+	if (out == NULL) {
+		perror("Unable to open output file");
+		parts_db_free(db);
+		return 1;
+	}
+
+	fprintf(out, "/* Internal parts table, generated from %s by parts_gen. Do not edit. */\n\n", argv[1]);
+	fprintf(out, "#include <stdint.h>\n#include <stdlib.h>\n\n#include \"parts.h\"\n\n");
+
+	/* Sector maps */
+	for (i = 0; i < db->nb_parts; i++) {
+		struct part_desc* part = &(db->parts[i]);
+		if (part->sector_sizes == NULL) {
+			continue;
+		}
+		fprintf(out, "static uint32_t sector_sizes_%u[] = {", i);
+		for (j = 0; j < part->flash_nb_sectors; j++) {
+			fprintf(out, "%s0x%x", ((j == 0) ? "\n\t" : ((j % 8) ? ", " : ",\n\t")), part->sector_sizes[j]);
+		}
+		fprintf(out, "\n};\n");
+	}
+
+	/* Parts */
+	fprintf(out, "\nstatic struct part_desc internal_parts[] = {\n");
+	for (i = 0; i < db->nb_parts; i++) {
+		struct part_desc* part = &(db->parts[i]);
+		fprintf(out, "\t{\n");
+		fprintf(out, "\t\t.part_id = 0x%08llx,\n", (unsigned long long)part->part_id);
+		fprintf(out, "\t\t.name = \"%s\",\n", part->name);
+		if (part->sector_sizes != NULL) {
+			fprintf(out, "\t\t.sector_sizes = sector_sizes_%u,\n", i);
+		} else {
+			fprintf(out, "\t\t.sector_sizes = NULL,\n");
+		}
+		fprintf(out, "\t\t.flash_base = 0x%08x,\n", part->flash_base);
+		fprintf(out, "\t\t.flash_size = 0x%x,\n", part->flash_size);
+		fprintf(out, "\t\t.flash_nb_sectors = %u,\n", part->flash_nb_sectors);
+		fprintf(out, "\t\t.reset_vector_offset = 0x%x,\n", part->reset_vector_offset);
+		fprintf(out, "\t\t.ram_base = 0x%08x,\n", part->ram_base);
+		fprintf(out, "\t\t.ram_size = 0x%x,\n", part->ram_size);
+		fprintf(out, "\t\t.ram_buff_offset = 0x%x,\n", part->ram_buff_offset);
+		fprintf(out, "\t\t.ram_buff_size = 0x%x,\n", part->ram_buff_size);
+		fprintf(out, "\t\t.uuencode = %u,\n", part->uuencode);
+		fprintf(out, "\t\t.max_baudrate = %u,\n", part->max_baudrate);
+		fprintf(out, "\t\t.ram_window = 0x%x,\n", part->ram_window);
+		fprintf(out, "\t\t.cmd_gap_us = %u,\n", part->cmd_gap_us);
+		fprintf(out, "\t\t.copy_sizes = 0x%x,\n", part->copy_sizes);
+		fprintf(out, "\t\t.isp_cmds = 0x%x,\n", part->isp_cmds);
+		fprintf(out, "\t},\n");
+	}
+	fprintf(out, "};\n");
+
+	/* Hash index */
+	fprintf(out, "\nstatic unsigned int internal_index[] = {");
+	for (i = 0; i < (1U << db->index_bits); i++) {
+		fprintf(out, "%s%u", ((i == 0) ? "\n\t" : ((i % 16) ? ", " : ",\n\t")), db->index[i]);
+	}
+	fprintf(out, "\n};\n");
+
+	fprintf(out, "\nstatic struct parts_db internal_db = {\n");
+	fprintf(out, "\t.parts = internal_parts,\n");
+	fprintf(out, "\t.nb_parts = %u,\n", db->nb_parts);
+	fprintf(out, "\t.index = internal_index,\n");
+	fprintf(out, "\t.index_bits = %u,\n", db->index_bits);
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "struct part_desc* find_part_internal_tab(uint64_t dev_id)\n{\n");
+	fprintf(out, "\treturn parts_db_find(&internal_db, dev_id);\n}\n");
+
+	parts_db_free(db);
+	if (fclose(out) != 0) {
+		perror("Unable to write output file");
+		return 1;
+	}
+	return 0;
+}
@@ -36,103 +36,346 @@
 #include "isp_utils.h"
 #include "isp_commands.h"
 #include "parts.h"
+#include "prog_commands.h"
 
 #define REP_BUFSIZE 40
 
-extern int trace_on;
 
-
-int get_ids(void)
+int get_ids(struct isp_transport* t)
 {
 	int ret = 0;
 
-	isp_cmd_part_id(0);
-	isp_cmd_read_uid();
-	isp_cmd_boot_version();
+	isp_cmd_part_id(t, 0);
+	isp_cmd_read_uid(t);
+	isp_cmd_boot_version(t);
 
 	return ret;
 }
 
 
-int dump_to_file(struct part_desc* part, char* filename)
+/* Candidate baudrates for negotiation, in increasing order */
+static unsigned int negotiation_baudrates[] = { 57600, 115200, 230400, 460800, 921600, 0, };
+/* Amount of data sent and read back when testing a baudrate */
+#define NEGOTIATION_TEST_SIZE 2048
+
+/* Find the fastest baudrate (up to max_baudrate if not nul) at which a RAM round trip
+ * needs no resend. The target and host are left at this baudrate.
+ * Returns the selected baudrate, or a negative value if the target has been lost.
+ */
+int negotiate_baudrate(struct isp_transport* t, struct part_desc* part, unsigned int max_baudrate)
+{
+	unsigned int best = t->baudrate;
+	uint32_t ram_addr = (part->ram_base + part->ram_buff_offset);
+	unsigned int size = NEGOTIATION_TEST_SIZE;
+	int i = 0, ret = 0;
+
+	if (size > part_ram_buff_size(part)) {
+		size = part_ram_buff_size(part);
+	}
+	/* Check the reference baudrate first, resends here mean the link is already bad */
+	ret = isp_link_test(t, ram_addr, size, part->uuencode);
+	if (ret != 0) {
+		printf("Link test failed at %u bauds (%d), keeping it.\n", best, ret);
+		return best;
+	}
+
+	for (i = 0; negotiation_baudrates[i] != 0; i++) {
+		unsigned int rate = negotiation_baudrates[i];
+
+		if (rate <= best) {
+			continue;
+		}
+		if ((max_baudrate != 0) && (rate > max_baudrate)) {
+			break;
+		}
+		if (isp_send_cmd_set_baud_rate(t, rate, 1) != 0) {
+			if (isp_link_fallback(t, best) != 0) {
+				printf("Target lost while testing link speed.\n");
+				return -1;
+			}
+			break;
+		}
+		ret = isp_link_test(t, ram_addr, size, part->uuencode);
+		if (t->trace) {
+			printf("Link test at %u bauds: %d\n", rate, ret);
+		}
+		if (ret != 0) {
+			if (isp_link_fallback(t, best) != 0) {
+				printf("Target lost while testing link speed.\n");
+				return -1;
+			}
+			break;
+		}
+		best = rate;
+	}
+	printf("Link speed set to %u bauds.\n", best);
+
+	return best;
+}
+
+
+/* Blank map discovery.
+ * Blank-check sectors "first" to "last" as a whole, and use the offset of the first non
+ * blank word returned by the bootloader to skip over the blank sectors before it. The
+ * range is only bisected when this offset cannot be used.
+ * Blank sectors are marked in "blank", one char per sector.
+ * Returns the number of blank sectors found in the range, or a negative value on error.
+ */
+static int blank_map(struct isp_transport* t, struct part_desc* part, int first, int last, char* blank)
+{
+	int count = 0;
+
+	while (first <= last) {
+		char buf[REP_BUFSIZE];
+		int ret = 0, len = 0, sector = -1;
+
+		ret = isp_send_cmd_sectors(t, "blank-check", 'I', first, last, 1);
+		if (ret == CMD_SUCCESS) {
+			memset(&blank[first], 1, (last - first + 1));
+			return count + (last - first + 1);
+		}
+		if (ret != SECTOR_NOT_BLANK) {
+			printf("Blank check error (%d) for sectors %d to %d!\n", ret, first, last);
+			return ((ret < 0) ? ret : -ret);
+		}
+		/* Controller replyed with first non blank offset and data */
+		len = isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+		if (len > 0) {
+			unsigned long int offset = strtoul(buf, NULL, 10);
+			isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+			sector = part_offset_to_sector(part, (part_sector_start(part, first) + offset));
+		}
+		if ((sector < first) || (sector > last)) {
+			/* No usable offset, bisect */
+			int mid = (first + last) / 2;
+			if (first == last) {
+				blank[first] = 0;
+				return count;
+			}
+			ret = blank_map(t, part, first, mid, blank);
+			if (ret < 0) {
+				return ret;
+			}
+			count += ret;
+			first = mid + 1;
+			continue;
+		}
+		/* Sectors before the non blank one are blank */
+		if (sector > first) {
+			memset(&blank[first], 1, (sector - first));
+			count += (sector - first);
+		}
+		blank[sector] = 0;
+		first = sector + 1;
+	}
+	return count;
+}
+
+/* Returns 1 if the "len" bytes of "data" are all in erased state */
+static int block_is_blank(const char* data, unsigned int len)
+{
+	unsigned int i = 0;
+
+	for (i = 0; i < len; i++) {
+		if ((unsigned char)data[i] != 0xFF) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+int dump_to_file(struct isp_transport* t, struct part_desc* part, char* filename)
 {
+	char* blank = NULL;
+	char ff[256];
 	int ret = 0, len = 0;
-	char* data;
+	int out_fd = -1;
+	int i = 0, nb_sectors = part->flash_nb_sectors;
 
-	/* Allocate buffer */
-	data = malloc(part->flash_size);
-	if (data == NULL) {
-		printf("Unable to allocate read buffer, asked %u.\n", part->flash_size);
-		return -10;
+	blank = malloc(nb_sectors);
+	if (blank == NULL) {
+		printf("Unable to allocate blank map.\n");
+		return -4;
+	}
+	/* Blank sectors need not be read */
+	ret = blank_map(t, part, 0, (nb_sectors - 1), blank);
+	if (ret < 0) {
+		free(blank);
+		return ret;
 	}
+	ret = 0;
+	memset(ff, 0xFF, sizeof(ff));
 
-	/* Read data */
-	len = isp_read_memory(data, part->flash_base, part->flash_size, part->uuencode);
-	if (len != (int)(part->flash_size)) {
-		printf("Read returned %d bytes instead of %u.\n", len, part->flash_size);
+	out_fd = isp_file_open_out(filename);
+	if (out_fd < 0) {
+		free(blank);
+		return -10;
 	}
 
-	/* Write data to file */
-	ret = isp_buff_to_file(data, part->flash_size, filename);
+	/* Read data, written to the file block by block */
+	for (i = 0; i < nb_sectors; i++) {
+		uint32_t start = part_sector_start(part, i);
+		uint32_t size = 0;
+		int last = i;
 
-	/* Free memory */
-	free(data);
+		while (((last + 1) < nb_sectors) && (blank[last + 1] == blank[i])) {
+			last++;
+		}
+		size = part_sector_start(part, last) + part_sector_size(part, last) - start;
+		if (blank[i]) {
+			uint32_t done = 0;
+			while (done < size) {
+				unsigned int chunk = ((size - done) > sizeof(ff)) ? sizeof(ff) : (size - done);
+				if (isp_read_sink_fd(&out_fd, (part->flash_base + start + done), ff, chunk) != 0) {
+					ret = -11;
+					goto out;
+				}
+				done += chunk;
+			}
+		} else {
+			len = isp_read_memory_stream(t, (part->flash_base + start), size, part->uuencode,
+											isp_read_sink_fd, &out_fd);
+			if (len != (int)size) {
+				printf("Read returned %d bytes instead of %u.\n", len, size);
+				ret = -1;
+				goto out;
+			}
+		}
+		i = last;
+	}
+
+out:
+	isp_file_close_out(out_fd);
+	free(blank);
 
 	return ret;
 }
 
 
-int erase_flash(struct part_desc* part)
+/* Erase sectors "first" to "last" */
+static int erase_range(struct isp_transport* t, int first, int last)
 {
 	int ret = 0;
+
+	ret = isp_send_cmd_sectors(t, "prepare-for-write", 'P', first, last, 1);
+	if (ret != 0) {
+		printf("Error (%d) when trying to prepare sectors %d to %d for erase operation!\n", ret, first, last);
+		return ret;
+	}
+	ret = isp_send_cmd_sectors(t, "erase", 'E', first, last, 1);
+	if (ret != 0) {
+		printf("Error (%d) when trying to erase sectors %d to %d!\n", ret, first, last);
+		return ret;
+	}
+	if (t->trace) {
+		printf("Erased sectors %d to %d.\n", first, last);
+	}
+	return 0;
+}
+
+/* Erase planner.
+ * Erase the sectors marked in "sectors" (one char per sector, all sectors if NULL) which
+ * are not blank, with as few commands as possible : contiguous sectors are erased as one
+ * range, and when "whole_ok" is set (content of the other sectors does not matter) and
+ * most sectors must be erased, the whole flash is erased at once.
+ * "blank" is the blank map of the sectors to erase, found using blank_map() if NULL.
+ */
+static int erase_sectors(struct isp_transport* t, struct part_desc* part, char* sectors, char* blank,
+							int whole_ok)
+{
+	int nb_sectors = part->flash_nb_sectors;
+	char* erase = NULL; /* Sectors to erase, one char per sector */
+	int first = -1, last = -1;
+	int nb_erase = 0;
+	int ret = 0;
 	int i = 0;
 
+	erase = malloc(2 * nb_sectors);
+	if (erase == NULL) {
+		printf("Unable to allocate erase map.\n");
+		return -4;
+	}
+	for (i = 0; i < nb_sectors; i++) {
+		erase[i] = ((sectors == NULL) || sectors[i]);
+		if (erase[i]) {
+			if (first < 0) {
+				first = i;
+			}
+			last = i;
+		}
+	}
+	if (first < 0) {
+		goto out;
+	}
+	/* Do not erase blank sectors */
+	if (blank == NULL) {
+		blank = erase + nb_sectors;
+		ret = blank_map(t, part, first, last, blank);
+		if (ret < 0) {
+			goto out;
+		}
+		ret = 0;
+	}
+	for (i = first; i <= last; i++) {
+		if (blank[i]) {
+			erase[i] = 0;
+		}
+		nb_erase += erase[i];
+	}
+	if (nb_erase == 0) {
+		goto out;
+	}
+
 	/* Unlock device */
-	ret = isp_cmd_unlock(1);
+	ret = isp_cmd_unlock(t, 1);
 	if (ret != 0) {
 		printf("Unable to unlock device, aborting.\n");
-		return -1;
+		ret = -1;
+		goto out;
 	}
 
-	for (i=0; i<(int)(part->flash_nb_sectors); i++) {
-		ret = isp_send_cmd_sectors("blank-check", 'I', i, i, 1);
-		if (ret == CMD_SUCCESS) {
-			/* sector already blank, preserve the flash, skip to next one :) */
+	if (whole_ok && ((2 * nb_erase) > nb_sectors)) {
+		ret = erase_range(t, 0, (nb_sectors - 1));
+		goto out;
+	}
+	for (i = first; i <= last; i++) {
+		int end = i;
+		if (erase[i] == 0) {
 			continue;
 		}
-		if (ret < 0) {
-			/* Error ? */
-			printf("Initial blank check error (%d) at sector %d!\n", ret, i);
-			return ret;
-		} else {
-			/* Controller replyed with first non blank offset and data, remove it from buffer */
-			char buf[REP_BUFSIZE];
-			usleep( 5000 ); /* Some devices are slow to scan flash, give them some time */
-			isp_serial_read(buf, REP_BUFSIZE, 3);
-		}
-		/* Sector not blank, perform erase */
-		ret = isp_send_cmd_sectors("prepare-for-write", 'P', i, i, 1);
-		if (ret != 0) {
-			printf("Error (%d) when trying to prepare sector %d for erase operation!\n", ret, i);
-			return ret;
+		while (((end + 1) <= last) && erase[end + 1]) {
+			end++;
 		}
-		ret = isp_send_cmd_sectors("erase", 'E', i, i, 1);
+		ret = erase_range(t, i, end);
 		if (ret != 0) {
-			printf("Error (%d) when trying to erase sector %d!\n", ret, i);
-			return ret;
+			goto out;
 		}
+		i = end;
 	}
-	printf("Flash now all blank.\n");
 
-	return 0;
+out:
+	free(erase);
+	return ret;
 }
 
-int start_prog(struct part_desc* part)
+int erase_flash(struct isp_transport* t, struct part_desc* part)
+{
+	int ret = 0;
+
+	ret = erase_sectors(t, part, NULL, NULL, 1);
+	if (ret == 0) {
+		printf("Flash now all blank.\n");
+	}
+	return ret;
+}
+
+int start_prog(struct isp_transport* t, struct part_desc* part)
 {
 	int ret = 0, len = 0;
 	uint32_t addr = 0;
 
-	len = isp_read_memory((char*)&addr, (part->flash_base + part->reset_vector_offset), sizeof(addr), part->uuencode);
+	len = isp_read_memory(t, (char*)&addr, (part->flash_base + part->reset_vector_offset), sizeof(addr), part->uuencode);
 	if (len != sizeof(addr)) {
 		printf("Unable to read reset address from flash.\n");
 		return len;
@@ -142,7 +385,7 @@ int start_prog(struct part_desc* part)
 		printf("Actual reset address is 0x%08x, which is under the lowest allowed address of 0x200.\n", addr);
 	}
 	/* Unlock device */
-	ret = isp_cmd_unlock(1);
+	ret = isp_cmd_unlock(t, 1);
 	if (ret != 0) {
 		printf("Unable to unlock device, aborting.\n");
 		return -1;
@@ -150,9 +393,9 @@ int start_prog(struct part_desc* part)
 	/* Read address in thumb or arm mode ? */
 	if (addr & 0x01) {
 		addr &= ~1UL;
-		ret = isp_send_cmd_go(addr, 'T');
+		ret = isp_send_cmd_go(t, addr, 'T');
 	} else {
-		ret = isp_send_cmd_go(addr, 'A');
+		ret = isp_send_cmd_go(t, addr, 'A');
 	}
 
 	/* FIXME : start terminal */
@@ -161,37 +404,227 @@ int start_prog(struct part_desc* part)
 }
 
 
-static unsigned int calc_write_size(unsigned int sector_size, unsigned int ram_buff_size)
+/* Biggest copy size supported by the part which fits in both the sector and the RAM
+ * buffer, 0 if none.
+ * According to section 21.5.7 of LPC11xx user's manual (UM10398), number of bytes
+ * written should be 256 | 512 | 1024 | 4096 */
+static unsigned int calc_write_size(struct part_desc* part, unsigned int sector_size)
 {
-	unsigned int write_size = 0;
+	unsigned int max_size = part_ram_buff_size(part);
+	uint32_t copy_sizes = part->copy_sizes;
+	int n = 0;
 
-	write_size = ((sector_size < ram_buff_size) ? sector_size : ram_buff_size);
-	/* According to section 21.5.7 of LPC11xx user's manual (UM10398), number of bytes
-	 * written should be 256 | 512 | 1024 | 4096 */
-	if (write_size >= 4096) {
-		write_size = 4096;
-	} else if (write_size >= 1024) {
-		write_size = 1024;
-	} else if (write_size >= 512) {
-		write_size = 512;
-	} else if (write_size >= 256) {
-		write_size = 256;
-	} else if (write_size >= 64) {
-		write_size = 64;
-	} else {
-		write_size = 0;
+	if (copy_sizes == 0) {
+		copy_sizes = PART_DEFAULT_COPY_SIZES;
+	}
+	if (sector_size < max_size) {
+		max_size = sector_size;
+	}
+	for (n = 31; n >= 0; n--) {
+		if ((copy_sizes & (1U << n)) && ((1U << n) <= max_size)) {
+			return (1U << n);
+		}
 	}
-	return write_size;
+	return 0;
+}
+
+/* Size of the blocks used to program "sector" */
+static unsigned int sector_write_size(struct part_desc* part, unsigned int sector)
+{
+	return calc_write_size(part, part_sector_size(part, sector));
 }
 
-int flash_target(struct part_desc* part, char* filename, int calc_user_code)
+/* Readback comparison of a sector with the image */
+struct delta_check {
+	char* expected;
+	uint32_t addr;
+	int differ;
+};
+
+static int delta_check_sink(void* priv, uint32_t addr, const char* data, unsigned int len)
 {
+	struct delta_check* check = priv;
+
+	if (memcmp((check->expected + (addr - check->addr)), data, len) != 0) {
+		check->differ = 1;
+		return 1; /* No need to read the remaining of the sector */
+	}
+	return 0;
+}
+
+/* Returns 1 if the sector content differs from "expected", 0 if it is the same, or a
+ * negative value on error */
+static int delta_read_sector(struct isp_transport* t, struct part_desc* part, unsigned int sector, char* expected)
+{
+	struct delta_check check;
+	uint32_t size = part_sector_size(part, sector);
+	int len = 0;
+
+	check.expected = expected;
+	check.addr = part->flash_base + part_sector_start(part, sector);
+	check.differ = 0;
+	len = isp_read_memory_stream(t, check.addr, size, part->uuencode, delta_check_sink, &check);
+	if (check.differ) {
+		return 1;
+	}
+	if (len != (int)size) {
+		printf("Unable to read back sector %u.\n", sector);
+		return -1;
+	}
+	return 0;
+}
+
+/* Same as delta_read_sector(), comparing the CRC-32 of the sector computed by the target
+ * with the one of the image, for parts supporting the read CRC command */
+static int delta_crc_sector(struct isp_transport* t, struct part_desc* part, unsigned int sector, char* expected)
+{
+	uint32_t size = part_sector_size(part, sector);
+	uint32_t crc = 0;
 	int ret = 0;
+
+	ret = isp_read_crc(t, (part->flash_base + part_sector_start(part, sector)), size, &crc);
+	if (ret != 0) {
+		printf("Error (%d) when reading CRC of sector %u.\n", ret, sector);
+		return ((ret < 0) ? ret : -ret);
+	}
+	return (crc != isp_crc32(expected, size));
+}
+
+/* Same as delta_read_sector(), sending the image to RAM by blocks of the sector write
+ * size and using the compare command */
+static int delta_compare_sector(struct isp_transport* t, struct part_desc* part, unsigned int sector,
+								char* expected)
+{
+	uint32_t ram_addr = (part->ram_base + part->ram_buff_offset);
+	uint32_t flash_addr = part->flash_base + part_sector_start(part, sector);
+	uint32_t size = part_sector_size(part, sector);
+	unsigned int write_size = sector_write_size(part, sector);
+	uint32_t offset = 0;
+	int ret = 0;
+
+	for (offset = 0; offset < size; offset += write_size) {
+		ret = isp_send_buf_to_ram(t, (expected + offset), ram_addr, write_size, part->uuencode);
+		if (ret != 0) {
+			printf("Unable to send sector %u data to RAM for comparison.\n", sector);
+			return -1;
+		}
+		ret = isp_send_cmd_address(t, 'M', (flash_addr + offset), ram_addr, write_size, "compare");
+		if (ret == COMPARE_ERROR) {
+			/* Drop the first mismatch offset */
+			char buf[REP_BUFSIZE];
+			isp_serial_readline(t, buf, REP_BUFSIZE, SERIAL_LATENCY_MS);
+			return 1;
+		}
+		if (ret != CMD_SUCCESS) {
+			printf("Error (%d) when comparing sector %u.\n", ret, sector);
+			return -2;
+		}
+	}
+	return 0;
+}
+
+/* Find the sectors of the flash holding the first "len" bytes of "data" which differ
+ * from "data". They are marked in "dirty", one char per sector.
+ * Returns the number of sectors which differ, or a negative value on error.
+ */
+static int delta_scan(struct isp_transport* t, struct part_desc* part, char* data, unsigned int len,
+						char* dirty, char* blank, int mode)
+{
+	unsigned int i = 0;
+	int ret = 0, count = 0;
+	int last = part_offset_to_sector(part, (len - 1));
+
+	/* Blank sectors need not be read back */
+	memset(blank, 0, part->flash_nb_sectors);
+	if (last > 0) {
+		ret = blank_map(t, part, 1, last, blank);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	for (i = 0; i < part->flash_nb_sectors; i++) {
+		uint32_t start = part_sector_start(part, i);
+
+		dirty[i] = 0;
+		if (start >= len) {
+			continue;
+		}
+		if (start == 0) {
+			/* The bootloader maps its own vectors over the start of the first sector,
+			 * it cannot be compared. Always program it. */
+			ret = 1;
+		} else if (blank[i]) {
+			ret = !block_is_blank((data + start), part_sector_size(part, i));
+		} else if (mode == FLASH_DELTA_COMPARE) {
+			ret = delta_compare_sector(t, part, i, (data + start));
+		} else if (part->isp_cmds & PART_CMD_CRC) {
+			ret = delta_crc_sector(t, part, i, (data + start));
+		} else {
+			ret = delta_read_sector(t, part, i, (data + start));
+		}
+		if (ret < 0) {
+			return ret;
+		}
+		dirty[i] = ret;
+		count += ret;
+		if (t->trace) {
+			printf("Sector %u %s.\n", i, (ret ? "differs" : "is up to date"));
+		}
+	}
+	return count;
+}
+
+int flash_image_load(struct flash_image* image, char* filename)
+{
 	char* data = NULL;
 	int size = 0;
+
+	image->data = NULL;
+	image->size = 0;
+	data = malloc(FLASH_IMAGE_MAX_SIZE);
+	if (data == NULL) {
+		printf("Unable to get a buffer to load the image!\n");
+		return -4;
+	}
+	size = isp_file_to_buff(data, FLASH_IMAGE_MAX_SIZE, filename);
+	if (size <= 0) {
+		free(data);
+		return -5;
+	}
+	if (size == FLASH_IMAGE_MAX_SIZE) {
+		printf("Image too big, more than %d bytes.\n", FLASH_IMAGE_MAX_SIZE);
+		free(data);
+		return -7;
+	}
+	/* Only keep what we need */
+	image->data = realloc(data, size);
+	if (image->data == NULL) {
+		image->data = data;
+	}
+	image->size = size;
+	return 0;
+}
+
+void flash_image_free(struct flash_image* image)
+{
+	free(image->data);
+	image->data = NULL;
+	image->size = 0;
+}
+
+int flash_target(struct isp_transport* t, struct part_desc* part, struct flash_image* image, int calc_user_code, int mode)
+{
+	int ret = 0;
+	char* data = NULL;
+	char* dirty = NULL; /* Sectors to erase and program, one char per sector */
+	char* blank = NULL; /* Blank sectors, one char per sector */
+	int size = 0;
 	int i = 0, blocks = 0;
+	int last_sector = 0;
+	uint32_t end = 0; /* End of the image, rounded up to the write size of its last sector */
+	uint32_t offset = 0;
 	unsigned int write_size = 0;
-	unsigned int sector_size = (part->flash_size / part->flash_nb_sectors);
 	uint32_t ram_addr = (part->ram_base + part->ram_buff_offset);
 	uint32_t uuencode = part->uuencode;
 	uint32_t* v = NULL; /* Used for checksum computing */
@@ -200,38 +633,40 @@ int flash_target(struct part_desc* part, char* filename, int calc_user_code)
 
 	/**  Sanity checks  *********************************/
 	/* RAM buffer address within RAM */
-	if (ram_addr > (part->ram_base + part->ram_size)) {
+	if ((part->ram_buff_offset + part_ram_buff_size(part)) > part->ram_size) {
 		printf("Invalid configuration, asked to use buffer out of RAM, aborting.\n");
 		return -1;
 	}
-	/* Calc write block size */
-	write_size = calc_write_size(sector_size, part->ram_buff_size);
-	if (write_size == 0) {
-		printf("Config error, I cannot flash using blocks of nul size !\nAborted.\n");
-		return -2;
-	}
-
-	/* Just make sure flash is erased */
-	ret = erase_flash(part);
-	if (ret != 0) {
-		printf("Unable to erase device, aborting.\n");
-		return -3;
+	/* Check write block size of each sector */
+	for (i = 0; i < (int)part->flash_nb_sectors; i++) {
+		write_size = sector_write_size(part, i);
+		if ((write_size == 0) || ((part_sector_size(part, i) % write_size) != 0)) {
+			printf("Config error, I cannot flash sector %d using blocks of %d bytes !\nAborted.\n",
+					i, write_size);
+			return -2;
+		}
 	}
-
 	/* Allocate a buffer as big as the flash */
 	data = malloc(part->flash_size);
-	if (data == NULL) {
+	dirty = malloc(part->flash_nb_sectors);
+	blank = malloc(part->flash_nb_sectors);
+	if ((data == NULL) || (dirty == NULL) || (blank == NULL)) {
 		printf("Unable to get a buffer to load the image!");
-		return -4;
+		ret = -4;
+		goto out;
 	}
 	/* And fill the buffer with the image */
-	size = isp_file_to_buff(data, part->flash_size, filename);
-	if (size <= 0){
-		free(data);
-		return -5;
+	size = image->size;
+	if (size > (int)part->flash_size) {
+		printf("Config error, I cannot flash beyond end of flash !\n");
+		printf("Flash size : %d, trying to flash %d bytes\n", part->flash_size, size);
+		ret = -7;
+		goto out;
 	}
-	/* Fill unused buffer with 0's so we can flash blocks of data of "write_size" */
-	memset(&data[size], 0, (part->flash_size - size));
+	memcpy(data, image->data, size);
+	/* Fill unused buffer with erased state so we can flash whole blocks of data, and
+	 * compare whole sectors */
+	memset(&data[size], 0xFF, (part->flash_size - size));
 	/* And check checksum of first 7 vectors if asked, according to section 21.3.3 of
 	 * LPC11xx user's manual (UM10398) */
 	v = (uint32_t *)data;
@@ -240,8 +675,8 @@ int flash_target(struct part_desc* part, char* filename, int calc_user_code)
 		v[7] = cksum;
 	} else if (cksum != v[7]) {
 		printf("Checksum is 0x%08x, should be 0x%08x\n", v[7], cksum);
-		free(data);
-		return -5;
+		ret = -5;
+		goto out;
 	}
 	printf("Checksum check OK\n");
 
@@ -252,51 +687,101 @@ int flash_target(struct part_desc* part, char* filename, int calc_user_code)
 		printf("Check the licence for the software you are using, and if this is allowed,\n");
 		printf(" then modify this software to allow flashing of code with CRP protection\n");
 		printf(" activated. (Or use another software).\n");
-		return -6;
+		ret = -6;
+		goto out;
 	}
 
-	blocks = (size / write_size) + ((size % write_size) ? 1 : 0);
 	/* Gonna write out of flash ? */
-	if ((blocks * write_size) > part->flash_size) {
+	last_sector = part_offset_to_sector(part, (size - 1));
+	if (last_sector < 0) {
 		printf("Config error, I cannot flash beyond end of flash !\n");
-		printf("Flash size : %d, trying to flash %d blocks of %d bytes : %d\n",
-				part->flash_size, blocks, write_size, (blocks * write_size));
-		free(data);
-		return -7;
+		printf("Flash size : %d, trying to flash %d bytes\n", part->flash_size, size);
+		ret = -7;
+		goto out;
+	}
+	write_size = sector_write_size(part, last_sector);
+	end = part_sector_start(part, last_sector);
+	end += (((size - end) + write_size - 1) / write_size) * write_size;
+	printf("Flash size : %d, trying to flash %d bytes (%d sectors)\n",
+			part->flash_size, end, (last_sector + 1));
+
+	if (mode == FLASH_FULL) {
+		/* Erase and program all the sectors covered by the image */
+		for (i = 0; i < (int)part->flash_nb_sectors; i++) {
+			dirty[i] = (i <= last_sector);
+		}
+		/* Sectors after the image are kept, never erase the whole flash */
+		ret = erase_sectors(t, part, dirty, NULL, 0);
+		if (ret != 0) {
+			printf("Unable to erase device, aborting.\n");
+			ret = -3;
+			goto out;
+		}
+	} else {
+		ret = delta_scan(t, part, data, end, dirty, blank, mode);
+		if (ret < 0) {
+			printf("Unable to compare flash content with the image, aborting.\n");
+			goto out;
+		}
+		printf("%d sector(s) to update.\n", ret);
+		/* Other sectors hold valid data, they must not be erased */
+		ret = erase_sectors(t, part, dirty, blank, 0);
+		if (ret != 0) {
+			printf("Unable to erase device, aborting.\n");
+			ret = -3;
+			goto out;
+		}
 	}
-	printf("Flash size : %d, trying to flash %d blocks of %d bytes : %d\n",
-			part->flash_size, blocks, write_size, (blocks * write_size));
 
-	/* Now flash the device */
-	printf("Writing started, %d blocks of %d bytes ...\n", blocks, write_size);
-	for (i=0; i<blocks; i++) {
-		unsigned int current_sector = (i * write_size) / sector_size;
-		uint32_t flash_addr = part->flash_base + (i * write_size);
+	/* Copy to flash needs the device unlocked, even when nothing had to be erased */
+	ret = isp_cmd_unlock(t, 1);
+	if (ret != 0) {
+		printf("Unable to unlock device, aborting.\n");
+		ret = -1;
+		goto out;
+	}
+
+	/* Now flash the device, by blocks of the write size of each sector */
+	printf("Writing started ...\n");
+	for (offset = 0; offset < end; offset += write_size) {
+		int current_sector = part_offset_to_sector(part, offset);
+		uint32_t flash_addr = part->flash_base + offset;
+		write_size = sector_write_size(part, current_sector);
+		if (dirty[current_sector] == 0) {
+			continue;
+		}
+		/* Erased flash already holds this block */
+		if (block_is_blank(&data[offset], write_size)) {
+			continue;
+		}
 		/* Prepare sector for writting (must be done before each write) */
-		ret = isp_send_cmd_sectors("prepare-for-write", 'P', current_sector, current_sector, 1);
+		ret = isp_send_cmd_sectors(t, "prepare-for-write", 'P', current_sector, current_sector, 1);
 		if (ret != 0) {
-			printf("Error (%d) when trying to prepare sector %d for erase operation!\n", ret, i);
-			free(data);
-			return ret;
+			printf("Error (%d) when trying to prepare sector %d for write operation!\n", ret, current_sector);
+			ret = -9;
+			goto out;
 		}
 		/* Send data to RAM */
-		ret = isp_send_buf_to_ram(&data[i * write_size], ram_addr, write_size, uuencode);
+		ret = isp_send_buf_to_ram(t, &data[offset], ram_addr, write_size, uuencode);
 		if (ret != 0) {
-			printf("Unable to perform write-to-ram operation for block %d (block size: %d)\n",
-					i, write_size);
-			free(data);
-			return ret;
+			printf("Unable to perform write-to-ram operation for block at 0x%08x (block size: %d)\n",
+					offset, write_size);
+			goto out;
 		}
 		/* Copy from RAM to FLASH */
-		ret = isp_send_cmd_address('C', flash_addr, ram_addr, write_size, "write_to_ram");
+		ret = isp_send_cmd_address(t, 'C', flash_addr, ram_addr, write_size, "write_to_ram");
 		if (ret != 0) {
-			printf("Unable to copy data to flash for block %d (block size: %d)\n", i, write_size);
-			free(data);
-			return ret;
+			printf("Unable to copy data to flash for block at 0x%08x (block size: %d)\n", offset, write_size);
+			ret = -10;
+			goto out;
 		}
+		blocks++;
 	}
+	printf("%d blocks written.\n", blocks);
 
+out:
+	free(blank);
+	free(dirty);
 	free(data);
 	return ret;
 }
-
@@ -24,16 +24,36 @@
 #define ISP_CMDS_FLASH_H
 
 #include "parts.h"
+#include "isp_transport.h"
 
-int dump_to_file(struct part_desc* part, char* filename);
+/* Step up the link speed while RAM round trips need no resend.
+ * Returns the selected baudrate, or a negative value if the target has been lost. */
+int negotiate_baudrate(struct isp_transport* t, struct part_desc* part, unsigned int max_baudrate);
 
-int erase_flash(struct part_desc* part);
+int dump_to_file(struct isp_transport* t, struct part_desc* part, char* filename);
 
-int flash_target(struct part_desc* part, char* filename, int check_user_code);
+int erase_flash(struct isp_transport* t, struct part_desc* part);
 
-int get_ids(void);
+/* flash_target() modes */
+#define FLASH_FULL  0 /* Erase and program the sectors covered by the image */
+#define FLASH_DELTA_READ  1 /* Only erase and program sectors which differ, found by readback */
+#define FLASH_DELTA_COMPARE  2 /* Same, using the ISP compare command */
 
-int start_prog(struct part_desc* part);
+/* Image to flash, loaded once and used for all targets */
+struct flash_image {
+	char* data;
+	int size;
+};
+#define FLASH_IMAGE_MAX_SIZE  (16 * 1024 * 1024)
+
+int flash_image_load(struct flash_image* image, char* filename);
+void flash_image_free(struct flash_image* image);
+
+int flash_target(struct isp_transport* t, struct part_desc* part, struct flash_image* image, int check_user_code, int mode);
+
+int get_ids(struct isp_transport* t);
+
+int start_prog(struct isp_transport* t, struct part_desc* part);
 
 
 #endif /* ISP_CMDS_FLASH_H */